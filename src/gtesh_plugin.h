@@ -0,0 +1,62 @@
+// gtesh_plugin.h - ABI para comandos internos cargados con el builtin 'load'
+//
+// Un plugin es una biblioteca compartida que exporta gtesh_plugin_init().
+// El shell la llama al cargarla ('load ./libfoo.so') y el plugin registra
+// sus comandos con host->register_cmd(). Cada comando corre dentro del
+// shell (sin fork/exec) como un job más: '>', 'time', --stats y & funcionan
+// igual que con un programa externo (con --keep-order o --tag corre en un
+// hijo creado con fork, para capturar su salida). Con 'load -i' (o
+// GTESH_CMD_ISOLATED) el comando corre en un proceso worker ya creado, así
+// que si el plugin falla (segfault, abort) sólo muere el worker y el shell sigue.
+//
+// Compilar:  gcc -shared -fPIC -Isrc -o libfoo.so foo.c
+//
+// Ejemplo:
+//   static int cmd_hola(int argc, char **argv, gtesh_ctx_t *ctx) {
+//       dprintf(ctx->out_fd, "hola %s\n", argc > 1 ? argv[1] : "mundo");
+//       return 0;
+//   }
+//   int gtesh_plugin_init(const gtesh_host_t *host) {
+//       if (host->abi != GTESH_PLUGIN_ABI) return -1;
+//       return host->register_cmd("hola", cmd_hola, 0);
+//   }
+
+#ifndef GTESH_PLUGIN_H
+#define GTESH_PLUGIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define GTESH_PLUGIN_ABI 1      // Cambia sólo si se rompe la compatibilidad
+#define GTESH_PLUGIN_INIT_SYM "gtesh_plugin_init"
+
+// Contexto de una ejecución: lo que el comando puede usar del shell
+typedef struct gtesh_ctx {
+    uint32_t abi;       // GTESH_PLUGIN_ABI del shell
+    int in_fd;          // stdin del comando
+    int out_fd;         // stdout (el archivo de '>' si hay redirección)
+    int err_fd;         // stderr (también el archivo de '>')
+    // Memoria de la arena del shell: se libera sola al terminar el comando
+    void *(*alloc)(struct gtesh_ctx *ctx, size_t size);
+    void *priv;         // Uso interno del shell
+} gtesh_ctx_t;
+
+// Un comando. argv[0] es su nombre y argv[argc] es NULL; el plugin no debe
+// cerrar los fds del contexto. Retorna: estado de salida (0-255)
+typedef int (*gtesh_cmd_fn)(int argc, char **argv, gtesh_ctx_t *ctx);
+
+#define GTESH_CMD_ISOLATED 0x1u  // Correr siempre en el worker aislado
+
+// Servicios del shell, válidos sólo durante gtesh_plugin_init()
+typedef struct gtesh_host {
+    uint32_t abi;       // GTESH_PLUGIN_ABI del shell
+    // Registrar un comando (el nombre se copia). Retorna: 0, o -1 si el
+    // nombre no es válido o ya existe (builtin, utilidad u otro plugin)
+    int (*register_cmd)(const char *name, gtesh_cmd_fn fn, uint32_t flags);
+} gtesh_host_t;
+
+// Punto de entrada que exporta el plugin. Retorna: 0 si se cargó bien
+// (si falla, sus comandos se descartan)
+int gtesh_plugin_init(const gtesh_host_t *host);
+
+#endif
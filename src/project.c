@@ -7,50 +7,620 @@
 #include <sys/wait.h>   // wait, waitpid
 #include <sys/types.h>  // pid_t, size_t
 #include <sys/stat.h>   
+#include <sys/mman.h>   // mmap, madvise: lectura del archivo batch
+#include <sys/uio.h>    // splice (con _GNU_SOURCE, vía fcntl.h)
+#include <sys/resource.h>  // struct rusage, wait4
+#include <sys/time.h>   // timeradd
+#include <sched.h>      // sched_setaffinity, cpu_set_t: colocación de los hijos
+#include <sys/sendfile.h>  // sendfile: emitir salida capturada que se volcó a disco
 #include <fcntl.h>      // open, O_WRONLY, O_CREAT, O_TRUNC
 #include <errno.h>
+#include <signal.h>     // sigaction (SIGUSR1 para volcar las trazas)
+#include <stdint.h>     // uint32_t
+#include <time.h>       // clock_gettime, struct timespec
+#include <spawn.h>      // posix_spawn, posix_spawn_file_actions_*
+#include <getopt.h>     // getopt_long: opciones de línea de comandos
+#include <sys/epoll.h>  // epoll: esperar a varios hijos a la vez
+#include <poll.h>       // poll: ¿respondió el worker de plugins?
+#include <sys/syscall.h>  // SYS_pidfd_open
+#include <sys/socket.h>   // socket, sendmsg/recvmsg (SCM_RIGHTS): modo servidor
+#include <sys/un.h>       // struct sockaddr_un
+#include <dirent.h>       // opendir/readdir: tamaño y desalojo de la caché de resultados
+#include <limits.h>       // PATH_MAX, NAME_MAX: expansión de comodines
+#include <malloc.h>       // malloc_usable_size: reutilizar el buffer de un directorio
+#include <glob.h>         // glob(3): referencia en el benchmark de comodines
+#include <ftw.h>          // nftw: 'rm -r' dentro del shell
+#include <sys/timerfd.h>  // timerfd: 'sleep' dentro del shell sin bloquear
+#include <sys/inotify.h>  // inotify: cambios en los directorios del PATH
+#include <sys/signalfd.h> // signalfd: SIGCHLD de jobs detenidos/continuados en el epoll
+#include <termios.h>      // tcsetpgrp, tcgetattr: terminal del job en primer plano
+#include <dlfcn.h>        // dlopen/dlsym: plugins del builtin 'load'
 #include <readline/readline.h>  // readline: edición interactiva de línea
 #include <readline/history.h>   // add_history: historial de comandos      
+#include "gtesh_plugin.h"       // ABI de los plugins (load)
 
 // Constantes del programa
 #define MAX_PATH_DIRS 256       // Máximo número de directorios en PATH
-#define MAX_PARALLEL_CMDS 64    // Máximo número de comandos paralelos con &
+#define EV_MAX_EVENTS 64        // Eventos procesados por cada epoll_wait
+#define SPLICE_CHUNK (1 << 20)  // Bytes movidos por cada splice() en modo --splice
+#define WATCHDOG_GRACE_NS 2000000000LL  // Tras el SIGTERM de un timeout, espera antes de SIGKILL
+#define POLL_CHILD_MS 10  // Hijos sin pidfd propio: cada cuánto revisarlos con wait4(WNOHANG)
+#define CAPTURE_READ_SIZE (64 << 10)         // Espacio libre mínimo por read() de captura
+#define CAPTURE_DEFAULT_BUDGET (64UL << 20)  // Memoria para salida capturada antes de ir a disco
+#define ARENA_CHUNK_SIZE 16384  // Tamaño de cada bloque de la arena por línea
+#define BATCH_READ_SIZE (1 << 20)           // Buffer inicial de lectura para pipes/stdin (1 MiB)
+#define BATCH_RELEASE_BYTES (64UL << 20)    // Liberar páginas ya procesadas cada 64 MiB
+#define HASH_INITIAL_CAP 64     // Capacidad inicial de la caché de ejecutables (potencia de 2)
 #define PROMPT "\033[35mgtesh>\033[0m "        // Prompt en morado
 #define ERROR_MSG "\033[31mAn error has occurred\033[0m\n"  // Mensaje de error en rojo
 
 // Estructura para representar un comando individual
-typedef struct {
+// Un pipeline "a | b | c" es una lista de cmd_t enlazada por pipe_next; el
+// primero representa a todo el pipeline (is_background) y sólo el último
+// puede tener redir_file
+typedef struct cmd {
     char **argv;           // Array de argumentos (NULL-terminated), ej: ["ls", "-la", NULL]
     char *redir_file;      // Nombre del archivo de redirección (NULL si no hay >)
     int is_background;     // 1 si el comando es parte de una cadena paralela (&)
+    struct cmd *pipe_next; // Siguiente etapa del pipeline (NULL si es la última)
+    int index;             // Posición del comando dentro de la línea (0, 1, ...)
+    int timed;             // Prefijo 'time': reportar tiempos al terminar
+    int cached;            // Prefijo 'cache': usar la caché de resultados (--cache)
+    long long timeout_ns;  // Prefijo 'timeout N' o --timeout (0 = sin límite)
 } cmd_t;
 
+// Tipos de fuente de eventos registradas en el epoll del shell
+// Cada estructura registrada empieza con ev_source_t (epoll_event.data.ptr)
+typedef enum {
+    EV_CHILD,      // pidfd de un hijo: se vuelve legible cuando el hijo termina
+    EV_SPLICE,     // pipe de salida de un job en modo --splice
+    EV_CAPTURE,    // pipe de stdout/stderr de un job en modo --keep-order / --tag
+    EV_SLEEP,      // timerfd de un 'sleep' ejecutado dentro del shell
+    EV_SIGCHLD,    // signalfd de SIGCHLD: un job se detuvo o continuó (modo interactivo)
+    EV_WATCHDOG,   // timerfd del watchdog: venció el plazo del primer job (timeout)
+    EV_PLUGIN      // socket del worker de plugins: llegó la respuesta (o el worker murió)
+} ev_type_t;
+
+typedef struct {
+    ev_type_t type;
+} ev_source_t;
+
+struct job;
+
+// Un proceso hijo (una etapa de un pipeline)
+typedef struct {
+    ev_source_t ev;        // Debe ser el primer campo (ver ev_source_t)
+    pid_t pid;
+    int pidfd;             // -1 si pidfd_open no está disponible
+    int polled;            // Sin pidfd propio (EMFILE, epoll): se revisa con wait4(pid, WNOHANG)
+    struct job *job;       // Job al que pertenece
+} proc_t;
+
+// Salida de un job movida con splice(): pipe del hijo -> archivo de '>'
+typedef struct {
+    ev_source_t ev;        // Debe ser el primer campo (ver ev_source_t)
+    int pipe_fd;           // Extremo de lectura del pipe (-1 si no se usa)
+    int file_fd;           // Archivo de redirección abierto por el shell
+    struct job *job;
+} splice_src_t;
+
+// Timer de un 'sleep' dentro del shell (ver inproc_try)
+typedef struct {
+    ev_source_t ev;        // Debe ser el primer campo (ver ev_source_t)
+    int fd;                // timerfd (-1 si no se usa)
+    struct job *job;
+} sleep_src_t;
+
+// Salida capturada de un job: en memoria o, pasado el presupuesto, en disco
+typedef struct {
+    char *data;            // NULL una vez volcado a disco
+    size_t len, cap;
+    int spill_fd;          // Archivo temporal (-1 mientras esté en memoria)
+} outbuf_t;
+
+// Salida de un job pendiente de emitir (cola en orden de los comandos)
+typedef struct out_entry {
+    outbuf_t out, err;     // stdout y stderr del job
+    char *tag;             // Prefijo de cada línea con --tag (NULL si no)
+    int done;              // 1 cuando el job terminó y su salida está completa
+    struct out_entry *next;
+} out_entry_t;
+
+// Pipe de captura (stdout o stderr de un job) registrado en el epoll
+typedef struct {
+    ev_source_t ev;        // Debe ser el primer campo (ver ev_source_t)
+    int pipe_fd;           // Extremo de lectura (-1 si no se usa)
+    outbuf_t *buf;         // Dónde se acumula lo leído
+    struct job *job;
+} capture_src_t;
+
+// Clave de la caché de resultados (FNV-1a de 128 bits, ver cache_key)
+typedef unsigned __int128 cache_key_t;
+typedef enum { CACHE_NONE, CACHE_MISS, CACHE_HIT } cache_state_t;
+
+// Un comando (o pipeline) en ejecución: ocupa un slot de jobs_limit
+typedef struct job {
+    cmd_t *cmd;
+    proc_t *procs;         // Una entrada por etapa
+    int proc_cap;          // Capacidad de procs (se reutiliza entre jobs)
+    int nprocs;            // Etapas lanzadas
+    int live;              // Procesos + salidas (splice/captura) que aún no terminan
+    int status;            // Estado de la última etapa (wait4)
+    unsigned long line_no; // Línea del batch (o del modo interactivo) que lo lanzó
+    long long start_ns;    // Momento del lanzamiento (CLOCK_MONOTONIC)
+    struct rusage ru;      // Recursos consumidos, sumados entre etapas (wait4)
+    splice_src_t out;
+    capture_src_t cap_out, cap_err;  // Captura con --keep-order / --tag
+    sleep_src_t sleep;     // 'sleep' dentro del shell (el job no tiene procesos)
+    out_entry_t *entry;    // Salida capturada (NULL si el job no captura)
+    cache_state_t cache;   // Prefijo 'cache': acierto (sin procesos) o fallo a guardar
+    cache_key_t cache_key;
+    struct batch_line *line;  // Línea del batch dueña del job (--parallel-batch)
+    pid_t pgid;            // Grupo de procesos del job (0 = el del shell)
+    long long deadline_ns; // Próximo plazo del watchdog (SIGTERM, luego SIGKILL)
+    int wd_index;          // Posición en el heap del watchdog (-1 = no vigilado)
+    int timed_out;         // 1 = se envió SIGTERM por timeout, 2 = SIGKILL
+    struct job *prev, *next;  // Lista de jobs en ejecución
+} job_t;
+
 // Variables globales para el PATH del shell
 // path_dirs: Array dinámico de strings, cada uno es un directorio
 // path_count: Número de directorios actuales en el PATH
 static char **path_dirs = NULL;
 static size_t path_count = 0;
 
+// Estado por directorio del PATH (mismo índice que path_dirs)
+// fd: descriptor O_PATH pre-abierto para buscar con faccessat() sin armar rutas
+// mtime: última modificación observada (sin inotify); si cambia, se invalida
+// wd: watch de inotify del directorio o, si no existe, de su ancestro más cercano
+typedef struct {
+    int fd;                    // -1 si el directorio no se pudo abrir (ej: no existe)
+    struct timespec mtime;
+    int wd;                    // -1 sin watch
+} path_dir_state_t;
+
+static path_dir_state_t *path_state = NULL;
+// inotify sobre los directorios del PATH: un hit de la caché se valida con un
+// solo read() no bloqueante (EAGAIN = nada cambió). -1 si no está disponible
+// (entonces se compara el mtime de cada directorio y se confirma con faccessat)
+static int path_inotify_fd = -1;
+
+// Entrada de la caché de ejecutables: comando -> ruta completa
+typedef struct {
+    char *name;            // Nombre del comando (clave); NULL = slot vacío
+    char *path;            // Ruta completa, ej: "/bin/ls"
+    size_t dir;            // Índice en path_dirs del directorio donde está
+    uint32_t hash;         // Hash de name (evita recalcularlo al crecer la tabla)
+    unsigned long hits;    // Veces que se resolvió desde la caché
+} hash_entry_t;
+
+// Tabla hash de direccionamiento abierto (sondeo lineal), estilo 'hash' de bash
+static hash_entry_t *hash_table = NULL;
+static size_t hash_cap = 0;     // Número de slots (potencia de 2)
+static size_t hash_used = 0;    // Slots ocupados
+static unsigned long hash_hits = 0;    // Búsquedas resueltas por la caché
+static unsigned long hash_misses = 0;  // Búsquedas que recorrieron el PATH
+
+// Backend para crear procesos hijos (se elige al arrancar con --spawn)
+// SPAWN_POSIX: posix_spawn(); glibc lo implementa con clone(CLONE_VM|CLONE_VFORK),
+//              así que no copia las tablas de páginas del shell
+// SPAWN_FORK:  fork() + dup2 + execv clásico (fallback)
+typedef enum {
+    SPAWN_POSIX,
+    SPAWN_FORK
+} spawn_backend_t;
+
+static spawn_backend_t spawn_backend = SPAWN_POSIX;
+
+// Planificador de comandos paralelos (estilo xargs -P)
+// jobs_limit: máximo de hijos simultáneos (-j N o builtin jobs-limit);
+//             por defecto el número de CPUs en línea
+static long jobs_limit = 0;
+static job_t *running_jobs = NULL;  // Lista de jobs en ejecución
+static long running_count = 0;
+static job_t *free_jobs = NULL;     // job_t ya usados, para reutilizar
+static int ev_epfd = -1;            // epoll donde se registran los pidfd
+static int pidfd_supported = 1;     // 0 si el kernel no tiene pidfd_open
+static int polled_count = 0;        // Hijos sin pidfd con pidfd_supported (ver proc_t.polled)
+static int splice_mode = 0;         // --splice: mover la salida de '>' con splice()
+static long long timeout_default_ns = 0;  // --timeout SECS (0 = sin límite)
+
+// Contabilidad de recursos por comando
+static unsigned long current_line_no = 0;  // Línea que se está ejecutando (desde 1)
+static FILE *stats_file = NULL;            // --stats FILE: un registro JSON por comando
+
+// Journal de avance del batch (--journal FILE / --resume)
+static const char *journal_path = NULL;
+static int journal_resume = 0;             // --resume: continuar donde quedó el journal
+static int journal_fd = -1;
+static int journal_state_dirty = 0;        // cd / path cambiaron el estado registrado
+
+// Captura de salida (--keep-order / --tag / --capture-mem)
+static int keep_order = 0;          // Emitir la salida en el orden de los comandos
+static int tag_output = 0;          // Prefijar cada línea con el comando
+static size_t capture_budget = CAPTURE_DEFAULT_BUDGET;
+static size_t capture_mem_used = 0; // Bytes reservados en buffers de captura
+static out_entry_t *out_head = NULL, *out_tail = NULL;  // Cola de salida pendiente
+
 // Función de utilidad para imprimir el mensaje de error único
 // Escribe en stderr (file descriptor 2)
 static void util_print_error(void) {
     write(STDERR_FILENO, ERROR_MSG, strlen(ERROR_MSG));
 }
 
-// Liberar toda la memoria asociada a un comando
-// Libera cada string en argv, el array argv, el nombre de archivo de redirección
-// y finalmente la estructura cmd_t misma
-static void free_command(cmd_t *cmd) {
-    if (!cmd) return;  // Si es NULL, no hay nada que liberar
-    if (cmd->argv) {
-        // Liberar cada argumento individualmente
-        for (int i = 0; cmd->argv[i]; i++) {
-            free(cmd->argv[i]);
+// ====== Arena por línea (asignador "bump") ======
+// Todo lo que produce el parser para una línea (cmd_t, argv, arrays) se
+// asigna aquí; los strings no se copian: argv apunta al buffer de la línea.
+// arena_reset() libera todo en O(1) tras wait_for_children(); los bloques
+// se conservan para reutilizarlos en la siguiente línea.
+typedef struct arena_chunk {
+    struct arena_chunk *next;  // Siguiente bloque (reutilizable tras reset)
+    size_t size;               // Bytes utilizables en data
+    char data[];
+} arena_chunk_t;
+
+typedef struct {
+    arena_chunk_t *head;   // Primer bloque de la cadena
+    arena_chunk_t *cur;    // Bloque donde se está asignando
+    size_t used;           // Bytes usados de cur
+} arena_t;
+
+// Una línea del batch en ejecución (modo --parallel-batch), o un job del
+// modo interactivo (control de jobs: jobs, fg, bg, wait)
+// Tiene su propia arena: la copia del texto, los cmd_t y argv viven ahí
+// hasta que terminan todos sus jobs
+typedef struct batch_line {
+    arena_t arena;
+    cmd_t **cmds;
+    int count;
+    int pending;             // Jobs lanzados que aún no terminan
+    int launched;            // Ya se lanzaron todos sus comandos
+    unsigned long line_no;
+    char *text;              // Texto original (en la arena), para 'jobs'
+    int job_id;              // Número de job [N] (0 = sin número)
+    unsigned long seq;       // Último uso: el mayor es el job actual (+)
+    pid_t pgid;              // Grupo de procesos de la línea (0 = aún ninguno)
+    int stopped;             // Algún proceso se detuvo (Ctrl+Z, SIGSTOP)
+    int foreground;          // El shell la espera: no se anuncia al terminar
+    int status;              // Estado del último comando que terminó
+    int pure;                // --parallel-batch: sólo escribe por '>' (ver batch_stage_pure)
+    char **reads, **writes;  // --parallel-batch: rutas canónicas que lee y que escribe por '>'
+    int nreads, nwrites;
+    int *statuses;           // --journal: salida de cada comando (-1 = no se lanzó)
+    size_t end;              // --journal: offset del batch donde empieza la siguiente
+    struct batch_line *prev, *next;
+} batch_line_t;
+
+static batch_line_t *current_batch_line = NULL;  // Línea a la que pertenecen los jobs nuevos
+static int parallel_batch = 0;                   // --parallel-batch
+
+// Control de jobs del modo interactivo: cada línea tiene su grupo de
+// procesos y el de primer plano recibe la terminal (Ctrl+C, Ctrl+Z)
+static int job_control = 0;        // Activo (terminal + pidfd)
+static pid_t shell_pgid = 0;
+static struct termios shell_tmodes;
+static ev_source_t sigchld_src = { EV_SIGCHLD };
+static int sigchld_fd = -1;
+
+static arena_t line_arena = {NULL, NULL, 0};
+static arena_t *parse_arena = &line_arena;  // Arena donde asigna el parser
+
+// Asignar n bytes alineados a 16 desde la arena
+// Retorna: puntero a la memoria (sin inicializar), o NULL si no hay memoria
+static void *arena_alloc(arena_t *a, size_t n) {
+    n = (n + 15) & ~(size_t)15;
+    if (a->cur && a->used + n <= a->cur->size) {  // Camino rápido
+        void *p = a->cur->data + a->used;
+        a->used += n;
+        return p;
+    }
+    // Pasar al siguiente bloque si ya existe y alcanza (reutilizado tras un reset)
+    arena_chunk_t *next = a->cur ? a->cur->next : a->head;
+    if (!next || next->size < n) {
+        // Alocar un bloque nuevo e insertarlo después de cur
+        size_t size = n > ARENA_CHUNK_SIZE ? n : ARENA_CHUNK_SIZE;
+        arena_chunk_t *chunk = malloc(sizeof(arena_chunk_t) + size);
+        if (!chunk) return NULL;
+        chunk->size = size;
+        chunk->next = next;
+        if (a->cur) {
+            a->cur->next = chunk;
+        } else {
+            a->head = chunk;
+        }
+        next = chunk;
+    }
+    a->cur = next;
+    a->used = n;
+    return next->data;
+}
+
+// Liberar en O(1) todo lo asignado (los bloques quedan para reutilizarse)
+static void arena_reset(arena_t *a) {
+    a->cur = NULL;
+    a->used = 0;
+}
+
+// Tiempo monotónico en nanosegundos (clock_gettime usa vDSO: no es syscall)
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Duración "1.5", "2m", "1h", "0.1d" (sufijo s/m/h/d, como sleep)
+// Retorna: segundos, o -1 si no es válida
+static double parse_duration(const char *s) {
+    char *end;
+    errno = 0;
+    double v = strtod(s, &end);
+    if (end == s || errno || v < 0 || v != v) return -1;
+    double unit = 1;
+    if (*end == 'm') unit = 60;
+    else if (*end == 'h') unit = 3600;
+    else if (*end == 'd') unit = 86400;
+    else if (*end != 's' && *end != '\0') return -1;
+    if (*end && end[1]) return -1;
+    return v * unit;
+}
+
+// ====== Trazas del camino crítico (--trace FILE) ======
+// Cada span (parseo, búsqueda en PATH, spawn, apertura de la redirección,
+// espera, vida de cada job) se guarda en un buffer circular en memoria sin
+// locks: el índice se reserva con una suma atómica y cada slot se publica
+// con su número de secuencia. El buffer es MAP_SHARED, así que los hijos
+// creados con fork() también registran su preparación antes del execv.
+// Se vuelca en formato Chrome/Perfetto (JSON) al salir o al recibir SIGUSR1.
+// Deshabilitado, cada punto de medición cuesta un branch predecible.
+#define TRACE_RING_SIZE (1 << 16)  // Eventos guardados (potencia de 2)
+
+typedef struct {
+    uint64_t seq;          // Índice + 1 cuando el slot está completo
+    const char *name;      // Siempre un literal (válido también en los hijos)
+    long long start_ns;
+    long long dur_ns;
+    int pid;               // Proceso que registró el evento
+    int tid;               // Pista en el visor (pid del hijo para los jobs)
+    long arg;
+} trace_event_t;
+
+typedef struct {
+    uint64_t head;         // Próximo índice a reservar (atómico)
+    trace_event_t events[TRACE_RING_SIZE];
+} trace_ring_t;
+
+static int trace_enabled = 0;
+static const char *trace_path = NULL;
+static trace_ring_t *trace_ring = NULL;
+static pid_t trace_owner = 0;   // Sólo el shell (no sus hijos) escribe el archivo
+static volatile sig_atomic_t trace_flush_requested = 0;
+
+// Marcar el inicio de un span (0 si las trazas están apagadas)
+#define TRACE_BEGIN() (__builtin_expect(trace_enabled, 0) ? now_ns() : 0)
+// Cerrar un span iniciado con TRACE_BEGIN
+#define TRACE_END(name, start, arg) do { \
+        if (__builtin_expect(trace_enabled, 0)) trace_record(name, start, now_ns() - (start), 0, arg); \
+    } while (0)
+
+// Registrar un evento completo en el buffer circular
+static void trace_record(const char *name, long long start_ns, long long dur_ns, int tid, long arg) {
+    uint64_t idx = __atomic_fetch_add(&trace_ring->head, 1, __ATOMIC_RELAXED);
+    trace_event_t *ev = &trace_ring->events[idx & (TRACE_RING_SIZE - 1)];
+    __atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);  // Slot en escritura
+    ev->name = name;
+    ev->start_ns = start_ns;
+    ev->dur_ns = dur_ns;
+    ev->pid = getpid();
+    ev->tid = tid ? tid : ev->pid;
+    ev->arg = arg;
+    __atomic_store_n(&ev->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+// Volcar el buffer al archivo de trazas (se reescribe completo cada vez)
+static void trace_flush(void) {
+    if (!trace_enabled || getpid() != trace_owner) return;
+    trace_flush_requested = 0;
+    FILE *out = fopen(trace_path, "we");
+    if (!out) {
+        util_print_error();
+        return;
+    }
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", out);
+    uint64_t head = __atomic_load_n(&trace_ring->head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+    int written = 0;
+    for (uint64_t i = first; i < head; i++) {
+        trace_event_t *ev = &trace_ring->events[i & (TRACE_RING_SIZE - 1)];
+        if (__atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE) != i + 1) continue;  // Incompleto
+        fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                     "\"pid\":%d,\"tid\":%d,\"args\":{\"arg\":%ld}}",
+                written++ ? ",\n" : "", ev->name, ev->start_ns / 1e3, ev->dur_ns / 1e3,
+                trace_owner, ev->tid, ev->arg);
+    }
+    fputs("\n]}\n", out);
+    fclose(out);
+}
+
+// SIGUSR1: pedir un volcado (se hace en el siguiente punto seguro del bucle)
+static void trace_sigusr1(int sig) {
+    (void)sig;
+    trace_flush_requested = 1;
+}
+
+// Activar las trazas hacia 'path': buffer compartido, volcado al salir y con SIGUSR1
+static void trace_init(const char *path) {
+    trace_ring = mmap(NULL, sizeof(trace_ring_t), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (trace_ring == MAP_FAILED) {
+        util_print_error();
+        exit(1);
+    }
+    trace_path = path;
+    trace_owner = getpid();
+    trace_enabled = 1;
+    atexit(trace_flush);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = trace_sigusr1;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);  // Sin SA_RESTART: despierta a epoll_wait
+}
+
+// Vaciar la caché de ejecutables (hash -r, cambio de PATH o de un directorio)
+static void hash_clear(void) {
+    for (size_t i = 0; i < hash_cap; i++) {
+        free(hash_table[i].name);
+        free(hash_table[i].path);
+        hash_table[i].name = NULL;
+        hash_table[i].path = NULL;
+    }
+    hash_used = 0;
+}
+
+static void hash_drop_from(size_t dir);
+static void hash_forget(const char *name, size_t dir);
+
+// Abrir (o reabrir) el descriptor del directorio i del PATH y guardar su mtime
+static void path_state_open(size_t i) {
+    path_dir_state_t *st = &path_state[i];
+    if (st->fd != -1) close(st->fd);
+    st->fd = open(path_dirs[i], O_PATH | O_DIRECTORY | O_CLOEXEC);
+    st->mtime.tv_sec = 0;
+    st->mtime.tv_nsec = 0;
+    struct stat sb;
+    if (st->fd != -1 && fstat(st->fd, &sb) == 0) {
+        st->mtime = sb.st_mtim;
+    }
+}
+
+// Vigilar con inotify el directorio i del PATH: archivos creados, borrados,
+// renombrados o con otros permisos, y el directorio mismo borrado o movido.
+// Si no existe, vigilar su ancestro más cercano para saber cuándo aparece.
+// IN_MASK_ADD: un mismo directorio puede ser del PATH y ancestro de otro
+// Retorna: 0, o -1 si no se pudo (ej: límite de watches)
+static int path_state_watch(size_t i) {
+    path_dir_state_t *st = &path_state[i];
+    if (st->fd != -1) {
+        st->wd = inotify_add_watch(path_inotify_fd, path_dirs[i],
+                                   IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB |
+                                   IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_MASK_ADD);
+        return st->wd == -1 ? -1 : 0;
+    }
+    char dir[PATH_MAX];
+    if (snprintf(dir, sizeof(dir), "%s", path_dirs[i]) >= (int)sizeof(dir)) return -1;
+    while (1) {
+        size_t len = strlen(dir);
+        while (len > 1 && dir[len - 1] == '/') dir[--len] = '\0';
+        char *slash = strrchr(dir, '/');
+        if (!slash) strcpy(dir, ".");  // "bin" -> "."
+        else if (slash == dir) dir[1] = '\0';  // "/opt" -> "/"
+        else *slash = '\0';
+        st->wd = inotify_add_watch(path_inotify_fd, dir,
+                                   IN_CREATE | IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR | IN_MASK_ADD);
+        if (st->wd != -1) return 0;
+        if ((errno != ENOENT && errno != ENOTDIR) || strcmp(dir, "/") == 0 || strcmp(dir, ".") == 0) {
+            return -1;
+        }
+    }
+}
+
+// Reconstruir path_state para el path_dirs actual (tras init_path/update_path)
+// Cerrar los fds anteriores, abrir los nuevos y vaciar la caché
+static void path_state_reset(size_t old_count) {
+    for (size_t i = 0; i < old_count; i++) {
+        if (path_state[i].fd != -1) close(path_state[i].fd);
+    }
+    free(path_state);
+    path_state = NULL;
+    hash_clear();
+    if (path_inotify_fd != -1) close(path_inotify_fd);
+    path_inotify_fd = -1;
+    if (path_count == 0) return;
+    path_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    path_state = calloc(path_count, sizeof(path_dir_state_t));
+    if (!path_state) {
+        util_print_error();
+        exit(1);
+    }
+    for (size_t i = 0; i < path_count; i++) {
+        path_state[i].fd = -1;
+        path_state[i].wd = -1;
+        path_state_open(i);
+        if (path_inotify_fd != -1 && path_state_watch(i) == -1) {
+            close(path_inotify_fd);  // Usar los mtime
+            path_inotify_fd = -1;
+        }
+    }
+}
+
+// Aplicar los eventos de inotify pendientes (casi siempre el read() da
+// EAGAIN). Un archivo NOMBRE creado, borrado o con otros permisos en el
+// directorio i sólo invalida la entrada de NOMBRE si salió de i o de un
+// directorio posterior; el directorio i borrado o movido, o uno que antes
+// no existía y apareció, invalida las entradas de i en adelante
+static void path_inotify_drain(void) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    size_t from = path_count;  // Primer directorio que cambió entero
+    int overflow = 0;
+    while ((n = read(path_inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n;) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) overflow = 1;  // Se perdieron eventos
+            for (size_t i = 0; i < path_count && !overflow; i++) {
+                path_dir_state_t *st = &path_state[i];
+                if (st->wd != ev->wd) continue;
+                if (st->fd == -1 || (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))) {
+                    // Cambió el directorio mismo (o su ancestro): reabrirlo
+                    int existed = st->fd != -1;
+                    path_state_open(i);
+                    if (path_state_watch(i) == -1) overflow = 1;
+                    if (existed || st->fd != -1) from = from < i ? from : i;
+                } else if (ev->len > 0) {
+                    hash_forget(ev->name, i);
+                }
+            }
+        }
+    }
+    if (overflow) path_state_reset(path_count);  // Reabrir dirs y watches (o usar los mtime)
+    else if (from < path_count) hash_drop_from(from);
+}
+
+// Sin inotify: comparar el mtime de los directorios 0..upto del PATH (los
+// que deciden un hit en upto) y reintentar los que no existían. Si el
+// directorio i cambió (se agregó, quitó o renombró un archivo) o apareció,
+// se invalidan las entradas de i en adelante
+static void path_state_poll(size_t upto) {
+    for (size_t i = 0; i <= upto && i < path_count; i++) {
+        path_dir_state_t *st = &path_state[i];
+        if (st->fd == -1) {
+            path_state_open(i);  // Reintentar: el directorio pudo crearse después
+            if (st->fd == -1) continue;
+        } else {
+            struct stat sb;
+            if (fstat(st->fd, &sb) == 0 &&
+                sb.st_mtim.tv_sec == st->mtime.tv_sec &&
+                sb.st_mtim.tv_nsec == st->mtime.tv_nsec) {
+                continue;
+            }
+            path_state_open(i);
+        }
+        hash_drop_from(i);
+        return;
+    }
+}
+
+// Tras un cd: los directorios relativos del PATH ahora apuntan a otro lugar
+// Reabrirlos (con sus watches) y vaciar la caché (sólo si hay alguno relativo)
+static void path_state_chdir(void) {
+    for (size_t i = 0; i < path_count; i++) {
+        if (path_dirs[i][0] != '/') {
+            path_state_reset(path_count);
+            return;
         }
-        free(cmd->argv);  // Liberar el array de punteros
     }
-    free(cmd->redir_file);  // Liberar el nombre del archivo (puede ser NULL)
-    free(cmd);  // Liberar la estructura principal
 }
 
 // Inicializar PATH con /bin al arrancar el shell
@@ -68,12 +638,15 @@ static void init_path(void) {
         exit(1);
     }
     path_count = 1;  // Ahora tenemos 1 directorio en el PATH
+    path_state_reset(0);  // Pre-abrir /bin para la caché de ejecutables
 }
 
 // Actualizar PATH con nuevos directorios (usado por el builtin 'path')
 // new_dirs: Array de strings con los nuevos directorios
 // count: Número de directorios en new_dirs (puede ser 0 para vaciar el PATH)
 static void update_path(char **new_dirs, size_t count) {
+    size_t old_count = path_count;
+
     // Liberar el PATH antiguo completamente
     for (size_t i = 0; i < path_count; i++) {
         free(path_dirs[i]);
@@ -84,6 +657,7 @@ static void update_path(char **new_dirs, size_t count) {
     if (count == 0) {
         path_dirs = NULL;
         path_count = 0;
+        path_state_reset(old_count);  // Cerrar fds y vaciar la caché
         return;
     }
 
@@ -108,11 +682,130 @@ static void update_path(char **new_dirs, size_t count) {
         }
     }
     path_count = count;  // Actualizar contador
+    path_state_reset(old_count);  // Abrir los nuevos dirs e invalidar la caché
+}
+
+// Hash FNV-1a de 32 bits para los nombres de comando
+static uint32_t hash_string(const char *str) {
+    uint32_t h = 2166136261u;
+    while (*str) {
+        h ^= (unsigned char)*str++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Buscar el slot de 'name' en la tabla: retorna el slot ocupado por name
+// o el primer slot vacío donde debería insertarse
+static hash_entry_t *hash_slot(const char *name, uint32_t h) {
+    size_t mask = hash_cap - 1;
+    for (size_t i = h & mask;; i = (i + 1) & mask) {
+        hash_entry_t *e = &hash_table[i];
+        if (!e->name) return e;
+        if (e->hash == h && strcmp(e->name, name) == 0) return e;
+    }
+}
+
+// Duplicar la capacidad de la tabla y reinsertar las entradas
+static int hash_grow(void) {
+    size_t old_cap = hash_cap;
+    hash_entry_t *old = hash_table;
+    size_t new_cap = old_cap ? old_cap * 2 : HASH_INITIAL_CAP;
+    hash_entry_t *table = calloc(new_cap, sizeof(hash_entry_t));
+    if (!table) return -1;
+    hash_table = table;
+    hash_cap = new_cap;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].name) *hash_slot(old[i].name, old[i].hash) = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+// Insertar comando -> ruta en la caché (toma posesión de 'path')
+static void hash_insert(const char *name, uint32_t h, char *path, size_t dir) {
+    // Mantener factor de carga <= 1/2 para que el sondeo sea corto
+    if ((hash_used + 1) * 2 > hash_cap && hash_grow() == -1) {
+        free(path);
+        return;  // Sin memoria: simplemente no se cachea
+    }
+    hash_entry_t *e = hash_slot(name, h);
+    e->name = strdup(name);
+    if (!e->name) {
+        free(path);
+        return;
+    }
+    e->path = path;
+    e->dir = dir;
+    e->hash = h;
+    e->hits = 0;
+    hash_used++;
+}
+
+// Quitar la entrada e de la tabla: las siguientes del mismo grupo se
+// corren hacia atrás para que el sondeo lineal las siga encontrando
+static void hash_remove(hash_entry_t *e) {
+    size_t mask = hash_cap - 1, i = (size_t)(e - hash_table);
+    free(e->name);
+    free(e->path);
+    for (size_t j = (i + 1) & mask; hash_table[j].name; j = (j + 1) & mask) {
+        size_t home = hash_table[j].hash & mask;
+        // ¿El slot libre i está entre el inicio de j y j? Entonces j se mueve
+        int movable = i <= j ? (home <= i || home > j) : (home <= i && home > j);
+        if (movable) {
+            hash_table[i] = hash_table[j];
+            i = j;
+        }
+    }
+    hash_table[i].name = NULL;
+    hash_table[i].path = NULL;
+    hash_used--;
+}
+
+// Olvidar 'name' si se encontró en el directorio 'dir' del PATH o después
+static void hash_forget(const char *name, size_t dir) {
+    if (hash_cap == 0) return;
+    hash_entry_t *e = hash_slot(name, hash_string(name));
+    if (e->name && e->dir >= dir) hash_remove(e);
+}
+
+// Olvidar las entradas encontradas en el directorio 'dir' del PATH o después
+static void hash_drop_from(size_t dir) {
+    if (dir == 0) {
+        hash_clear();
+        return;
+    }
+    for (size_t i = 0; i < hash_cap; i++) {
+        // hash_remove puede traer al slot i una entrada que todavía no se vio
+        while (hash_table[i].name && hash_table[i].dir >= dir) hash_remove(&hash_table[i]);
+    }
+}
+
+// Recorrer el PATH con faccessat() sobre los fds pre-abiertos (sin asprintf
+// por directorio); sólo se arma la ruta completa del directorio que coincide
+// *dir: índice del directorio donde se encontró (si no es NULL)
+static char *path_search(const char *cmd, size_t *dir) {
+    for (size_t i = 0; i < path_count; i++) {
+        if (path_state[i].fd == -1) continue;  // Directorio inexistente
+        // Verificar si el archivo existe y tiene permisos de ejecución (X_OK)
+        if (faccessat(path_state[i].fd, cmd, X_OK, 0) == 0) {
+            char *full_path = NULL;
+            // asprintf aloca memoria y formatea: "/bin" + "/" + "ls" = "/bin/ls"
+            if (asprintf(&full_path, "%s/%s", path_dirs[i], cmd) == -1) {
+                util_print_error();
+                return NULL;
+            }
+            if (dir) *dir = i;
+            return full_path;  // Encontrado! Retornar ruta completa
+        }
+    }
+    return NULL;  // No encontrado en ningún directorio del PATH
 }
 
 // Buscar un ejecutable en el PATH del shell
 // cmd: Nombre del comando (ej: "ls", "grep", "/bin/ls")
 // Retorna: Ruta completa al ejecutable si se encuentra, NULL si no
+// Las búsquedas en PATH se guardan en la caché (hash_table); los fallos no
 static char *find_executable(const char *cmd) {
     // Si el comando contiene '/', es una ruta (absoluta o relativa)
     // No buscar en PATH, usar directamente
@@ -123,363 +816,5835 @@ static char *find_executable(const char *cmd) {
         }
         return NULL;  // No existe o no es ejecutable
     }
+    if (path_count == 0) return NULL;  // PATH vacío: sólo builtins
 
-    // Buscar en cada directorio del PATH en orden
-    for (size_t i = 0; i < path_count; i++) {
-        char *full_path = NULL;
-        // asprintf aloca memoria y formatea: "/bin" + "/" + "ls" = "/bin/ls"
-        if (asprintf(&full_path, "%s/%s", path_dirs[i], cmd) == -1) {
-            util_print_error();
-            continue;  // Si falla asprintf, probar siguiente directorio
-        }
-        // Verificar si el archivo existe y tiene permisos de ejecución (X_OK)
-        if (access(full_path, X_OK) == 0) {
-            return full_path;  // Encontrado! Retornar ruta completa
+    uint32_t h = hash_string(cmd);
+    if (hash_cap > 0) {
+        hash_entry_t *e = hash_slot(cmd, h);
+        if (e->name) {
+            // Hit: aplicar antes los cambios de los directorios. Con inotify
+            // alcanza con sus eventos (IN_ATTRIB cubre chmod); sin él, los mtime
+            // hasta el directorio de la entrada y faccessat (chmod no cambia
+            // el mtime del directorio)
+            if (path_inotify_fd != -1) path_inotify_drain();
+            else path_state_poll(e->dir);
+            e = hash_slot(cmd, h);
+            if (e->name && path_inotify_fd == -1 &&
+                faccessat(path_state[e->dir].fd, cmd, X_OK, 0) != 0) {
+                hash_remove(e);  // Quedó vieja: buscar de nuevo
+            } else if (e->name) {
+                e->hits++;
+                hash_hits++;
+                return strdup(e->path);
+            }
         }
-        free(full_path);  // No encontrado aquí, liberar y continuar
     }
-    return NULL;  // No encontrado en ningún directorio del PATH
-}
 
-// Manejar comandos incorporados (builtins): exit, cd, path
-// Retorna: 1 si es un builtin (aunque falle), 0 si no es builtin
-static int handle_builtin(cmd_t *cmd) {
-    if (!cmd || !cmd->argv || !cmd->argv[0]) return 0;  // Validación
+    hash_misses++;
+    size_t dir;
+    char *full_path = path_search(cmd, &dir);
+    if (!full_path) return NULL;
+    char *cached = strdup(full_path);
+    if (cached) hash_insert(cmd, h, cached, dir);
+    return full_path;
+}
 
-    // Builtin: exit
-    // Debe invocarse sin argumentos, termina el shell con exit(0)
-    if (strcmp(cmd->argv[0], "exit") == 0) {
-        if (cmd->argv[1]) {  // Si hay argumentos después de exit -> error
+// Builtin: hash
+// hash            -> listar la caché (hits, comando y ruta de cada uno)
+// hash -r         -> vaciar la caché
+// hash -s         -> mostrar contadores de hits/misses
+// hash cmd1 ...   -> precargar los comandos indicados (error si alguno no existe)
+static void builtin_hash(char **args) {
+    if (!args[0]) {
+        printf("hits\tcommand\tpath\n");
+        for (size_t i = 0; i < hash_cap; i++) {
+            if (hash_table[i].name) {
+                printf("%4lu\t%s\t%s\n", hash_table[i].hits, hash_table[i].name, hash_table[i].path);
+            }
+        }
+        fflush(stdout);
+        return;
+    }
+    if (strcmp(args[0], "-r") == 0) {
+        if (args[1]) {
             util_print_error();
-            return 1;  // Es un builtin, pero con error
+            return;
         }
-        exit(0);  // Terminar el shell limpiamente
+        hash_clear();
+        return;
     }
-
-    // Builtin: cd
-    // Requiere EXACTAMENTE 1 argumento (el directorio destino)
-    if (strcmp(cmd->argv[0], "cd") == 0) {
-        if (!cmd->argv[1] || cmd->argv[2]) {  // 0 argumentos o más de 1 -> error
+    if (strcmp(args[0], "-s") == 0) {
+        if (args[1]) {
             util_print_error();
-            return 1;
+            return;
         }
-        // chdir() cambia el directorio de trabajo del proceso
-        if (chdir(cmd->argv[1]) != 0) {  // Si falla (ej: no existe)
+        unsigned long total = hash_hits + hash_misses;
+        printf("entries: %zu\nhits: %lu\nmisses: %lu\nhit rate: %.1f%%\n",
+               hash_used, hash_hits, hash_misses,
+               total ? 100.0 * hash_hits / total : 0.0);
+        fflush(stdout);
+        return;
+    }
+    // Precargar: cada nombre debe resolverse en el PATH
+    for (int i = 0; args[i]; i++) {
+        if (strchr(args[i], '/')) {  // Las rutas no se cachean
+            util_print_error();
+            continue;
+        }
+        char *exec_path = find_executable(args[i]);
+        if (!exec_path) {
             util_print_error();
+            continue;
         }
-        return 1;  // Es un builtin (retornamos 1 aunque falle chdir)
+        free(exec_path);
     }
+}
 
-    // Builtin: path
-    // Acepta 0 o más argumentos; reemplaza el PATH completo
-    if (strcmp(cmd->argv[0], "path") == 0) {
-        // Contar cuántos directorios se pasaron (argv[1], argv[2], ...)
-        int count = 0;
-        while (cmd->argv[count + 1]) count++;
-        // Actualizar PATH global; si count==0 se vacía el PATH
-        update_path(cmd->argv + 1, count);  // +1 para saltar "path"
-        return 1;
+// ====== Planificador de hijos (pidfd + epoll) ======
+
+static void batch_line_job_done(batch_line_t *bl);
+static int plugin_worker_reaped(pid_t pid, int status);
+static void jc_job_done(batch_line_t *bl);
+static void builtin_jobs(char **args);
+static void builtin_fg(char **args);
+static void builtin_bg(char **args);
+static void builtin_wait(char **args);
+static void out_entry_done(out_entry_t *entry);
+static void cache_store(cache_key_t key, const char *redir_file, int status);
+static void journal_note(const job_t *job);
+static void journal_seq_begin(int count);
+
+// Crear el epoll del shell y fijar el límite de jobs por defecto
+static void sched_init(void) {
+    if (jobs_limit <= 0) {
+        jobs_limit = sysconf(_SC_NPROCESSORS_ONLN);
+        if (jobs_limit < 1) jobs_limit = 1;
+    }
+    ev_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (ev_epfd == -1) {
+        util_print_error();
+        exit(1);
     }
+}
+
+// ====== Watchdog de timeouts (timeout N / --timeout) ======
+// Un solo timerfd para todos los jobs vigilados: un min-heap ordenado por
+// plazo y el timer armado (en tiempo absoluto) al plazo del primero. Al
+// vencer se envía SIGTERM al grupo de procesos del job y el plazo se corre
+// WATCHDOG_GRACE_NS; si vuelve a vencer, SIGKILL. Sin procesos ni hilos
+// auxiliares: el mismo epoll que recolecta los pidfd atiende el timer, y
+// cada alta/baja cuesta O(log n) aunque haya miles de jobs vigilados.
 
-    return 0;  // No es un builtin, debe ejecutarse como programa externo
+static job_t **wd_heap = NULL;
+static int wd_count = 0, wd_cap = 0;
+static ev_source_t wd_src = { EV_WATCHDOG };
+static int wd_fd = -1;
+
+static void wd_swap(int a, int b) {
+    job_t *tmp = wd_heap[a];
+    wd_heap[a] = wd_heap[b];
+    wd_heap[b] = tmp;
+    wd_heap[a]->wd_index = a;
+    wd_heap[b]->wd_index = b;
 }
 
-// Parsear una línea de comando en una estructura cmd_t
-// line: String con el comando (puede contener redirección >)
-// Retorna: cmd_t con argv y redir_file llenados, o NULL si hay error
-static cmd_t *parse_command(char *line) {
-    // Alocar estructura con calloc (inicializa todo a 0/NULL)
-    cmd_t *cmd = calloc(1, sizeof(cmd_t));
-    if (!cmd) {
-        util_print_error();
-        return NULL;
+// Reubicar la entrada i hacia arriba o hacia abajo hasta cumplir el heap
+static void wd_fix(int i) {
+    while (i > 0 && wd_heap[(i - 1) / 2]->deadline_ns > wd_heap[i]->deadline_ns) {
+        wd_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while (1) {
+        int min = i, l = 2 * i + 1, r = l + 1;
+        if (l < wd_count && wd_heap[l]->deadline_ns < wd_heap[min]->deadline_ns) min = l;
+        if (r < wd_count && wd_heap[r]->deadline_ns < wd_heap[min]->deadline_ns) min = r;
+        if (min == i) return;
+        wd_swap(i, min);
+        i = min;
     }
+}
 
-    // PASO 1: Separar comando de redirección (buscar '>')
-    char *cmd_part = line;  // Parte antes del '>'
-    char *redir_part = NULL;  // Parte después del '>'
-    char *gt_pos = strchr(line, '>');  // Buscar primer '>'
-    
-    if (gt_pos) {
-        // Verificar que hay algo (no sólo espacios) antes del '>'
-        char *tmp = line;
-        int has_command = 0;
-        while (tmp < gt_pos) {
-            if (*tmp != ' ' && *tmp != '\t') {
-                has_command = 1;
-                break;
-            }
-            tmp++;
+// Armar el timer al plazo más cercano (o desarmarlo si no queda ninguno)
+static void wd_rearm(void) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (wd_count > 0) {
+        long long d = wd_heap[0]->deadline_ns;
+        if (d < 1) d = 1;  // 0 desarmaría el timer
+        its.it_value.tv_sec = d / 1000000000LL;
+        its.it_value.tv_nsec = d % 1000000000LL;
+    }
+    timerfd_settime(wd_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+// Vigilar un job ya lanzado. Retorna: 0, o -1 (sin memoria/timerfd; el
+// job corre sin límite y se reporta el error)
+static int wd_add(job_t *job, long long timeout_ns) {
+    if (wd_fd == -1) {
+        wd_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &wd_src };
+        if (wd_fd == -1 || epoll_ctl(ev_epfd, EPOLL_CTL_ADD, wd_fd, &ev) == -1) {
+            if (wd_fd != -1) close(wd_fd);
+            wd_fd = -1;
+            return -1;
         }
-        if (!has_command) {
-            util_print_error();
-            free_command(cmd);
-            return NULL;
+    }
+    if (wd_count == wd_cap) {
+        int cap = wd_cap ? wd_cap * 2 : 64;
+        job_t **grown = realloc(wd_heap, cap * sizeof(job_t *));
+        if (!grown) return -1;
+        wd_heap = grown;
+        wd_cap = cap;
+    }
+    job->deadline_ns = job->start_ns + timeout_ns;
+    job->wd_index = wd_count;
+    wd_heap[wd_count++] = job;
+    wd_fix(job->wd_index);
+    if (wd_heap[0] == job) wd_rearm();  // Es el nuevo plazo más cercano
+    return 0;
+}
+
+// Dejar de vigilar un job (terminó, o ya recibió SIGKILL)
+static void wd_remove(job_t *job) {
+    int i = job->wd_index;
+    job->wd_index = -1;
+    wd_count--;
+    if (i != wd_count) {
+        wd_heap[i] = wd_heap[wd_count];
+        wd_heap[i]->wd_index = i;
+        wd_fix(i);
+    }
+    if (i == 0) wd_rearm();
+}
+
+// Enviar una señal a todo el job: a su grupo de procesos (así también la
+// reciben los nietos) o, si comparte el grupo del shell, a cada etapa
+static void wd_signal(job_t *job, int sig) {
+    if (job->pgid > 0) {
+        kill(-job->pgid, sig);
+        if (sig == SIGTERM) kill(-job->pgid, SIGCONT);  // Si estaba detenido
+        return;
+    }
+    for (int i = 0; i < job->nprocs; i++) {
+        if (job->procs[i].pidfd != -1) syscall(SYS_pidfd_send_signal, job->procs[i].pidfd, sig, NULL, 0);
+        else if (job->procs[i].polled) kill(job->procs[i].pid, sig);  // Aún no recolectado
+    }
+}
+
+// El timer venció: escalar todos los jobs cuyo plazo ya pasó
+static void wd_fire(void) {
+    uint64_t expirations;
+    while (read(wd_fd, &expirations, sizeof(expirations)) > 0);
+    long long now = now_ns();
+    while (wd_count > 0 && wd_heap[0]->deadline_ns <= now) {
+        job_t *job = wd_heap[0];
+        if (!job->timed_out) {
+            job->timed_out = 1;
+            wd_signal(job, SIGTERM);
+            job->deadline_ns = now + WATCHDOG_GRACE_NS;
+            wd_fix(0);
+        } else {
+            job->timed_out = 2;
+            wd_signal(job, SIGKILL);
+            wd_remove(job);
         }
+    }
+    wd_rearm();
+}
 
-        *gt_pos = '\0';  // Separar: reemplazar '>' con fin de string
-        redir_part = gt_pos + 1;  // Apuntar a lo que viene después del '>'
-        // Saltar espacios iniciales después del '>'
-        while (*redir_part == ' ' || *redir_part == '\t') redir_part++;
-        
-        // Verificar que sólo hay UN archivo después del '>'
-        char *next_token = strchr(redir_part, ' ');
-        char *next_gt = strchr(redir_part, '>');
-        if (!*redir_part || next_gt || (next_token && *(next_token+1) != '\0')) {
+// Crear un job para un comando con nstages etapas y agregarlo a la lista
+// de jobs en ejecución. Retorna: el job, o NULL si no hay memoria
+static job_t *job_new(cmd_t *cmd, int nstages) {
+    job_t *job = free_jobs;
+    if (job) {
+        free_jobs = job->next;
+    } else {
+        job = calloc(1, sizeof(job_t));
+        if (!job) {
             util_print_error();
-            free_command(cmd);
             return NULL;
         }
-        // Guardar nombre del archivo de redirección
-        cmd->redir_file = strdup(redir_part);
-        if (!cmd->redir_file) {
+    }
+    if (job->proc_cap < nstages) {
+        proc_t *procs = realloc(job->procs, nstages * sizeof(proc_t));
+        if (!procs) {
+            job->next = free_jobs;
+            free_jobs = job;
             util_print_error();
-            free_command(cmd);
             return NULL;
         }
-        // Eliminar espacios al final del nombre del archivo
-        char *end = cmd->redir_file + strlen(cmd->redir_file) - 1;
-        while (end > cmd->redir_file && (*end == ' ' || *end == '\t')) {
-            *end = '\0';
-            end--;
-        }
+        job->procs = procs;
+        job->proc_cap = nstages;
     }
+    job->cmd = cmd;
+    job->nprocs = 0;
+    job->live = 0;
+    job->status = 0;
+    job->line_no = current_line_no;
+    job->line = current_batch_line;
+    if (job->line) job->line->pending++;
+    job->pgid = 0;
+    job->wd_index = -1;
+    job->timed_out = 0;
+    job->start_ns = now_ns();
+    memset(&job->ru, 0, sizeof(job->ru));
+    job->out.ev.type = EV_SPLICE;
+    job->out.pipe_fd = -1;
+    job->out.file_fd = -1;
+    job->out.job = job;
+    job->cap_out.pipe_fd = job->cap_err.pipe_fd = -1;
+    job->entry = NULL;
+    job->cache = CACHE_NONE;
+    job->sleep.fd = -1;
 
-    // PASO 2: Contar tokens (palabras) en la parte del comando
-    // Necesitamos saber cuántos argumentos hay para alocar argv
-    int token_count = 0;
-    char *tmp = strdup(cmd_part);  // Copiar porque strtok modifica el string
-    if (!tmp) {
-        util_print_error();
-        free_command(cmd);
-        return NULL;
+    job->prev = NULL;
+    job->next = running_jobs;
+    if (running_jobs) running_jobs->prev = job;
+    running_jobs = job;
+    running_count++;
+    return job;
+}
+
+// Registrar un hijo recién creado como la siguiente etapa del job
+// Si el kernel no tiene pidfd_open, todo el shell pasa a wait4(-1); si sólo
+// falló para este hijo (EMFILE, epoll_ctl), se lo revisa por su PID
+static void job_add_proc(job_t *job, pid_t pid) {
+    proc_t *proc = &job->procs[job->nprocs++];
+    proc->ev.type = EV_CHILD;
+    proc->pid = pid;
+    proc->job = job;
+    proc->pidfd = -1;
+    proc->polled = 0;
+    job->live++;
+
+    if (!pidfd_supported) return;
+    proc->pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    if (proc->pidfd == -1 && errno == ENOSYS && polled_count == 0 && running_count <= 1) {
+        pidfd_supported = 0;  // Ningún hijo tiene pidfd: wait4(-1) sirve para todos
+        return;
     }
-    char *token = strtok(tmp, " \t");  // Separar por espacios y tabs
-    while (token) {
-        token_count++;
-        token = strtok(NULL, " \t");  // NULL indica "continuar con el string anterior"
+    if (proc->pidfd != -1) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = proc };
+        if (epoll_ctl(ev_epfd, EPOLL_CTL_ADD, proc->pidfd, &ev) == 0) return;
+        close(proc->pidfd);
+        proc->pidfd = -1;
     }
-    free(tmp);  // Liberar copia temporal
+    proc->polled = 1;
+    polled_count++;
+}
 
-    if (token_count == 0) {  // Línea vacía o sólo espacios
-        free_command(cmd);
-        return NULL;
-    }
+// Sacar un job terminado de la lista y devolverlo al pool
+static void job_release(job_t *job) {
+    if (job->wd_index != -1) wd_remove(job);
+    if (job->prev) job->prev->next = job->next;
+    else running_jobs = job->next;
+    if (job->next) job->next->prev = job->prev;
+    running_count--;
+    job->next = free_jobs;
+    free_jobs = job;
+}
 
-    // PASO 3: Alocar argv (array de punteros a string, terminado en NULL)
-    cmd->argv = calloc(token_count + 1, sizeof(char*));  // +1 para NULL final
-    if (!cmd->argv) {
-        util_print_error();
-        free_command(cmd);
-        return NULL;
-    }
+// Descartar un job que no lanzó ningún proceso (no se reporta)
+static void job_discard(job_t *job) {
+    batch_line_t *line = job->line;
+    job_release(job);
+    if (line) batch_line_job_done(line);
+}
 
-    // PASO 4: Llenar argv con los tokens (palabras del comando)
-    int i = 0;
-    token = strtok(cmd_part, " \t");  // Volver a tokenizar (ahora guardaremos)
-    while (token && i < token_count) {
-        cmd->argv[i] = strdup(token);  // Duplicar cada token
-        if (!cmd->argv[i]) {
-            util_print_error();
-            free_command(cmd);
-            return NULL;
+// Escribir el contenido de un string JSON (sin comillas), escapando '"',
+// '\' y los caracteres de control
+static void json_write_escaped(FILE *out, const char *str) {
+    for (const unsigned char *c = (const unsigned char *)str; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', out);
+            fputc(*c, out);
+        } else if (*c < 0x20) {
+            fprintf(out, "\\u%04x", *c);
+        } else {
+            fputc(*c, out);
         }
-        i++;
-        token = strtok(NULL, " \t");
     }
-    cmd->argv[i] = NULL;  // Terminar con NULL (requerido por execv)
-
-    return cmd;  // Retornar comando parseado exitosamente
 }
 
-// Dividir una línea en comandos paralelos (separados por '&')
-// Ejemplo: "ls & echo uno & pwd" -> ["ls", "echo uno", "pwd"]
-// line: Línea completa con posibles '&'
-// count: (salida) Número de comandos encontrados
-// Retorna: Array de cmd_t*, o NULL si hay error o no hay comandos
-static cmd_t **split_parallel_commands(char *line, int *count) {
-    *count = 0;
-    // Alocar espacio para hasta MAX_PARALLEL_CMDS comandos
-    cmd_t **cmds = malloc(MAX_PARALLEL_CMDS * sizeof(cmd_t*));
-    if (!cmds) {
-        util_print_error();
-        return NULL;
-    }
+// Milisegundos de un struct timeval
+static double timeval_ms(struct timeval tv) {
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
 
-    char *saveptr;  // Para strtok_r (versión reentrant de strtok)
-    // strtok_r divide por '&', saveptr guarda el estado
-    char *token = strtok_r(line, "&", &saveptr);
-    
-    while (token && *count < MAX_PARALLEL_CMDS) {
-        // Eliminar espacios al inicio y final de cada comando
-        while (*token == ' ' || *token == '\t') token++;
-        char *end = token + strlen(token) - 1;
-        while (end > token && (*end == ' ' || *end == '\t')) {
-            *end = '\0';
-            end--;
+// Registrar en --stats un job terminado: una línea JSON con el comando,
+// su estado de salida y los recursos que consumió
+static void stats_write(const job_t *job, long long wall_ns) {
+    FILE *out = stats_file;
+    fprintf(out, "{\"line\":%lu,\"index\":%d,\"cmd\":\"", job->line_no, job->cmd->index);
+    for (const cmd_t *st = job->cmd; st; st = st->pipe_next) {
+        for (int i = 0; st->argv[i]; i++) {
+            if (i > 0) fputc(' ', out);
+            json_write_escaped(out, st->argv[i]);
         }
-        
-        if (*token) {  // Ignorar tokens vacíos (ej: "ls & & pwd" tiene & vacío)
-            cmd_t *cmd = parse_command(token);  // Parsear este comando individual
-            if (cmd) {
-                cmd->is_background = 1;  // Marcar como background (se ajusta después)
-                cmds[*count] = cmd;
-                (*count)++;
-            }
+        if (st->pipe_next) {
+            fputs(" | ", out);
+        } else if (st->redir_file) {
+            fputs(" > ", out);
+            json_write_escaped(out, st->redir_file);
         }
-        
-        token = strtok_r(NULL, "&", &saveptr);  // Siguiente comando
     }
+    fputc('"', out);
+    if (WIFEXITED(job->status)) {
+        fprintf(out, ",\"exit\":%d,\"signal\":0", WEXITSTATUS(job->status));
+    } else {
+        fprintf(out, ",\"exit\":null,\"signal\":%d",
+                WIFSIGNALED(job->status) ? WTERMSIG(job->status) : 0);
+    }
+    if (job->cache != CACHE_NONE) {
+        fprintf(out, ",\"cache\":\"%s\"", job->cache == CACHE_HIT ? "hit" : "miss");
+    }
+    if (job->timed_out) {  // "SIGTERM" o "SIGKILL": la señal que lo terminó
+        fprintf(out, ",\"timeout\":\"%s\"", job->timed_out == 1 ? "SIGTERM" : "SIGKILL");
+    }
+    fprintf(out, ",\"pid\":%d,\"stages\":%d,\"wall_ms\":%.3f,\"user_ms\":%.3f,"
+                 "\"sys_ms\":%.3f,\"maxrss_kb\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld}\n",
+            job->nprocs ? job->procs[0].pid : -1, job->nprocs, wall_ns / 1e6,
+            timeval_ms(job->ru.ru_utime), timeval_ms(job->ru.ru_stime),
+            job->ru.ru_maxrss, job->ru.ru_nvcsw, job->ru.ru_nivcsw);
+}
 
-    if (*count == 0) {  // No se encontró ningún comando válido
-        free(cmds);
-        return NULL;
+// Reporte del prefijo 'time' (mismo formato que bash), en stderr
+static void print_time_report(long long wall_ns, const struct rusage *ru) {
+    const char *names[3] = { "real", "user", "sys" };
+    double secs[3] = {
+        wall_ns / 1e9,
+        ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6,
+        ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6
+    };
+    char buf[128];
+    int len = snprintf(buf, sizeof(buf), "\n");
+    for (int i = 0; i < 3; i++) {
+        int mins = (int)(secs[i] / 60);
+        len += snprintf(buf + len, sizeof(buf) - len, "%s\t%dm%.3fs\n",
+                        names[i], mins, secs[i] - mins * 60);
     }
+    write(STDERR_FILENO, buf, len);
+}
 
-    // Ajuste: el último comando NO es background SALVO que la línea termine en '&'
-    // Ejemplo: "ls & pwd" -> pwd NO es background (esperamos a que termine)
-    // Ejemplo: "ls & pwd &" -> pwd SÍ es background
-    if (*count > 0) {
-        cmds[*count - 1]->is_background = (line[strlen(line) - 1] == '&');
+// El job terminó por completo: reportar (time / --stats) y liberar su slot
+static void job_complete(job_t *job) {
+    long long wall_ns = now_ns() - job->start_ns;
+    if (job->timed_out) job->status = 124 << 8;  // Como timeout(1): exit 124
+    if (__builtin_expect(trace_enabled, 0)) {  // La vida del job, en la pista de su PID
+        trace_record("job", job->start_ns, wall_ns,
+                     job->nprocs ? job->procs[0].pid : 0, job->cmd->index);
     }
+    if (job->cmd->timed) print_time_report(wall_ns, &job->ru);
+    if (stats_file) stats_write(job, wall_ns);
+    if (journal_fd != -1) journal_note(job);
+    if (job->entry) out_entry_done(job->entry);  // --keep-order / --tag
+    if (job->cache == CACHE_MISS && WIFEXITED(job->status) && !job->timed_out) {
+        const cmd_t *last = job->cmd;
+        while (last->pipe_next) last = last->pipe_next;
+        cache_store(job->cache_key, last->redir_file, job->status);
+    }
+    batch_line_t *line = job->line;
+    if (line) line->status = job->status;
+    job_release(job);
+    if (line) batch_line_job_done(line);
+}
 
-    return cmds;
+// Una parte del job terminó (un proceso o la salida splice)
+// Cuando no queda ninguna, el job está completo
+static void job_part_done(job_t *job) {
+    if (--job->live == 0) job_complete(job);
 }
 
-// Ejecutar un comando (builtin o externo)
-// cmd: Comando parseado con argv, redir_file, is_background
-// Retorna: PID del proceso hijo (si es externo), 0 (si es builtin), -1 (error)
-static int execute_command(cmd_t *cmd) {
-    if (!cmd || !cmd->argv || !cmd->argv[0]) return -1;  // Validación
+// Acumular el consumo de una etapa en el total del job
+// (maxrss es el máximo entre etapas, no la suma)
+static void rusage_add(struct rusage *total, const struct rusage *ru) {
+    timeradd(&total->ru_utime, &ru->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &ru->ru_stime, &total->ru_stime);
+    if (ru->ru_maxrss > total->ru_maxrss) total->ru_maxrss = ru->ru_maxrss;
+    total->ru_nvcsw += ru->ru_nvcsw;
+    total->ru_nivcsw += ru->ru_nivcsw;
+}
 
-    // PASO 1: Verificar si es un builtin (exit, cd, path)
-    // handle_builtin retorna 1 si es builtin, 0 si no
-    if (handle_builtin(cmd)) {
-        return 0;  // Builtin ejecutado (o intentó), no necesitamos fork
+// Recolectar con wait4 un proceso que ya terminó (su pidfd está legible),
+// o registrar uno que ya reportó wait4(-1) con 'status' y 'ru'
+static void proc_reap(proc_t *proc, int status, const struct rusage *ru) {
+    job_t *job = proc->job;
+    struct rusage own;
+    if (!ru) {
+        while (wait4(proc->pid, &status, 0, &own) == -1 && errno == EINTR);
+        ru = &own;
     }
-
-    // PASO 2: Es un comando externo, buscar el ejecutable en PATH
-    char *exec_path = find_executable(cmd->argv[0]);
-    if (!exec_path) {  // No se encontró en PATH
-        util_print_error();
-        return -1;
+    rusage_add(&job->ru, ru);
+    if (proc->polled) {
+        proc->polled = 0;
+        polled_count--;
     }
+    if (proc->pidfd != -1) {
+        epoll_ctl(ev_epfd, EPOLL_CTL_DEL, proc->pidfd, NULL);
+        close(proc->pidfd);
+        proc->pidfd = -1;
+    }
+    // El estado del pipeline es el de su última etapa (como en sh)
+    if (proc == &job->procs[job->nprocs - 1]) job->status = status;
+    job_part_done(job);
+}
 
-    // PASO 3: Crear proceso hijo con fork()
+// Cerrar la salida splice de un job
+static void splice_close(splice_src_t *out) {
+    epoll_ctl(ev_epfd, EPOLL_CTL_DEL, out->pipe_fd, NULL);
+    close(out->pipe_fd);
+    close(out->file_fd);
+    out->pipe_fd = -1;
+    out->file_fd = -1;
+}
+
+// El pipe de salida de un job tiene datos: moverlos al archivo sin pasar
+// por memoria del shell (splice pipe -> archivo) hasta vaciarlo o llegar a EOF
+static void splice_drain(splice_src_t *out) {
+    while (1) {
+        ssize_t n = splice(out->pipe_fd, NULL, out->file_fd, NULL, SPLICE_CHUNK,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) continue;
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && errno == EAGAIN) return;  // Pipe vacío: esperar más datos
+        if (n == -1) util_print_error();  // Ej: disco lleno
+        // EOF (todas las etapas cerraron su salida) o error
+        splice_close(out);
+        job_part_done(out->job);
+        return;
+    }
+}
+
+// ====== Captura ordenada de salida (--keep-order / --tag) ======
+// Cada job sin '>' recibe dos pipes propios (stdout y stderr de todas sus
+// etapas). El bucle de eventos los vacía en buffers grandes y, al terminar
+// el job, su salida se emite de una sola vez:
+//   --keep-order: en el orden de los comandos (aunque terminen en otro orden)
+//   --tag:        cada línea con el comando como prefijo (como GNU parallel)
+// Si el total en memoria supera capture_budget, el buffer que crece se
+// vuelca a un archivo temporal y el resto se mueve con splice().
+
+// Escribir todo el buffer (reintentando escrituras parciales)
+static void write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return;  // Ej: EPIPE; la salida se descarta
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+// Crear el archivo temporal (anónimo) donde se vuelca un buffer
+static int capture_tmpfile(void) {
+    int fd = open(P_tmpdir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd != -1) return fd;
+    char path[] = P_tmpdir "/gtesh-capture-XXXXXX";  // Sin O_TMPFILE
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd != -1) unlink(path);
+    return fd;
+}
+
+// Pasar un buffer de memoria a disco (spill); el resto se agrega al archivo
+static int outbuf_spill(outbuf_t *buf) {
+    buf->spill_fd = capture_tmpfile();
+    if (buf->spill_fd == -1) return -1;
+    write_all(buf->spill_fd, buf->data, buf->len);
+    capture_mem_used -= buf->cap;
+    free(buf->data);
+    buf->data = NULL;
+    buf->cap = 0;
+    return 0;
+}
+
+// Liberar un buffer (memoria y/o archivo temporal)
+static void outbuf_free(outbuf_t *buf) {
+    capture_mem_used -= buf->cap;
+    free(buf->data);
+    if (buf->spill_fd != -1) close(buf->spill_fd);
+    buf->data = NULL;
+    buf->len = buf->cap = 0;
+    buf->spill_fd = -1;
+}
+
+// Emitir datos a fd anteponiendo 'tag' al inicio de cada línea
+// at_line_start conserva el estado entre bloques del mismo buffer
+static void emit_tagged(int fd, const char *tag, const char *data, size_t len,
+                        int *at_line_start) {
+    size_t tag_len = strlen(tag);
+    while (len > 0) {
+        if (*at_line_start) write_all(fd, tag, tag_len);
+        const char *nl = memchr(data, '\n', len);
+        size_t n = nl ? (size_t)(nl - data) + 1 : len;
+        write_all(fd, data, n);
+        *at_line_start = nl != NULL;
+        data += n;
+        len -= n;
+    }
+}
+
+// Emitir el contenido de un buffer capturado a fd (con o sin tag)
+static void outbuf_emit(outbuf_t *buf, int fd, const char *tag) {
+    int at_line_start = 1;
+    if (buf->spill_fd == -1) {
+        if (tag) emit_tagged(fd, tag, buf->data, buf->len, &at_line_start);
+        else write_all(fd, buf->data, buf->len);
+        return;
+    }
+    // En disco: sin tag se copia con sendfile (sin pasar por el shell)
+    off_t off = 0;
+    struct stat sb;
+    if (fstat(buf->spill_fd, &sb) == -1) return;
+    if (!tag) {
+        while (off < sb.st_size) {
+            ssize_t n = sendfile(fd, buf->spill_fd, &off, (size_t)(sb.st_size - off));
+            if (n <= 0) break;
+        }
+        if (off >= sb.st_size) return;
+    }
+    char chunk[CAPTURE_READ_SIZE];
+    ssize_t n;
+    while ((n = pread(buf->spill_fd, chunk, sizeof(chunk), off)) > 0) {
+        if (tag) emit_tagged(fd, tag, chunk, (size_t)n, &at_line_start);
+        else write_all(fd, chunk, (size_t)n);
+        off += n;
+    }
+}
+
+// Emitir la salida de una entrada terminada y liberarla
+static void out_entry_emit(out_entry_t *entry) {
+    outbuf_emit(&entry->out, STDOUT_FILENO, entry->tag);
+    outbuf_emit(&entry->err, STDERR_FILENO, entry->tag);
+    outbuf_free(&entry->out);
+    outbuf_free(&entry->err);
+    free(entry->tag);
+    free(entry);
+}
+
+// Emitir, en orden, todas las entradas terminadas al frente de la cola
+static void out_queue_flush(void) {
+    while (out_head && out_head->done) {
+        out_entry_t *entry = out_head;
+        out_head = entry->next;
+        if (!out_head) out_tail = NULL;
+        out_entry_emit(entry);
+    }
+}
+
+// El job de una entrada terminó: emitir lo que ya se pueda
+static void out_entry_done(out_entry_t *entry) {
+    entry->done = 1;
+    if (keep_order) {
+        out_queue_flush();
+    } else {  // Sólo --tag: salida agrupada por job, en orden de término
+        out_entry_emit(entry);
+    }
+}
+
+// Armar el tag de un comando: su texto ("a b | c") seguido de un tab
+static char *capture_make_tag(const cmd_t *cmd) {
+    size_t len = 2;
+    for (const cmd_t *st = cmd; st; st = st->pipe_next) {
+        for (int i = 0; st->argv[i]; i++) len += strlen(st->argv[i]) + 1;
+        len += 3;
+    }
+    char *tag = malloc(len);
+    if (!tag) return NULL;
+    char *p = tag;
+    for (const cmd_t *st = cmd; st; st = st->pipe_next) {
+        for (int i = 0; st->argv[i]; i++) {
+            if (i > 0) *p++ = ' ';
+            size_t n = strlen(st->argv[i]);
+            memcpy(p, st->argv[i], n);
+            p += n;
+        }
+        if (st->pipe_next) {
+            memcpy(p, " | ", 3);
+            p += 3;
+        }
+    }
+    *p++ = '\t';
+    *p = '\0';
+    return tag;
+}
+
+// Registrar en epoll el extremo de lectura de un pipe de captura
+static int capture_watch(capture_src_t *src, job_t *job, outbuf_t *buf, int fd) {
+    src->ev.type = EV_CAPTURE;
+    src->pipe_fd = fd;
+    src->buf = buf;
+    src->job = job;
+    fcntl(fd, F_SETPIPE_SZ, SPLICE_CHUNK);  // Menos despertares (best effort)
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = src };
+    return epoll_ctl(ev_epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// Preparar la captura de un job: entrada en la cola de salida y dos pipes
+// out_w/err_w: (salida) extremos de escritura para los hijos
+// Retorna: 0 si se preparó, -1 si hubo error (el job corre sin captura)
+static int capture_setup(job_t *job, int *out_w, int *err_w) {
+    out_entry_t *entry = calloc(1, sizeof(out_entry_t));
+    if (!entry) return -1;
+    entry->out.spill_fd = entry->err.spill_fd = -1;
+    if (tag_output && !(entry->tag = capture_make_tag(job->cmd))) {
+        free(entry);
+        return -1;
+    }
+    int out_fds[2], err_fds[2];
+    if (pipe2(out_fds, O_CLOEXEC) == -1) {
+        free(entry->tag);
+        free(entry);
+        return -1;
+    }
+    if (pipe2(err_fds, O_CLOEXEC) == -1) {
+        close(out_fds[0]);
+        close(out_fds[1]);
+        free(entry->tag);
+        free(entry);
+        return -1;
+    }
+    if (capture_watch(&job->cap_out, job, &entry->out, out_fds[0]) == -1 ||
+        capture_watch(&job->cap_err, job, &entry->err, err_fds[0]) == -1) {
+        epoll_ctl(ev_epfd, EPOLL_CTL_DEL, out_fds[0], NULL);
+        close(out_fds[0]);
+        close(out_fds[1]);
+        close(err_fds[0]);
+        close(err_fds[1]);
+        free(entry->tag);
+        free(entry);
+        return -1;
+    }
+    // En la cola en orden de lanzamiento (= orden de los comandos)
+    if (keep_order) {
+        if (out_tail) out_tail->next = entry;
+        else out_head = entry;
+        out_tail = entry;
+    }
+    job->entry = entry;
+    job->live += 2;  // El job termina cuando también llega EOF en ambos pipes
+    *out_w = out_fds[1];
+    *err_w = err_fds[1];
+    return 0;
+}
+
+// Dejar de leer un pipe de captura (EOF o error): es una parte del job
+static void capture_close(capture_src_t *src) {
+    epoll_ctl(ev_epfd, EPOLL_CTL_DEL, src->pipe_fd, NULL);
+    close(src->pipe_fd);
+    src->pipe_fd = -1;
+    job_part_done(src->job);
+}
+
+// Un pipe de captura tiene datos: leerlos al buffer (o al archivo si ya
+// se volcó a disco) hasta vaciarlo o llegar a EOF
+static void capture_drain(capture_src_t *src) {
+    outbuf_t *buf = src->buf;
+    while (1) {
+        ssize_t n;
+        if (buf->spill_fd != -1) {
+            n = splice(src->pipe_fd, NULL, buf->spill_fd, NULL, SPLICE_CHUNK,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } else {
+            // Asegurar espacio libre; si se excede el presupuesto, ir a disco
+            if (buf->cap - buf->len < CAPTURE_READ_SIZE) {
+                size_t new_cap = buf->cap ? buf->cap * 2 : CAPTURE_READ_SIZE * 2;
+                if (capture_mem_used + (new_cap - buf->cap) > capture_budget &&
+                    outbuf_spill(buf) == 0) {
+                    continue;
+                }
+                char *grown = realloc(buf->data, new_cap);
+                if (!grown) {
+                    if (outbuf_spill(buf) == 0) continue;
+                    util_print_error();  // Sin memoria ni disco: cortar la captura
+                    capture_close(src);
+                    return;
+                }
+                capture_mem_used += new_cap - buf->cap;
+                buf->data = grown;
+                buf->cap = new_cap;
+            }
+            n = read(src->pipe_fd, buf->data + buf->len, buf->cap - buf->len);
+            if (n > 0) buf->len += (size_t)n;
+        }
+        if (n > 0) continue;
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && errno == EAGAIN) return;  // Pipe vacío: esperar más datos
+        if (n == -1) util_print_error();  // Ej: disco lleno
+        // EOF (todos los procesos del job cerraron su extremo) o error
+        capture_close(src);
+        return;
+    }
+}
+
+// Ningún proceso del job llegó a lanzarse: cerrar su captura sin esperar
+// EOF (la entrada queda vacía y terminada, para no frenar la cola)
+static void capture_abort(job_t *job) {
+    capture_src_t *srcs[2] = { &job->cap_out, &job->cap_err };
+    for (int i = 0; i < 2; i++) {
+        if (srcs[i]->pipe_fd == -1) continue;
+        epoll_ctl(ev_epfd, EPOLL_CTL_DEL, srcs[i]->pipe_fd, NULL);
+        close(srcs[i]->pipe_fd);
+        srcs[i]->pipe_fd = -1;
+        job->live--;
+    }
+    out_entry_done(job->entry);
+    job->entry = NULL;
+}
+// ====== Caché de resultados (prefijo 'cache' + --cache DIR) ======
+// "cache cmd args > out" guarda la salida y el estado de cmd en DIR bajo
+// una clave de 128 bits (FNV-1a) calculada con:
+//   - la ruta del ejecutable de cada etapa y su dev/inodo/tamaño/mtime
+//   - argv de cada etapa, el archivo de '>' y el directorio actual
+//   - tamaño y mtime de cada argumento que sea un archivo o directorio
+//     existente (las entradas declaradas del comando)
+// Si la clave ya está en DIR, el shell escribe la salida guardada en el
+// archivo de '>' (con el mtime original, para que los comandos que lo lean
+// también acierten) y no crea ningún proceso. Las entradas se desalojan
+// por antigüedad de uso cuando DIR supera --cache-max.
+
+#define CACHE_DEFAULT_MAX (1UL << 30)  // Tamaño máximo por defecto de DIR (1 GiB)
+#define CACHE_MAGIC "GTC1"
+
+// Encabezado de cada entrada de la caché (seguido por la salida guardada)
+typedef struct {
+    char magic[4];
+    int32_t status;        // Estado de salida (wait4) del comando
+    int64_t mtime_sec;     // mtime del archivo de '>' al guardarlo
+    int64_t mtime_nsec;
+} cache_hdr_t;
+
+static const char *cache_path = NULL;  // --cache DIR
+static int cache_dirfd = -1;
+static unsigned long long cache_max = CACHE_DEFAULT_MAX;
+static unsigned long long cache_bytes = 0;  // Tamaño actual de DIR (aprox.)
+static unsigned long cache_hits = 0, cache_misses = 0, cache_stores = 0, cache_evictions = 0;
+
+// Agregar bytes a un hash FNV-1a de 128 bits
+static cache_key_t cache_hash(cache_key_t h, const void *data, size_t len) {
+    const cache_key_t prime = ((cache_key_t)1 << 88) | 0x13B;
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= prime;
+    }
+    return h;
+}
+
+// Agregar un string (con su '\0', para separar campos)
+static cache_key_t cache_hash_str(cache_key_t h, const char *str) {
+    return cache_hash(h, str, strlen(str) + 1);
+}
+
+// Calcular la clave de un comando (todas sus etapas)
+static cache_key_t cache_key(const cmd_t *cmd, char **exec_paths) {
+    cache_key_t h = ((cache_key_t)0x6c62272e07bb0142ULL << 64) | 0x62b821756295c58dULL;
+    char cwd[4096];
+    h = cache_hash_str(h, getcwd(cwd, sizeof(cwd)) ? cwd : "");
+    int i = 0;
+    for (const cmd_t *st = cmd; st; st = st->pipe_next, i++) {
+        struct stat sb;
+        h = cache_hash_str(h, exec_paths[i]);
+        if (stat(exec_paths[i], &sb) == 0) {
+            int64_t id[4] = { (int64_t)sb.st_dev, (int64_t)sb.st_ino, (int64_t)sb.st_size,
+                              (int64_t)sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec };
+            h = cache_hash(h, id, sizeof(id));
+        }
+        for (int a = 0; st->argv[a]; a++) {
+            h = cache_hash_str(h, st->argv[a]);
+            // Entrada declarada: el inodo no cuenta (un archivo restaurado o
+            // regenerado con el mismo contenido y mtime debe dar la misma clave)
+            if (a > 0 && stat(st->argv[a], &sb) == 0 &&
+                (S_ISREG(sb.st_mode) || S_ISDIR(sb.st_mode))) {
+                int64_t id[2] = { (int64_t)sb.st_size,
+                                  (int64_t)sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec };
+                h = cache_hash(h, id, sizeof(id));
+            }
+        }
+        h = cache_hash_str(h, st->redir_file ? st->redir_file : "|");
+    }
+    return h;
+}
+
+// Nombre de la entrada de una clave: 32 dígitos hexadecimales
+static void cache_entry_name(cache_key_t key, char name[33]) {
+    snprintf(name, 33, "%016llx%016llx",
+             (unsigned long long)(key >> 64), (unsigned long long)key);
+}
+
+// Copiar de 'in' (desde in_off) a 'out' hasta EOF. Retorna: bytes, o -1
+static long long cache_copy(int in, off_t in_off, int out) {
+    long long total = 0;
+    while (1) {
+        ssize_t n = copy_file_range(in, &in_off, out, NULL, SPLICE_CHUNK, 0);
+        if (n == 0) return total;
+        if (n > 0) {
+            total += n;
+            continue;
+        }
+        if (errno == EINTR) continue;
+        if (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP) {
+            return -1;
+        }
+        break;  // Sin copy_file_range para estos archivos: copiar con read/write
+    }
+    char buf[CAPTURE_READ_SIZE];
+    ssize_t n;
+    while ((n = pread(in, buf, sizeof(buf), in_off)) > 0) {
+        write_all(out, buf, (size_t)n);
+        in_off += n;
+        total += n;
+    }
+    return n == -1 ? -1 : total;
+}
+
+// Una entrada de DIR, para ordenar por antigüedad de uso
+typedef struct {
+    struct timespec mtime;  // Se actualiza en cada acierto
+    unsigned long long size;
+    char name[33];
+} cache_victim_t;
+
+static int cache_victim_cmp(const void *a, const void *b) {
+    const struct timespec *x = &((const cache_victim_t *)a)->mtime;
+    const struct timespec *y = &((const cache_victim_t *)b)->mtime;
+    if (x->tv_sec != y->tv_sec) return x->tv_sec < y->tv_sec ? -1 : 1;
+    return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+// Desalojar las entradas usadas hace más tiempo hasta bajar al 90% de cache_max
+// (DIR se vuelve a medir: otros shells pueden compartirlo)
+static void cache_evict(void) {
+    int fd = openat(cache_dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    if (!dir) return;
+    cache_victim_t *victims = NULL;
+    size_t count = 0, cap = 0;
+    unsigned long long total = 0;
+    struct dirent *de;
+    struct stat sb;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.' || strlen(de->d_name) != 32) continue;
+        if (fstatat(cache_dirfd, de->d_name, &sb, 0) == -1) continue;
+        if (count == cap) {
+            size_t new_cap = cap ? cap * 2 : 64;
+            cache_victim_t *grown = realloc(victims, new_cap * sizeof(cache_victim_t));
+            if (!grown) break;
+            victims = grown;
+            cap = new_cap;
+        }
+        victims[count].mtime = sb.st_mtim;
+        victims[count].size = (unsigned long long)sb.st_size;
+        memcpy(victims[count].name, de->d_name, 33);
+        total += victims[count].size;
+        count++;
+    }
+    closedir(dir);
+
+    qsort(victims, count, sizeof(cache_victim_t), cache_victim_cmp);
+    unsigned long long target = cache_max / 10 * 9;
+    for (size_t i = 0; i < count && total > target; i++) {
+        if (unlinkat(cache_dirfd, victims[i].name, 0) == 0) {
+            total -= victims[i].size;
+            cache_evictions++;
+        }
+    }
+    cache_bytes = total;
+    free(victims);
+}
+
+// Preparar DIR (crearlo si no existe) y medir su tamaño actual
+static void cache_init(void) {
+    mkdir(cache_path, 0755);  // Si ya existe, falla sin problema
+    cache_dirfd = open(cache_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cache_dirfd == -1) {
+        util_print_error();
+        exit(1);
+    }
+    int fd = openat(cache_dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    if (!dir) return;
+    struct dirent *de;
+    struct stat sb;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] != '.' && fstatat(cache_dirfd, de->d_name, &sb, 0) == 0) {
+            cache_bytes += (unsigned long long)sb.st_size;
+        }
+    }
+    closedir(dir);
+    if (cache_bytes > cache_max) cache_evict();  // --cache-max más chico que antes
+}
+
+// Buscar un comando en la caché; si está, restaurar su salida en redir_file
+// Retorna: 1 si hubo acierto (status queda en *status), 0 si no
+static int cache_lookup(cache_key_t key, const char *redir_file, int *status) {
+    char name[33];
+    cache_entry_name(key, name);
+    int fd = openat(cache_dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return 0;
+    cache_hdr_t hdr;
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        memcmp(hdr.magic, CACHE_MAGIC, 4) != 0) {
+        close(fd);
+        return 0;
+    }
+    int out = open(redir_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out == -1) {
+        close(fd);
+        return 0;  // Que el comando corra y reporte el error como siempre
+    }
+    long long copied = cache_copy(fd, sizeof(hdr), out);
+    struct timespec times[2] = {
+        { 0, UTIME_OMIT },
+        { (time_t)hdr.mtime_sec, (long)hdr.mtime_nsec }
+    };
+    futimens(out, times);  // Mismo mtime que la salida original
+    close(out);
+    futimens(fd, NULL);    // Marcar la entrada como usada recién (LRU)
+    close(fd);
+    if (copied == -1) return 0;
+    *status = hdr.status;
+    return 1;
+}
+
+// Guardar en la caché la salida (redir_file) y el estado de un comando
+static void cache_store(cache_key_t key, const char *redir_file, int status) {
+    int in = open(redir_file, O_RDONLY | O_CLOEXEC);
+    if (in == -1) return;
+    struct stat sb;
+    if (fstat(in, &sb) == -1 || !S_ISREG(sb.st_mode)) {
+        close(in);
+        return;
+    }
+    // Escribir en un temporal y renombrarlo: nunca hay entradas a medias
+    char tmp[64];
+    snprintf(tmp, sizeof(tmp), ".tmp-%d-%lu", (int)getpid(), cache_stores);
+    int out = openat(cache_dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out == -1) {
+        close(in);
+        return;
+    }
+    cache_hdr_t hdr;
+    memcpy(hdr.magic, CACHE_MAGIC, 4);
+    hdr.status = status;
+    hdr.mtime_sec = sb.st_mtim.tv_sec;
+    hdr.mtime_nsec = sb.st_mtim.tv_nsec;
+    write_all(out, (const char *)&hdr, sizeof(hdr));
+    long long copied = cache_copy(in, 0, out);
+    close(in);
+    char name[33];
+    cache_entry_name(key, name);
+    if (close(out) == -1 || copied == -1 || renameat(cache_dirfd, tmp, cache_dirfd, name) == -1) {
+        unlinkat(cache_dirfd, tmp, 0);
+        return;
+    }
+    cache_stores++;
+    cache_bytes += sizeof(hdr) + (unsigned long long)copied;
+    if (cache_bytes > cache_max) cache_evict();
+}
+
+// Builtin: cache
+// cache -s   -> mostrar aciertos/fallos, entradas guardadas y desalojadas
+// cache -r   -> vaciar DIR
+// (con un comando, 'cache' es un prefijo: ver apply_prefixes)
+static void builtin_cache(char **args) {
+    if (!args[0] || args[1] || (strcmp(args[0], "-s") != 0 && strcmp(args[0], "-r") != 0)) {
+        util_print_error();
+        return;
+    }
+    if (strcmp(args[0], "-s") == 0) {
+        unsigned long total = cache_hits + cache_misses;
+        printf("dir: %s\nhits: %lu\nmisses: %lu\nhit rate: %.1f%%\nstores: %lu\n"
+               "evictions: %lu\nbytes: %llu\n",
+               cache_path ? cache_path : "(off)", cache_hits, cache_misses,
+               total ? 100.0 * cache_hits / total : 0.0, cache_stores,
+               cache_evictions, cache_bytes);
+        fflush(stdout);
+        return;
+    }
+    if (cache_dirfd == -1) return;
+    unsigned long long saved = cache_max;
+    cache_max = 0;  // Desalojar todo
+    cache_evict();
+    cache_max = saved;
+}
+
+// ====== Utilidades dentro del shell (echo, true, false, pwd, sleep, ...) ======
+// Los comandos triviales más comunes se ejecutan sin fork/exec, como un job
+// sin procesos (así 'time', --stats, 'cache' y --parallel-batch funcionan
+// igual). Sólo se usan si el comando es de una sola etapa, no se pidió
+// --external-utils y el ejecutable que encontró el PATH es la utilidad del
+// sistema (mismo dispositivo e inodo que /bin/NOMBRE o /usr/bin/NOMBRE): un
+// PATH vacío sigue dando error y un 'echo' propio se ejecuta tal cual.
+// '> file' se respeta escribiendo en el archivo en vez de en stdout/stderr.
+// 'sleep' no bloquea: es un timerfd en el epoll, y los demás comandos de
+// la línea siguen lanzándose y terminando mientras tanto. Si aparece una
+// opción no implementada, se usa el ejecutable externo (retornan -1).
+
+static int external_utils = 0;  // --external-utils: siempre fork+exec
+
+// Imprimir "cmd: mensaje 'arg': error" como coreutils
+static void inproc_perror(int err_fd, const char *cmd, const char *what,
+                          const char *arg, int errnum) {
+    dprintf(err_fd, "%s: %s '%s': %s\n", cmd, what, arg, strerror(errnum));
+}
+
+// echo [-neE] args: -n sin salto final; -e interpreta \n, \t, \\, \0NNN, \xHH, \c, ...
+static int inproc_echo(char **argv, int out_fd, int err_fd) {
+    (void)err_fd;
+    int newline = 1, escapes = 0, i = 1;
+    // Como coreutils: sólo cuenta como opción una palabra hecha de n/e/E
+    for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++) {
+        if (strspn(argv[i] + 1, "neE") != strlen(argv[i] + 1)) break;
+        for (const char *f = argv[i] + 1; *f; f++) {
+            if (*f == 'n') newline = 0;
+            else escapes = *f == 'e';
+        }
+    }
+    size_t cap = 2;
+    for (int k = i; argv[k]; k++) cap += strlen(argv[k]) + 1;
+    char *buf = malloc(cap);
+    if (!buf) return -1;  // Que lo haga el externo
+    size_t len = 0;
+    for (int k = i; argv[k]; k++) {
+        if (k > i) buf[len++] = ' ';
+        for (const char *p = argv[k]; *p; p++) {
+            if (!escapes || *p != '\\' || !p[1]) {
+                buf[len++] = *p;
+                continue;
+            }
+            const char *esc = strchr("abefnrtv\\", p[1]);
+            if (esc) {
+                buf[len++] = "\a\b\033\f\n\r\t\v\\"[esc - "abefnrtv\\"];
+                p++;
+            } else if (p[1] == 'c') {  // \c: no imprimir nada más
+                newline = 0;
+                goto done;
+            } else if (p[1] == '0' || p[1] == 'x') {
+                int base = p[1] == '0' ? 8 : 16, max = p[1] == '0' ? 3 : 2, n = 0, v = 0;
+                const char *q = p + 2;
+                for (; n < max && *q; n++, q++) {
+                    int d = *q >= '0' && *q <= '9' ? *q - '0' :
+                            *q >= 'a' && *q <= 'f' ? *q - 'a' + 10 :
+                            *q >= 'A' && *q <= 'F' ? *q - 'A' + 10 : 99;
+                    if (d >= base) break;
+                    v = v * base + d;
+                }
+                if (base == 16 && n == 0) {  // "\x" sin dígitos: literal
+                    buf[len++] = *p;
+                    continue;
+                }
+                buf[len++] = (char)v;
+                p = q - 1;
+            } else {
+                buf[len++] = *p;
+            }
+        }
+    }
+done:
+    if (newline) buf[len++] = '\n';
+    write_all(out_fd, buf, len);
+    free(buf);
+    return 0;
+}
+
+static int inproc_true(char **argv, int out_fd, int err_fd) {
+    (void)argv, (void)out_fd, (void)err_fd;
+    return 0;
+}
+
+static int inproc_false(char **argv, int out_fd, int err_fd) {
+    (void)argv, (void)out_fd, (void)err_fd;
+    return 1;
+}
+
+// pwd [-L | -P]
+static int inproc_pwd(char **argv, int out_fd, int err_fd) {
+    for (int i = 1; argv[i]; i++) {
+        if (strcmp(argv[i], "-L") != 0 && strcmp(argv[i], "-P") != 0) return -1;
+    }
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        dprintf(err_fd, "pwd: %s\n", strerror(errno));
+        return 1;
+    }
+    size_t len = strlen(cwd);
+    cwd[len++] = '\n';
+    write_all(out_fd, cwd, len);
+    return 0;
+}
+
+// mkdir [-p] [-m MODO] dir...
+static int inproc_mkdir(char **argv, int out_fd, int err_fd) {
+    (void)out_fd;
+    int parents = 0, i = 1;
+    mode_t mode = 0777;
+    for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        }
+        if (strcmp(argv[i], "-p") == 0) {
+            parents = 1;
+        } else if (strcmp(argv[i], "-m") == 0 && argv[i + 1]) {
+            char *end;
+            long m = strtol(argv[++i], &end, 8);
+            if (*end || m < 0 || m > 07777) return -1;  // Modo simbólico: externo
+            mode = (mode_t)m;
+        } else {
+            return -1;
+        }
+    }
+    if (!argv[i]) return -1;  // Sin operandos: que el externo dé el mensaje
+    int status = 0;
+    for (; argv[i]; i++) {
+        if (parents) {
+            // Crear cada prefijo "a", "a/b", ... ignorando los que ya existen
+            char *path = strdup(argv[i]);
+            if (!path) return -1;
+            for (char *p = path + 1; ; p++) {
+                if (*p != '/' && *p != '\0') continue;
+                char saved = *p;
+                *p = '\0';
+                struct stat sb;
+                int err = mkdir(path, saved ? 0777 : mode) == -1 ? errno : 0;
+                // EEXIST sólo se ignora si lo que existe es un directorio
+                if (err == EEXIST && stat(path, &sb) == 0 && S_ISDIR(sb.st_mode)) err = 0;
+                if (err == EEXIST && saved) err = ENOTDIR;  // Un prefijo que no es directorio
+                if (err) {
+                    inproc_perror(err_fd, "mkdir", "cannot create directory", path, err);
+                    status = 1;
+                    *p = saved;
+                    break;
+                }
+                *p = saved;
+                if (!saved) break;
+            }
+            free(path);
+        } else if (mkdir(argv[i], mode) == -1) {
+            inproc_perror(err_fd, "mkdir", "cannot create directory", argv[i], errno);
+            status = 1;
+        } else if (mode & ~0777) {
+            chmod(argv[i], mode);  // setgid/sticky no pasan por mkdir+umask
+        }
+    }
+    return status;
+}
+
+// rm -r: callback de nftw (recorrido en profundidad: hijos antes que el dir)
+static int inproc_rm_status = 0;
+static int inproc_rm_err_fd = STDERR_FILENO;
+
+static int inproc_rm_entry(const char *path, const struct stat *sb, int type, struct FTW *ftw) {
+    (void)sb, (void)ftw;
+    int r = type == FTW_DP ? rmdir(path) : unlink(path);
+    if (r == -1) {
+        inproc_perror(inproc_rm_err_fd, "rm", "cannot remove", path, errno);
+        inproc_rm_status = 1;
+    }
+    return 0;  // Seguir con el resto, como rm
+}
+
+// ¿rm debe negarse a borrar 'arg'? Como coreutils: el último componente
+// (sin las '/' finales) es "." o "..", o es el directorio raíz ("//", "/./")
+static int inproc_rm_protected(const char *arg) {
+    size_t len = strlen(arg);
+    while (len > 1 && arg[len - 1] == '/') len--;
+    size_t base = len;
+    while (base > 0 && arg[base - 1] != '/') base--;
+    size_t blen = len - base;
+    if ((blen == 1 && arg[base] == '.') || (blen == 2 && arg[base] == '.' && arg[base + 1] == '.')) {
+        return 1;
+    }
+    struct stat sb, root;
+    return lstat(arg, &sb) == 0 && S_ISDIR(sb.st_mode) && stat("/", &root) == 0 &&
+           sb.st_dev == root.st_dev && sb.st_ino == root.st_ino;
+}
+
+// rm [-f] [-r|-R] file...
+static int inproc_rm(char **argv, int out_fd, int err_fd) {
+    (void)out_fd;
+    int force = 0, recursive = 0, i = 1;
+    for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (const char *f = argv[i] + 1; *f; f++) {
+            if (*f == 'f') force = 1;
+            else if (*f == 'r' || *f == 'R') recursive = 1;
+            else return -1;
+        }
+    }
+    if (!argv[i]) return force ? 0 : -1;
+    // Casos protegidos: antes de borrar nada, todo el comando va al rm externo
+    // (que da el mensaje y no borra)
+    for (int k = i; argv[k]; k++) {
+        if (inproc_rm_protected(argv[k])) return -1;
+    }
+    inproc_rm_status = 0;
+    inproc_rm_err_fd = err_fd;
+    for (; argv[i]; i++) {
+        struct stat sb;
+        if (lstat(argv[i], &sb) == -1) {
+            if (!force || errno != ENOENT) {
+                inproc_perror(err_fd, "rm", "cannot remove", argv[i], errno);
+                inproc_rm_status = 1;
+            }
+            continue;
+        }
+        if (S_ISDIR(sb.st_mode)) {
+            if (!recursive) {
+                inproc_perror(err_fd, "rm", "cannot remove", argv[i], EISDIR);
+                inproc_rm_status = 1;
+                continue;
+            }
+            nftw(argv[i], inproc_rm_entry, 64, FTW_DEPTH | FTW_PHYS);
+        } else if (unlink(argv[i]) == -1) {
+            inproc_perror(err_fd, "rm", "cannot remove", argv[i], errno);
+            inproc_rm_status = 1;
+        }
+    }
+    return inproc_rm_status;
+}
+
+// touch [-c] file...: crear si no existe y fijar atime/mtime a ahora
+static int inproc_touch(char **argv, int out_fd, int err_fd) {
+    (void)out_fd;
+    int no_create = 0, i = 1;
+    for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        }
+        if (strcmp(argv[i], "-c") != 0) return -1;  // -d, -t, -r, -a, -m: externo
+        no_create = 1;
+    }
+    if (!argv[i]) return -1;
+    int status = 0;
+    for (; argv[i]; i++) {
+        if (utimensat(AT_FDCWD, argv[i], NULL, 0) == 0) continue;
+        if (errno != ENOENT) {
+            inproc_perror(err_fd, "touch", "cannot touch", argv[i], errno);
+            status = 1;
+            continue;
+        }
+        if (no_create) continue;
+        int fd = open(argv[i], O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+        if (fd == -1) {
+            inproc_perror(err_fd, "touch", "cannot touch", argv[i], errno);
+            status = 1;
+            continue;
+        }
+        close(fd);
+    }
+    return status;
+}
+
+// Duración de 'sleep' (suma de argumentos "1.5", "2m", "1h", "0.1d")
+// Retorna: ns, o -1 si algún argumento no es válido (lo reporta el externo)
+static long long inproc_sleep_ns(char **argv) {
+    if (!argv[1]) return -1;
+    double total = 0;
+    for (int i = 1; argv[i]; i++) {
+        double v = parse_duration(argv[i]);
+        if (v < 0) return -1;
+        total += v;
+    }
+    if (total > 9e9) return -1;  // Prácticamente infinito: que lo haga el externo
+    return (long long)(total * 1e9);
+}
+
+static const struct {
+    const char *name;
+    int (*run)(char **argv, int out_fd, int err_fd);  // NULL: sleep (ver abajo)
+} inproc_utils[] = {
+    { "echo", inproc_echo }, { "true", inproc_true }, { "false", inproc_false },
+    { "pwd", inproc_pwd }, { "mkdir", inproc_mkdir }, { "rm", inproc_rm },
+    { "touch", inproc_touch }, { "sleep", NULL }, { NULL, NULL }
+};
+
+// Identidad de cada utilidad del sistema (mismo índice que inproc_utils)
+static struct {
+    dev_t dev;
+    ino_t ino;
+    int known;  // 0 = aún no se buscó, 1 = encontrada, -1 = no existe
+} inproc_ids[sizeof(inproc_utils) / sizeof(inproc_utils[0])];
+
+// Buscar la utilidad u en /bin y /usr/bin
+static void inproc_id_load(int u) {
+    static const char *const dirs[] = { "/bin/", "/usr/bin/" };
+    inproc_ids[u].known = -1;
+    for (int d = 0; d < 2; d++) {
+        char path[64];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s%s", dirs[d], inproc_utils[u].name);
+        if (stat(path, &st) == 0) {
+            inproc_ids[u].dev = st.st_dev;
+            inproc_ids[u].ino = st.st_ino;
+            inproc_ids[u].known = 1;
+            return;
+        }
+    }
+}
+
+// ¿exec_path (lo que resolvió el PATH) es la utilidad u del sistema?
+static int inproc_is_system(int u, const char *exec_path) {
+    struct stat st;
+    if (stat(exec_path, &st) == -1) return 0;
+    for (int pass = 0; pass < 2; pass++) {
+        // La identidad guardada puede ser vieja (se actualizó el paquete): buscarla otra vez
+        if (pass == 1 || !inproc_ids[u].known) inproc_id_load(u);
+        if (inproc_ids[u].known == 1 && inproc_ids[u].dev == st.st_dev &&
+            inproc_ids[u].ino == st.st_ino) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Registrar en epoll el timerfd de un 'sleep' dentro del shell
+// Retorna: 0, o -1 si no se pudo (el sleep se hace con el ejecutable)
+static int inproc_sleep_start(job_t *job, long long ns) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1) return -1;
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = ns / 1000000000;
+    its.it_value.tv_nsec = ns % 1000000000;
+    if (ns == 0) its.it_value.tv_nsec = 1;  // 0 desarmaría el timer
+    job->sleep.ev.type = EV_SLEEP;
+    job->sleep.fd = fd;
+    job->sleep.job = job;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &job->sleep };
+    if (timerfd_settime(fd, 0, &its, NULL) == -1 ||
+        epoll_ctl(ev_epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        close(fd);
+        job->sleep.fd = -1;
+        return -1;
+    }
+    job->live++;
+    return 0;
+}
+
+// Terminó el timer de un 'sleep' dentro del shell
+static void inproc_sleep_done(sleep_src_t *src) {
+    epoll_ctl(ev_epfd, EPOLL_CTL_DEL, src->fd, NULL);
+    close(src->fd);
+    src->fd = -1;
+    job_part_done(src->job);
+}
+
+// SIGCHLD (control de jobs): las terminaciones las recolecta el pidfd de
+// cada hijo; aquí sólo se registran los cambios de detenido/continuado, que
+// waitid reporta sin consumir el estado de salida (no se pide WEXITED)
+static void jc_sigchld(void) {
+    struct signalfd_siginfo ssi;
+    while (read(sigchld_fd, &ssi, sizeof(ssi)) > 0);  // Vaciar (no bloqueante)
+    siginfo_t si;
+    memset(&si, 0, sizeof(si));
+    while (waitid(P_ALL, 0, &si, WSTOPPED | WCONTINUED | WNOHANG) == 0 && si.si_pid != 0) {
+        for (job_t *job = running_jobs; job; job = job->next) {
+            for (int i = 0; i < job->nprocs; i++) {
+                if (job->procs[i].pid == si.si_pid && job->line) {
+                    job->line->stopped = si.si_code == CLD_STOPPED;
+                }
+            }
+        }
+        memset(&si, 0, sizeof(si));
+    }
+}
+
+// Revisar con wait4(pid, WNOHANG) los hijos sin pidfd (proc_t.polled)
+// Retorna: 1 si recolectó uno (su job puede haber terminado), 0 si no
+static int reap_polled(void) {
+    for (job_t *job = running_jobs; job; job = job->next) {
+        for (int i = 0; i < job->nprocs; i++) {
+            proc_t *proc = &job->procs[i];
+            if (!proc->polled) continue;
+            int status;
+            struct rusage ru;
+            if (wait4(proc->pid, &status, WNOHANG, &ru) == proc->pid) {
+                proc_reap(proc, status, &ru);  // Puede liberar el job: no seguir
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Procesar los eventos listos, esperando a lo más timeout_ms (-1 = hasta
+// que ocurra al menos uno: termina un hijo, hay salida para mover). Con
+// pidfd se esperan sólo los hijos registrados (epoll); sin pidfd se usa
+// wait4(-1) y se busca el proceso por PID (en ese caso --splice y la
+// captura no se usan).
+static void reap_events(int timeout_ms) {
+    if (running_count == 0 && !job_control) return;
+
+    if (!pidfd_supported) {
+        int status;
+        struct rusage ru;
+        pid_t pid = wait4(-1, &status, timeout_ms == -1 ? 0 : WNOHANG, &ru);
+        if (pid == 0) return;
+        if (pid == -1) {
+            if (errno == ECHILD) {  // No quedan hijos: limpiar la lista
+                while (running_jobs) job_release(running_jobs);
+            }
+            return;
+        }
+        if (plugin_worker_reaped(pid, status)) return;  // No es de ningún job
+        for (job_t *job = running_jobs; job; job = job->next) {
+            for (int i = 0; i < job->nprocs; i++) {
+                if (job->procs[i].pid == pid) {
+                    proc_reap(&job->procs[i], status, &ru);
+                    return;
+                }
+            }
+        }
+        return;
+    }
+
+    // Hijos sin pidfd: no bloquear en epoll más de POLL_CHILD_MS
+    if (polled_count > 0) {
+        if (reap_polled()) timeout_ms = 0;
+        else if (timeout_ms == -1 || timeout_ms > POLL_CHILD_MS) timeout_ms = POLL_CHILD_MS;
+    }
+
+    struct epoll_event events[EV_MAX_EVENTS];
+    int n = epoll_wait(ev_epfd, events, EV_MAX_EVENTS, timeout_ms);
+    if (trace_flush_requested) trace_flush();  // SIGUSR1 interrumpe epoll_wait
+    for (int i = 0; i < n; i++) {
+        ev_source_t *src = events[i].data.ptr;
+        switch (src->type) {
+        case EV_CHILD:
+            proc_reap((proc_t *)src, 0, NULL);
+            break;
+        case EV_SPLICE:
+            splice_drain((splice_src_t *)src);
+            break;
+        case EV_CAPTURE:
+            capture_drain((capture_src_t *)src);
+            break;
+        case EV_SLEEP:
+            inproc_sleep_done((sleep_src_t *)src);
+            break;
+        case EV_SIGCHLD:
+            jc_sigchld();
+            break;
+        case EV_WATCHDOG:
+            wd_fire();
+            break;
+        case EV_PLUGIN:  // La respuesta la lee plugin_call_isolated
+            break;
+        }
+    }
+}
+
+// Bloquear hasta que ocurra al menos un evento y procesar los listos
+static void reap_children(void) {
+    if (running_count == 0) return;
+    reap_events(-1);
+}
+
+// Builtin: jobs-limit
+// jobs-limit      -> mostrar el máximo de hijos simultáneos
+// jobs-limit N    -> fijarlo (N >= 1)
+static void builtin_jobs_limit(char **args) {
+    if (!args[0]) {
+        printf("%ld\n", jobs_limit);
+        fflush(stdout);
+        return;
+    }
+    char *end;
+    errno = 0;
+    long n = strtol(args[0], &end, 10);
+    if (args[1] || *end || errno || n < 1) {
+        util_print_error();
+        return;
+    }
+    jobs_limit = n;
+}
+
+// ====== Colocación y prioridad de los hijos (--affinity, --nice, ...) ======
+// Opciones que se aplican en el hijo antes de execv:
+//   affinity=rr    -> cada proceso fijado a una CPU distinta (en rueda)
+//   affinity=numa  -> jobs repartidos en rueda entre nodos NUMA, cada uno
+//                     fijado a las CPUs de su nodo (su memoria queda local)
+//   nice=N, ioprio=idle|be[:N]|rt[:N], rlimit=RES:N
+// Se fijan globalmente con flags o, desde la línea siguiente, con el
+// builtin 'opts'. Como posix_spawn no puede ejecutar código en el hijo, los
+// jobs con alguna de estas opciones se lanzan siempre con fork.
+
+#define PLACE_MAX_RLIMITS 8     // Límites distintos que se pueden fijar a la vez
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+
+typedef enum { AFFINITY_NONE, AFFINITY_RR, AFFINITY_NUMA } affinity_t;
+
+typedef struct {
+    affinity_t affinity;
+    int nice_set;          // 1 si se pidió nice
+    int nice;
+    int ioprio;            // Valor para ioprio_set (-1 = sin cambio)
+    int nrlimits;
+    struct {
+        int resource;      // RLIMIT_*
+        rlim_t value;      // Se fija como límite blando y duro
+    } rlimits[PLACE_MAX_RLIMITS];
+} place_opts_t;
+
+static place_opts_t place_defaults = { AFFINITY_NONE, 0, 0, -1, 0, {{0, 0}} };  // Flags
+static place_opts_t place_current = { AFFINITY_NONE, 0, 0, -1, 0, {{0, 0}} };   // opts
+
+static cpu_set_t place_allowed;      // CPUs permitidas al shell al iniciar
+static int *place_cpus = NULL;       // Las mismas, en orden, para la rueda
+static int place_ncpus = 0;
+static cpu_set_t *place_nodes = NULL;  // CPUs (permitidas) de cada nodo NUMA
+static int place_nnodes = 0;
+static unsigned long place_next = 0;   // Siguiente posición de la rueda
+static int place_node = 0;             // Nodo del job actual (affinity=numa)
+
+static const struct {
+    const char *name;
+    int resource;
+} place_rlimit_names[] = {
+    { "cpu", RLIMIT_CPU }, { "as", RLIMIT_AS }, { "data", RLIMIT_DATA },
+    { "fsize", RLIMIT_FSIZE }, { "nofile", RLIMIT_NOFILE }, { "nproc", RLIMIT_NPROC },
+    { "stack", RLIMIT_STACK }, { "core", RLIMIT_CORE }, { NULL, 0 }
+};
+
+// Leer las CPUs permitidas y, si hay, los nodos NUMA (/sys/devices/system/node)
+static void place_init(void) {
+    if (place_cpus) return;
+    CPU_ZERO(&place_allowed);
+    if (sched_getaffinity(0, sizeof(place_allowed), &place_allowed) == -1) return;
+    place_cpus = malloc(CPU_SETSIZE * sizeof(int));
+    if (!place_cpus) return;
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (CPU_ISSET(c, &place_allowed)) place_cpus[place_ncpus++] = c;
+    }
+
+    // cpulist: rangos "0-15,32-47"
+    for (int node = 0;; node++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *f = fopen(path, "re");
+        if (!f) break;
+        cpu_set_t *grown = realloc(place_nodes, (node + 1) * sizeof(cpu_set_t));
+        if (!grown) {
+            fclose(f);
+            break;
+        }
+        place_nodes = grown;
+        CPU_ZERO(&place_nodes[node]);
+        int lo, hi;
+        char sep;
+        while (fscanf(f, "%d", &lo) == 1) {
+            hi = lo;
+            if (fscanf(f, "%c", &sep) == 1 && sep == '-') {
+                if (fscanf(f, "%d", &hi) != 1) break;
+                if (fscanf(f, "%c", &sep) != 1) sep = '\n';
+            }
+            for (int c = lo; c <= hi && c < CPU_SETSIZE; c++) {
+                if (CPU_ISSET(c, &place_allowed)) CPU_SET(c, &place_nodes[node]);
+            }
+            if (sep != ',') break;
+        }
+        fclose(f);
+        // Un nodo sin CPUs permitidas no cuenta
+        if (CPU_COUNT(&place_nodes[node]) > 0) place_nnodes = node + 1;
+    }
+}
+
+// ¿Hay alguna opción que obligue a preparar el hijo antes del exec?
+static int place_active(const place_opts_t *opts) {
+    return opts->affinity != AFFINITY_NONE || opts->nice_set || opts->ioprio != -1 ||
+           opts->nrlimits > 0;
+}
+
+// Elegir las CPUs del siguiente proceso (o del siguiente job, con numa)
+// Retorna: 1 si *set quedó lleno, 0 si el proceso no se fija a CPUs
+static int place_pick(const place_opts_t *opts, int new_job, cpu_set_t *set) {
+    if (opts->affinity == AFFINITY_NONE || place_ncpus == 0) return 0;
+    if (opts->affinity == AFFINITY_NUMA && place_nnodes > 1) {
+        // Todas las etapas de un job en el mismo nodo (comparten datos por pipes)
+        if (new_job) place_node = (int)(place_next++ % place_nnodes);
+        *set = place_nodes[place_node];
+        return 1;
+    }
+    // rr (o numa con un solo nodo): una CPU por proceso
+    CPU_ZERO(set);
+    CPU_SET(place_cpus[place_next++ % place_ncpus], set);
+    return 1;
+}
+
+// Aplicar las opciones en el proceso actual (el hijo, antes del exec)
+// Sólo usa llamadas al sistema, seguras después de fork
+// Retorna: 0 si todo se aplicó, -1 si alguna falló
+static int place_apply(const place_opts_t *opts, const cpu_set_t *cpus) {
+    if (cpus && sched_setaffinity(0, sizeof(cpu_set_t), cpus) == -1) return -1;
+    if (opts->nice_set && setpriority(PRIO_PROCESS, 0, opts->nice) == -1) return -1;
+    if (opts->ioprio != -1 &&
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, opts->ioprio) == -1) {
+        return -1;
+    }
+    for (int i = 0; i < opts->nrlimits; i++) {
+        struct rlimit lim = { opts->rlimits[i].value, opts->rlimits[i].value };
+        if (setrlimit(opts->rlimits[i].resource, &lim) == -1) return -1;
+    }
+    return 0;
+}
+
+// Interpretar una opción "clave=valor" (la misma sintaxis que los flags)
+// Retorna: 0 si es válida, -1 si no
+static int place_set(place_opts_t *opts, const char *key, const char *value) {
+    char *end;
+    if (strcmp(key, "affinity") == 0) {
+        if (strcmp(value, "none") == 0) opts->affinity = AFFINITY_NONE;
+        else if (strcmp(value, "rr") == 0) opts->affinity = AFFINITY_RR;
+        else if (strcmp(value, "numa") == 0) opts->affinity = AFFINITY_NUMA;
+        else return -1;
+        if (opts->affinity != AFFINITY_NONE) place_init();
+        return 0;
+    }
+    if (strcmp(key, "nice") == 0) {
+        long n = strtol(value, &end, 10);
+        if (end == value || *end || n < -20 || n > 19) return -1;
+        opts->nice_set = 1;
+        opts->nice = (int)n;
+        return 0;
+    }
+    if (strcmp(key, "ioprio") == 0) {
+        // idle | be[:0-7] | rt[:0-7] | none
+        static const char *const classes[] = { "none", "rt", "be", "idle" };
+        const char *colon = strchr(value, ':');
+        size_t len = colon ? (size_t)(colon - value) : strlen(value);
+        long level = 4;  // Nivel por defecto de be/rt
+        if (colon) {
+            level = strtol(colon + 1, &end, 10);
+            if (end == colon + 1 || *end || level < 0 || level > 7) return -1;
+        }
+        for (int c = 0; c < 4; c++) {
+            if (strlen(classes[c]) == len && strncmp(value, classes[c], len) == 0) {
+                if (c == 0) opts->ioprio = -1;
+                else opts->ioprio = (c << IOPRIO_CLASS_SHIFT) | (c == 3 ? 0 : (int)level);
+                return 0;
+            }
+        }
+        return -1;
+    }
+    if (strcmp(key, "rlimit") == 0) {
+        // RES:N o RES:unlimited; repetir un recurso reemplaza su valor
+        const char *colon = strchr(value, ':');
+        if (!colon) return -1;
+        rlim_t limit;
+        if (strcmp(colon + 1, "unlimited") == 0) {
+            limit = RLIM_INFINITY;
+        } else {
+            errno = 0;
+            limit = strtoull(colon + 1, &end, 10);
+            if (end == colon + 1 || *end || errno || colon[1] == '-') return -1;
+        }
+        for (int r = 0; place_rlimit_names[r].name; r++) {
+            const char *name = place_rlimit_names[r].name;
+            if (strlen(name) != (size_t)(colon - value) ||
+                strncmp(value, name, colon - value) != 0) {
+                continue;
+            }
+            int i = 0;
+            while (i < opts->nrlimits && opts->rlimits[i].resource != place_rlimit_names[r].resource) i++;
+            if (i == PLACE_MAX_RLIMITS) return -1;
+            if (i == opts->nrlimits) opts->nrlimits++;
+            opts->rlimits[i].resource = place_rlimit_names[r].resource;
+            opts->rlimits[i].value = limit;
+            return 0;
+        }
+        return -1;
+    }
+    return -1;
+}
+
+// Builtin: opts
+// opts                 -> mostrar las opciones actuales
+// opts -r              -> volver a las de los flags
+// opts clave=valor ... -> cambiarlas para los comandos siguientes
+static void builtin_opts(char **args) {
+    if (!args[0]) {
+        static const char *const affinities[] = { "none", "rr", "numa" };
+        static const char *const classes[] = { "none", "rt", "be", "idle" };
+        printf("affinity=%s", affinities[place_current.affinity]);
+        if (place_current.nice_set) printf(" nice=%d", place_current.nice);
+        if (place_current.ioprio != -1) {
+            int c = place_current.ioprio >> IOPRIO_CLASS_SHIFT;
+            if (c == 3) printf(" ioprio=idle");
+            else printf(" ioprio=%s:%d", classes[c], place_current.ioprio & 7);
+        }
+        for (int i = 0; i < place_current.nrlimits; i++) {
+            for (int r = 0; place_rlimit_names[r].name; r++) {
+                if (place_rlimit_names[r].resource != place_current.rlimits[i].resource) continue;
+                if (place_current.rlimits[i].value == RLIM_INFINITY) {
+                    printf(" rlimit=%s:unlimited", place_rlimit_names[r].name);
+                } else {
+                    printf(" rlimit=%s:%llu", place_rlimit_names[r].name,
+                           (unsigned long long)place_current.rlimits[i].value);
+                }
+            }
+        }
+        printf("\n");
+        fflush(stdout);
+        return;
+    }
+    if (strcmp(args[0], "-r") == 0 && !args[1]) {
+        place_current = place_defaults;
+        return;
+    }
+    // Validar todo antes de cambiar nada
+    place_opts_t next = place_current;
+    for (int i = 0; args[i]; i++) {
+        char *eq = strchr(args[i], '=');
+        if (!eq) {
+            util_print_error();
+            return;
+        }
+        *eq = '\0';
+        int bad = place_set(&next, args[i], eq + 1) == -1;
+        *eq = '=';
+        if (bad) {
+            util_print_error();
+            return;
+        }
+    }
+    place_current = next;
+}
+
+// ====== Registro de builtins y plugins (load) ======
+// Todos los comandos que el shell resuelve por nombre sin buscar en el PATH
+// están en una tabla hash (FNV-1a + sondeo lineal), así el despacho cuesta
+// un hash y una comparación en vez de una cadena de strcmp:
+//   - builtins del shell (cambian su estado: exit, cd, path, ...)
+//   - utilidades internas (echo, sleep, ...; ver inproc_try)
+//   - comandos de plugins cargados con 'load' (ABI en gtesh_plugin.h)
+// Un comando de plugin corre dentro del shell como un job sin procesos, o,
+// si es aislado ('load -i' o GTESH_CMD_ISOLATED), en un worker ya creado
+// con fork: el shell le pasa argv y los fds por un socket (SCM_RIGHTS) y
+// recibe el estado; si el plugin se cae, el worker se vuelve a crear.
+
+#define PLUGIN_MSG_MAX (64 << 10)  // argv serializado máximo hacia el worker
+
+typedef struct {
+    const char *name;              // NULL = slot vacío
+    void (*shell)(char **args);    // Builtin del shell (recibe args sin el nombre)
+    gtesh_cmd_fn plugin;           // Comando de un plugin
+    int util;                      // Índice en inproc_utils, o -1
+    int isolated;                  // Plugin: correr en el worker
+    const char *lib;               // Plugin: biblioteca que lo registró
+} builtin_t;
+
+static builtin_t *builtin_table = NULL;
+static size_t builtin_cap = 0;        // Potencia de 2
+static size_t builtin_used = 0;
+static unsigned long builtin_gen = 0; // Cambia con cada alta/baja (autocompletado)
+
+static void builtin_load(char **args);
+
+// Slot de 'name': el que lo contiene, o el vacío donde iría
+static size_t builtin_slot(const builtin_t *table, size_t cap, const char *name) {
+    size_t i = hash_string(name) & (cap - 1);
+    while (table[i].name && strcmp(table[i].name, name) != 0) i = (i + 1) & (cap - 1);
+    return i;
+}
+
+static const builtin_t *builtin_lookup(const char *name) {
+    if (!builtin_cap) return NULL;
+    const builtin_t *b = &builtin_table[builtin_slot(builtin_table, builtin_cap, name)];
+    return b->name ? b : NULL;
+}
+
+// Agregar una entrada (el nombre no se copia). Retorna: 0, o -1 si ya
+// existe o no hay memoria
+static int builtin_add(const builtin_t *entry) {
+    if ((builtin_used + 1) * 2 > builtin_cap) {  // Mantener carga <= 1/2
+        size_t cap = builtin_cap ? builtin_cap * 2 : 64;
+        builtin_t *table = calloc(cap, sizeof(builtin_t));
+        if (!table) return -1;
+        for (size_t i = 0; i < builtin_cap; i++) {
+            if (builtin_table[i].name) {
+                table[builtin_slot(table, cap, builtin_table[i].name)] = builtin_table[i];
+            }
+        }
+        free(builtin_table);
+        builtin_table = table;
+        builtin_cap = cap;
+    }
+    size_t i = builtin_slot(builtin_table, builtin_cap, entry->name);
+    if (builtin_table[i].name) return -1;
+    builtin_table[i] = *entry;
+    builtin_used++;
+    builtin_gen++;
+    return 0;
+}
+
+// Builtin: exit
+// Debe invocarse sin argumentos, termina el shell con exit(0)
+static void builtin_exit(char **args) {
+    if (args[0]) {  // Si hay argumentos después de exit -> error
+        util_print_error();
+        return;
+    }
+    exit(0);  // Terminar el shell limpiamente
+}
+
+// Builtin: cd
+// Requiere EXACTAMENTE 1 argumento (el directorio destino)
+static void builtin_cd(char **args) {
+    if (!args[0] || args[1]) {  // 0 argumentos o más de 1 -> error
+        util_print_error();
+        return;
+    }
+    // chdir() cambia el directorio de trabajo del proceso
+    if (chdir(args[0]) != 0) {  // Si falla (ej: no existe)
+        util_print_error();
+        return;
+    }
+    path_state_chdir();  // Los dirs relativos del PATH cambiaron de destino
+    journal_state_dirty = 1;
+}
+
+// Builtin: path
+// Acepta 0 o más argumentos; reemplaza el PATH completo
+static void builtin_path(char **args) {
+    // Contar cuántos directorios se pasaron
+    int count = 0;
+    while (args[count]) count++;
+    // Actualizar PATH global; si count==0 se vacía el PATH
+    update_path(args, count);
+    journal_state_dirty = 1;
+}
+
+// Registrar los builtins del shell y las utilidades internas
+static void builtin_init(void) {
+    static const struct {
+        const char *name;
+        void (*fn)(char **args);
+    } shell[] = {
+        { "exit", builtin_exit },
+        { "cd", builtin_cd },
+        { "path", builtin_path },
+        { "hash", builtin_hash },              // Caché de ejecutables
+        { "jobs-limit", builtin_jobs_limit },  // Máximo de comandos paralelos
+        { "opts", builtin_opts },              // Colocación y prioridad
+        { "cache", builtin_cache },            // Caché de resultados (-s, -r)
+        { "jobs", builtin_jobs },              // Control de jobs (interactivo)
+        { "fg", builtin_fg },
+        { "bg", builtin_bg },
+        { "wait", builtin_wait },
+        { "load", builtin_load },              // Cargar un plugin
+    };
+    for (size_t i = 0; i < sizeof(shell) / sizeof(shell[0]); i++) {
+        builtin_t b = { shell[i].name, shell[i].fn, NULL, -1, 0, NULL };
+        if (builtin_add(&b) == -1) {
+            util_print_error();
+            exit(1);
+        }
+    }
+    for (int u = 0; inproc_utils[u].name; u++) {
+        builtin_t b = { inproc_utils[u].name, NULL, NULL, u, 0, NULL };
+        if (builtin_add(&b) == -1) {
+            util_print_error();
+            exit(1);
+        }
+    }
+}
+
+// Builtins del shell: no pueden ir en un pipeline y son barreras en
+// --parallel-batch (ver handle_builtin)
+static int is_builtin_name(const char *name) {
+    const builtin_t *b = builtin_lookup(name);
+    return b && b->shell;
+}
+
+// Manejar comandos incorporados (builtins): exit, cd, path, hash, jobs-limit,
+// opts, cache, jobs, fg, bg, wait, load
+// Retorna: 1 si es un builtin (aunque falle), 0 si no es builtin
+static int handle_builtin(cmd_t *cmd) {
+    if (!cmd || !cmd->argv || !cmd->argv[0]) return 0;  // Validación
+    const builtin_t *b = builtin_lookup(cmd->argv[0]);
+    if (!b || !b->shell) return 0;  // Debe ejecutarse como programa externo
+    b->shell(cmd->argv + 1);  // +1 para saltar el nombre
+    return 1;
+}
+
+// ---- Plugins ----
+
+static arena_t plugin_arena = {NULL, NULL, 0};   // Memoria de ctx->alloc
+static const char *plugin_loading = NULL;        // Biblioteca en gtesh_plugin_init
+static int plugin_loading_isolated = 0;
+static int plugin_registered = 0;
+static int plugin_worker_fd = -1;                // Socket con el worker aislado
+static pid_t plugin_worker_pid = -1;
+static int plugin_worker_dead = 0;               // wait4(-1) ya lo recolectó (sin pidfd)
+static int plugin_worker_status = 0;             // Su estado, en ese caso
+static ev_source_t plugin_src = { EV_PLUGIN };   // plugin_worker_fd en el epoll
+
+static void *plugin_alloc(gtesh_ctx_t *ctx, size_t size) {
+    return arena_alloc((arena_t *)ctx->priv, size);
+}
+
+// host->register_cmd: sólo válido mientras se carga un plugin
+static int plugin_register(const char *name, gtesh_cmd_fn fn, uint32_t flags) {
+    if (!plugin_loading || !name || !*name || !fn || strpbrk(name, "/ \t&|>")) return -1;
+    if (builtin_lookup(name)) return -1;
+    char *copy = strdup(name);
+    if (!copy) return -1;
+    builtin_t b = { copy, NULL, fn, -1,
+                    plugin_loading_isolated || (flags & GTESH_CMD_ISOLATED), plugin_loading };
+    if (builtin_add(&b) == -1) {
+        free(copy);
+        return -1;
+    }
+    plugin_registered++;
+    return 0;
+}
+
+// Quitar los comandos de una biblioteca (su init falló): reconstruir la tabla
+static void plugin_unregister(const char *lib) {
+    builtin_t *old = builtin_table;
+    size_t cap = builtin_cap;
+    builtin_table = NULL;
+    builtin_cap = builtin_used = 0;
+    for (size_t i = 0; i < cap; i++) {
+        if (!old[i].name) continue;
+        if (old[i].lib == lib) {
+            free((char *)old[i].name);
+        } else {
+            builtin_add(&old[i]);  // Cabe: la tabla nueva crece igual que la vieja
+        }
+    }
+    free(old);
+}
+
+// Ejecutar un comando de plugin en este proceso. Retorna: estado de salida
+static int plugin_call(const builtin_t *b, char **argv, int in_fd, int out_fd, int err_fd) {
+    int argc = 0;
+    while (argv[argc]) argc++;
+    gtesh_ctx_t ctx = { GTESH_PLUGIN_ABI, in_fd, out_fd, err_fd, plugin_alloc, &plugin_arena };
+    // Un stdout cerrado no debe matar al shell con SIGPIPE (sólo fallar el write)
+    struct sigaction ign = { .sa_handler = SIG_IGN }, old;
+    sigaction(SIGPIPE, &ign, &old);
+    int status = b->plugin(argc, argv, &ctx) & 0xff;
+    sigaction(SIGPIPE, &old, NULL);
+    arena_reset(&plugin_arena);
+    return status;
+}
+
+// Código del worker: recibir pedidos {slot, argc, argv...} + 3 fds,
+// ejecutarlos y responder el estado. Termina cuando el shell cierra el socket
+static void plugin_worker_main(int sock) {
+    // Como un hijo: Ctrl+C lo interrumpe (el shell lo ignora y lo recrea)
+    static const int sigs[] = { SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGCHLD };
+    for (size_t i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i++) signal(sigs[i], SIG_DFL);
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+
+    static char buf[PLUGIN_MSG_MAX];
+    while (1) {
+        union {
+            char buf[CMSG_SPACE(3 * sizeof(int))];
+            struct cmsghdr align;
+        } ctrl;
+        struct iovec iov = { buf, sizeof(buf) - 1 };
+        struct msghdr msg = {
+            .msg_iov = &iov, .msg_iovlen = 1,
+            .msg_control = ctrl.buf, .msg_controllen = sizeof(ctrl.buf)
+        };
+        ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) _exit(0);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        uint32_t hdr[2];
+        if ((size_t)n < sizeof(hdr) || !cm || cm->cmsg_type != SCM_RIGHTS ||
+            cm->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+            _exit(1);
+        }
+        int fds[3];
+        memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+        memcpy(hdr, buf, sizeof(hdr));
+        buf[n] = '\0';
+
+        // argv: hdr[1] strings seguidos, terminados en '\0'
+        int status = 127;
+        char **argv = arena_alloc(&plugin_arena, (hdr[1] + 1) * sizeof(char *));
+        char *p = buf + sizeof(hdr), *end = buf + n;
+        uint32_t argc = 0;
+        while (argv && argc < hdr[1] && p < end) {
+            argv[argc++] = p;
+            p += strlen(p) + 1;
+        }
+        if (argv && argc == hdr[1] && argc > 0 && hdr[0] < builtin_cap &&
+            builtin_table[hdr[0]].plugin) {
+            argv[argc] = NULL;
+            status = plugin_call(&builtin_table[hdr[0]], argv, fds[0], fds[1], fds[2]);
+        }
+        arena_reset(&plugin_arena);
+        for (int i = 0; i < 3; i++) close(fds[i]);
+        while (send(sock, &status, sizeof(status), MSG_NOSIGNAL) == -1 && errno == EINTR);
+    }
+}
+
+// Crear el worker (con todos los plugins ya cargados) antes de necesitarlo
+static void plugin_worker_start(void) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) return;
+    fflush(NULL);  // Que el worker no herede buffers de stdio sin vaciar
+    pid_t pid = fork();
+    if (pid == -1) {
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        plugin_worker_main(sv[1]);  // No retorna
+    }
+    close(sv[1]);
+    plugin_worker_fd = sv[0];
+    plugin_worker_pid = pid;
+    plugin_worker_dead = 0;
+}
+
+// El worker es hijo del shell: sin pidfd, el wait4(-1) de reap_events
+// también lo recolecta. Guardar su estado para plugin_worker_stop
+// Retorna: 1 si 'pid' era el worker
+static int plugin_worker_reaped(pid_t pid, int status) {
+    if (plugin_worker_pid == -1 || pid != plugin_worker_pid) return 0;
+    plugin_worker_dead = 1;
+    plugin_worker_status = status;
+    return 1;
+}
+
+// Terminar el worker. Retorna: su estado (wait), o 0 si no había
+static int plugin_worker_stop(void) {
+    int status = 0;
+    if (plugin_worker_pid == -1) return 0;
+    close(plugin_worker_fd);
+    if (plugin_worker_dead) {
+        status = plugin_worker_status;  // Ya recolectado: su PID pudo reutilizarse
+    } else {
+        kill(plugin_worker_pid, SIGKILL);  // Si seguía vivo; si ya murió no cambia su estado
+        while (waitpid(plugin_worker_pid, &status, 0) == -1) {
+            if (errno != EINTR) {
+                status = SIGKILL;
+                break;
+            }
+        }
+    }
+    plugin_worker_fd = -1;
+    plugin_worker_pid = -1;
+    plugin_worker_dead = 0;
+    return status;
+}
+
+// Esperar a que el worker responda (o muera) sin congelar el shell: el
+// socket está en el epoll y mientras tanto se atienden los demás jobs. Con
+// timeout_ns, al vencer el plazo el worker recibe SIGKILL
+// Retorna: 0 si hay algo para leer, -1 si venció el plazo
+static int plugin_wait_reply(long long timeout_ns) {
+    long long deadline = timeout_ns ? now_ns() + timeout_ns : 0;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &plugin_src };
+    int in_epoll = pidfd_supported && epoll_ctl(ev_epfd, EPOLL_CTL_ADD, plugin_worker_fd, &ev) == 0;
+    struct pollfd pfd = { plugin_worker_fd, POLLIN, 0 };
+    int ret = 0, r;
+    while ((r = poll(&pfd, 1, 0)) == 0 || (r == -1 && errno == EINTR)) {
+        int ms = -1;
+        if (deadline) {
+            long long left = deadline - now_ns();
+            if (left <= 0) {
+                kill(plugin_worker_pid, SIGKILL);
+                ret = -1;
+                break;
+            }
+            ms = (int)((left + 999999) / 1000000);
+        }
+        if (in_epoll && running_count > 0) {
+            reap_events(ms);
+        } else {
+            // Sin pidfd: reap_events no usa el epoll; revisar los hijos cada tanto
+            if (ms == -1 || ms > POLL_CHILD_MS) ms = POLL_CHILD_MS;
+            poll(&pfd, 1, ms);
+            reap_events(0);
+        }
+    }
+    if (in_epoll) epoll_ctl(ev_epfd, EPOLL_CTL_DEL, plugin_worker_fd, NULL);
+    return ret;
+}
+
+// Ejecutar un comando aislado en el worker (*timed_out = 2 si se lo mató
+// por timeout_ns)
+// Retorna: estado como el de wait4 (exit N, o la señal que mató al worker)
+static int plugin_call_isolated(const builtin_t *b, char **argv, int in_fd, int out_fd, int err_fd,
+                                long long timeout_ns, int *timed_out) {
+    static char buf[PLUGIN_MSG_MAX];
+    uint32_t hdr[2] = { (uint32_t)(b - builtin_table), 0 };
+    size_t len = sizeof(hdr);
+    for (; argv[hdr[1]]; hdr[1]++) {
+        size_t n = strlen(argv[hdr[1]]) + 1;
+        if (len + n >= sizeof(buf)) {  // argv demasiado largo para un mensaje
+            util_print_error();
+            return 1 << 8;
+        }
+        memcpy(buf + len, argv[hdr[1]], n);
+        len += n;
+    }
+    memcpy(buf, hdr, sizeof(hdr));
+    if (plugin_worker_dead) plugin_worker_stop();  // Murió entre comandos (ej: Ctrl+C)
+    if (plugin_worker_pid == -1) plugin_worker_start();
+    if (plugin_worker_pid == -1) {
+        util_print_error();
+        return 1 << 8;
+    }
+
+    int fds[3] = { in_fd, out_fd, err_fd };
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } ctrl;
+    memset(&ctrl, 0, sizeof(ctrl));
+    struct iovec iov = { buf, len };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = ctrl.buf, .msg_controllen = sizeof(ctrl.buf)
+    };
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+    int status;
+    ssize_t n;
+    while ((n = sendmsg(plugin_worker_fd, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR);
+    if (n != -1) {
+        if (plugin_wait_reply(timeout_ns) == -1) {
+            *timed_out = 2;
+        } else {
+            while ((n = recv(plugin_worker_fd, &status, sizeof(status), 0)) == -1 && errno == EINTR);
+            if (n == sizeof(status)) return status << 8;
+        }
+    }
+    // El worker murió (el plugin se cayó o se colgó y venció su plazo): su
+    // estado es el del comando, y se crea otro para el próximo
+    status = plugin_worker_stop();
+    plugin_worker_start();
+    return status;
+}
+
+// Ejecutar un comando de plugin como un job sin procesos
+static void plugin_run(cmd_t *cmd, const builtin_t *b) {
+    long long trace_start = TRACE_BEGIN();
+    int out_fd = STDOUT_FILENO, err_fd = STDERR_FILENO, status;
+    if (cmd->redir_file) {
+        out_fd = open(cmd->redir_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out_fd == -1) {
+            util_print_error();
+            return;
+        }
+        err_fd = out_fd;
+    }
+    job_t *job = job_new(cmd, 1);
+    int timed_out = 0;
+    if (b->isolated) {
+        status = plugin_call_isolated(b, cmd->argv, STDIN_FILENO, out_fd, err_fd,
+                                      cmd->timeout_ns, &timed_out);
+    } else {
+        status = plugin_call(b, cmd->argv, STDIN_FILENO, out_fd, err_fd) << 8;
+    }
+    if (out_fd != STDOUT_FILENO) close(out_fd);
+    TRACE_END("plugin", trace_start, b->isolated);
+    if (!job) return;
+    job->status = status;
+    job->timed_out = timed_out;
+    job_complete(job);
+}
+
+// Builtin: load
+// load             -> listar los comandos de plugins (nombre, biblioteca)
+// load [-i] LIB.so -> cargar un plugin; con -i sus comandos corren en el
+//                     worker aislado
+static void builtin_load(char **args) {
+    if (!args[0]) {
+        for (size_t i = 0; i < builtin_cap; i++) {
+            const builtin_t *b = &builtin_table[i];
+            if (b->name && b->plugin) {
+                printf("%s\t%s%s\n", b->name, b->lib, b->isolated ? "\t(aislado)" : "");
+            }
+        }
+        fflush(stdout);
+        return;
+    }
+    int isolated = strcmp(args[0], "-i") == 0;
+    if (isolated) args++;
+    if (!args[0] || args[1]) {
+        util_print_error();
+        return;
+    }
+
+    // RTLD_NOW: un símbolo faltante falla aquí y no a mitad de un comando
+    void *handle = dlopen(args[0], RTLD_NOW | RTLD_LOCAL);
+    int (*init)(const gtesh_host_t *) = NULL;
+    char *lib = strdup(args[0]);
+    if (handle) *(void **)&init = dlsym(handle, GTESH_PLUGIN_INIT_SYM);
+    if (!handle || !init || !lib) {
+        if (handle) dlclose(handle);
+        free(lib);
+        util_print_error();
+        return;
+    }
+    gtesh_host_t host = { GTESH_PLUGIN_ABI, plugin_register };
+    plugin_loading = lib;
+    plugin_loading_isolated = isolated;
+    plugin_registered = 0;
+    int err = init(&host);
+    plugin_loading = NULL;
+    if (err != 0 || plugin_registered == 0) {
+        plugin_unregister(lib);
+        dlclose(handle);
+        free(lib);
+        util_print_error();
+        return;
+    }
+    // El worker aislado se crea con fork: que tenga también este plugin
+    plugin_worker_stop();
+    for (size_t i = 0; i < builtin_cap; i++) {
+        if (builtin_table[i].name && builtin_table[i].isolated) {
+            plugin_worker_start();
+            break;
+        }
+    }
+}
+
+// Intentar ejecutar un comando de una etapa dentro del shell
+// Retorna: 1 si se ejecutó (su job ya terminó o, si es sleep, está en
+// curso), 0 si debe ejecutarse como proceso externo
+static int inproc_try(cmd_t *cmd, const char *exec_path, cache_key_t key, int use_cache) {
+    const builtin_t *b = builtin_lookup(cmd->argv[0]);
+    if (!b || b->util < 0 || !inproc_is_system(b->util, exec_path)) return 0;
+    int u = b->util;
+    long long sleep_ns = 0;
+    if (!inproc_utils[u].run) {  // sleep
+        sleep_ns = inproc_sleep_ns(cmd->argv);
+        // Sin epoll de hijos, o con control de jobs (Ctrl+C/Ctrl+Z deben
+        // llegarle a un proceso): externo
+        // Con timeout, el watchdog necesita un proceso al que enviar señales
+        if (sleep_ns < 0 || !pidfd_supported || job_control || cmd->timeout_ns) return 0;
+    }
+
+    long long trace_start = TRACE_BEGIN();
+    int out_fd = STDOUT_FILENO, err_fd = STDERR_FILENO, status = 0;
+    if (cmd->redir_file) {
+        out_fd = open(cmd->redir_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out_fd == -1) {
+            util_print_error();
+            return 1;
+        }
+        err_fd = out_fd;
+    }
+    if (inproc_utils[u].run) {
+        // Un stdout cerrado no debe matar al shell con SIGPIPE (sólo fallar el write)
+        struct sigaction ign = { .sa_handler = SIG_IGN }, old;
+        sigaction(SIGPIPE, &ign, &old);
+        status = inproc_utils[u].run(cmd->argv, out_fd, err_fd);
+        sigaction(SIGPIPE, &old, NULL);
+        if (status == -1) {  // Opción no implementada: usar el ejecutable
+            if (out_fd != STDOUT_FILENO) close(out_fd);
+            return 0;
+        }
+    }
+    if (out_fd != STDOUT_FILENO) close(out_fd);
+    TRACE_END("inproc", trace_start, u);
+
+    job_t *job = job_new(cmd, 1);
+    if (!job) return 1;
+    job->status = status << 8;  // Como lo reportaría wait4 para exit(status)
+    if (use_cache) {
+        cache_misses++;
+        job->cache = CACHE_MISS;
+        job->cache_key = key;
+    }
+    if (!inproc_utils[u].run && inproc_sleep_start(job, sleep_ns) == 0) return 1;
+    if (!inproc_utils[u].run) {  // Sin timerfd: dormir aquí
+        struct timespec ts = { sleep_ns / 1000000000, sleep_ns % 1000000000 };
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+    }
+    job_complete(job);
+    return 1;
+}
+
+// Vectores de trabajo del parser: acumulan los argumentos del comando y los
+// comandos de la línea mientras se recorre; al terminar se copian a la arena
+// con el tamaño exacto. Crecen con realloc y se reutilizan entre líneas.
+static char **scratch_args = NULL;
+static size_t scratch_args_cap = 0;
+static cmd_t **scratch_cmds = NULL;
+static size_t scratch_cmds_cap = 0;
+
+// Asegurar espacio para n punteros en un vector de trabajo
+static int scratch_reserve(void ***vec, size_t *cap, size_t n) {
+    if (n <= *cap) return 0;
+    size_t new_cap = *cap ? *cap * 2 : 16;
+    while (new_cap < n) new_cap *= 2;
+    void **grown = realloc(*vec, new_cap * sizeof(void*));
+    if (!grown) return -1;
+    *vec = grown;
+    *cap = new_cap;
+    return 0;
+}
+
+// Construir el cmd_t de un comando ya tokenizado (argv y redir en scratch)
+// Retorna: cmd_t asignado en la arena, o NULL si no hay memoria
+static cmd_t *build_command(size_t argc, char *redir_file) {
+    cmd_t *cmd = arena_alloc(parse_arena, sizeof(cmd_t));
+    char **argv = arena_alloc(parse_arena, (argc + 1) * sizeof(char*));  // +1 para NULL final
+    if (!cmd || !argv) return NULL;
+    memcpy(argv, scratch_args, argc * sizeof(char*));
+    argv[argc] = NULL;  // Terminar con NULL (requerido por execv)
+    cmd->argv = argv;
+    cmd->redir_file = redir_file;
+    cmd->is_background = 1;  // Se ajusta para el último comando al terminar la línea
+    cmd->pipe_next = NULL;
+    cmd->index = 0;
+    cmd->timed = 0;
+    cmd->cached = 0;
+    cmd->timeout_ns = 0;
+    return cmd;
+}
+
+// Prefijos que puede llevar un comando (ver apply_prefixes) y cuántos
+// argumentos propios toman antes del comando; el autocompletado los ofrece
+// y los salta para encontrar la palabra de comando
+static const struct {
+    const char *name;
+    int args;
+} cmd_prefixes[] = {
+    { "time", 0 }, { "cache", 0 }, { "timeout", 1 }, { NULL, 0 }
+};
+
+// Aplicar los prefijos del comando ('time', 'cache' y 'timeout', en cualquier orden)
+// "time cmd args" -> cmd args con timed = 1; "time" sólo es un error
+// "cache cmd args" -> cmd args con cached = 1 ("cache -s" es el builtin)
+// "timeout N cmd args" -> cmd args con timeout_ns = N (0 = sin límite); sin
+// comando o con una duración inválida, 'timeout' es un comando externo más
+// Sin prefijo 'timeout' se usa el de --timeout
+// Retorna: 0 si es válido, -1 si hay error de sintaxis
+static int apply_prefixes(cmd_t *cmd) {
+    double secs;
+    int has_timeout = 0;
+    while (1) {
+        if (strcmp(cmd->argv[0], "time") == 0 && !cmd->timed) {
+            if (!cmd->argv[1]) return -1;
+            cmd->argv++;
+            cmd->timed = 1;
+        } else if (strcmp(cmd->argv[0], "cache") == 0 && !cmd->cached &&
+                   cmd->argv[1] && cmd->argv[1][0] != '-') {
+            cmd->argv++;
+            cmd->cached = 1;
+        } else if (strcmp(cmd->argv[0], "timeout") == 0 && !has_timeout &&
+                   cmd->argv[1] && cmd->argv[2] && (secs = parse_duration(cmd->argv[1])) >= 0) {
+            cmd->argv += 2;
+            cmd->timeout_ns = secs < 9e9 ? (long long)(secs * 1e9) : 0;
+            has_timeout = 1;
+        } else {
+            if (!has_timeout) cmd->timeout_ns = timeout_default_ns;
+            return 0;
+        }
+    }
+}
+
+// ====== Expansión de comodines (*, ?, [...]) ======
+// Un argumento con '*', '?' o '[' se reemplaza por los nombres que coinciden,
+// ordenados (como sh); si no coincide ninguno queda tal cual. Los nombres
+// que empiezan con '.' sólo coinciden si el patrón también lo hace.
+// Cada directorio se lee una sola vez con getdents64 (en bloques grandes,
+// sin readdir) y sus registros quedan en una caché identificada por
+// dispositivo + inodo: la siguiente expansión sólo hace un stat y, si el
+// mtime no cambió, reutiliza la lista. Los argumentos expandidos se copian
+// directo a la arena del parser y se agregan al argv en construcción.
+
+#define GLOB_DENTS_CHUNK (256 << 10)  // Bytes mínimos libres por llamada a getdents64
+#define GLOB_CACHE_DIRS 64            // Directorios en caché (se desaloja el menos usado)
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;                // Vacío si buf == NULL
+    struct timespec mtime;    // mtime al momento de leerlo
+    char *buf;                // Registros linux_dirent64 seguidos, tal como llegan
+    size_t len;
+    unsigned long used;       // Último uso (LRU)
+} glob_dir_t;
+
+// Registro de getdents64 (no lo exporta glibc)
+struct glob_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static glob_dir_t glob_cache[GLOB_CACHE_DIRS];
+static unsigned long glob_tick = 0;
+static unsigned long glob_scans = 0, glob_cache_hits = 0;
+
+// Listado del directorio 'path' (desde la caché si no cambió)
+// Retorna: la entrada, o NULL si no es un directorio legible
+static const glob_dir_t *glob_dir_get(const char *path) {
+    struct stat st;
+    if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode)) return NULL;
+    glob_dir_t *slot = &glob_cache[0];
+    for (int i = 0; i < GLOB_CACHE_DIRS; i++) {
+        glob_dir_t *d = &glob_cache[i];
+        if (d->buf && d->dev == st.st_dev && d->ino == st.st_ino) {
+            slot = d;
+            if (d->mtime.tv_sec == st.st_mtim.tv_sec && d->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+                d->used = ++glob_tick;
+                glob_cache_hits++;
+                return d;
+            }
+            break;  // Cambió: volver a leerlo en el mismo slot
+        }
+        if (!d->buf ? slot->buf != NULL : slot->buf && d->used < slot->used) slot = d;
+    }
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return NULL;
+    char *buf = slot->buf;  // Se reutiliza (ya tiene el tamaño de otro directorio)
+    size_t cap = buf ? malloc_usable_size(buf) : 0, len = 0;
+    ssize_t n;
+    do {
+        if (cap - len < GLOB_DENTS_CHUNK) {
+            size_t grown_cap = cap ? cap * 2 : 2 * GLOB_DENTS_CHUNK;
+            char *grown = realloc(buf, grown_cap);
+            if (!grown) {
+                n = -1;
+                break;
+            }
+            buf = grown;
+            cap = grown_cap;
+        }
+        n = getdents64(fd, buf + len, cap - len);
+        if (n > 0) len += n;
+    } while (n > 0);
+    close(fd);
+    slot->buf = buf;
+    if (n == -1) {
+        free(slot->buf);
+        slot->buf = NULL;
+        return NULL;
+    }
+    slot->dev = st.st_dev;
+    slot->ino = st.st_ino;
+    slot->mtime = st.st_mtim;
+    slot->len = len;
+    slot->used = ++glob_tick;
+    glob_scans++;
+    return slot;
+}
+
+// Vaciar la caché de directorios (benchmark)
+static void glob_cache_clear(void) {
+    for (int i = 0; i < GLOB_CACHE_DIRS; i++) {
+        free(glob_cache[i].buf);
+        glob_cache[i].buf = NULL;
+    }
+}
+
+// Clase [...] al inicio de p: "[abc]", "[a-z]", "[!x]" o "[^x]" (un ']'
+// recién abierto es literal). Retorna: 1 si c está (o no, si es negada),
+// 0 si no, -1 si no hay ']' (el '[' es literal); *end queda tras el ']'
+static int glob_class(const char *p, char c, const char **end) {
+    const char *q = p + 1;
+    int negate = *q == '!' || *q == '^';
+    if (negate) q++;
+    int match = 0;
+    const char *first = q;
+    while (*q && (*q != ']' || q == first)) {
+        if (q[1] == '-' && q[2] && q[2] != ']') {
+            if ((unsigned char)c >= (unsigned char)q[0] && (unsigned char)c <= (unsigned char)q[2]) match = 1;
+            q += 3;
+        } else {
+            if (c == *q) match = 1;
+            q++;
+        }
+    }
+    if (*q != ']') return -1;
+    *end = q + 1;
+    return match != negate;
+}
+
+// ¿El nombre s coincide con el patrón p (un componente, sin '/')?
+// '*' se resuelve con retroceso sobre la última estrella (lineal en la práctica)
+static int glob_match(const char *p, const char *s) {
+    const char *star_p = NULL, *star_s = NULL;
+    while (*s) {
+        if (*p == '*') {
+            star_p = ++p;
+            star_s = s;
+            continue;
+        }
+        if (*p == '?') {
+            p++;
+            s++;
+            continue;
+        }
+        if (*p == '[') {
+            const char *end;
+            int m = glob_class(p, *s, &end);
+            if (m == 1) {
+                p = end;
+                s++;
+                continue;
+            }
+            if (m == -1 && *s == '[') {
+                p++;
+                s++;
+                continue;
+            }
+        } else if (*p == *s) {
+            p++;
+            s++;
+            continue;
+        }
+        if (!star_p) return 0;
+        p = star_p;
+        s = ++star_s;
+    }
+    while (*p == '*') p++;
+    return *p == '\0';
+}
+
+static int glob_has_magic(const char *s, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (s[i] == '*' || s[i] == '?' || s[i] == '[') return 1;
+    }
+    return 0;
+}
+
+// Agregar path[0..len) como argumento: copia en la arena, puntero en scratch_args
+static int glob_emit(const char *path, size_t len, size_t *argc) {
+    char *arg = arena_alloc(parse_arena, len + 1);
+    if (!arg || scratch_reserve((void ***)&scratch_args, &scratch_args_cap, *argc + 1) == -1) {
+        return -1;
+    }
+    memcpy(arg, path, len);
+    arg[len] = '\0';
+    scratch_args[(*argc)++] = arg;
+    return 0;
+}
+
+// Recorrer el patrón componente a componente. path[0..len) es el prefijo ya
+// resuelto (con su '/' final); rest, lo que falta del patrón
+// Retorna: 0, o -1 si no hay memoria
+static int glob_walk(char *path, size_t len, const char *rest, size_t *argc) {
+    const char *slash = strchr(rest, '/');
+    size_t clen = slash ? (size_t)(slash - rest) : strlen(rest);
+    const char *next = slash;
+    while (next && *next == '/') next++;
+    int last = !next || !*next;  // Último componente (quizás con '/' final)
+
+    if (!glob_has_magic(rest, clen)) {  // Componente literal: sólo avanzar
+        if (len + clen + 2 >= PATH_MAX) return 0;
+        memcpy(path + len, rest, clen);
+        len += clen;
+        if (!last) {
+            path[len++] = '/';
+            return glob_walk(path, len, next, argc);
+        }
+        if (slash) path[len++] = '/';
+        path[len] = '\0';
+        struct stat st;
+        if (fstatat(AT_FDCWD, path, &st, slash ? 0 : AT_SYMLINK_NOFOLLOW) == -1) return 0;
+        return glob_emit(path, len, argc);
+    }
+
+    char comp[NAME_MAX + 1];
+    if (clen > NAME_MAX) return 0;
+    memcpy(comp, rest, clen);
+    comp[clen] = '\0';
+    path[len] = '\0';
+    const glob_dir_t *d = glob_dir_get(len ? path : ".");
+    if (!d) return 0;
+    for (size_t off = 0; off < d->len;) {
+        const struct glob_dirent64 *de = (const struct glob_dirent64 *)(d->buf + off);
+        off += de->d_reclen;
+        const char *name = de->d_name;
+        if (name[0] == '.' && (comp[0] != '.' || !name[1] || (name[1] == '.' && !name[2]))) {
+            continue;  // Ocultos sólo con '.' explícito; nunca '.' ni '..'
+        }
+        if (!glob_match(comp, name)) continue;
+        size_t nlen = strlen(name);
+        if (len + nlen + 2 >= PATH_MAX) continue;
+        memcpy(path + len, name, nlen);
+        size_t sub = len + nlen;
+        if (slash) {  // Debe ser un directorio (o un enlace a uno)
+            if (de->d_type != DT_DIR) {
+                struct stat st;
+                path[sub] = '\0';
+                if (de->d_type != DT_LNK && de->d_type != DT_UNKNOWN) continue;
+                if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode)) continue;
+            }
+            path[sub++] = '/';
+        }
+        int err = last ? glob_emit(path, sub, argc) : glob_walk(path, sub, next, argc);
+        if (err == -1) return -1;
+    }
+    return 0;
+}
+
+static int glob_arg_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Expandir el argumento scratch_args[*argc - 1] (terminado en '\0')
+// Retorna: 0 (expandido o dejado literal), o -1 si no hay memoria
+static int glob_expand(size_t *argc) {
+    char path[PATH_MAX];
+    const char *pattern = scratch_args[*argc - 1];
+    size_t start = *argc;
+    long long trace_start = TRACE_BEGIN();
+    size_t len = 0;
+    while (pattern[len] == '/') path[len++] = *pattern++;  // Ruta absoluta
+    int err = glob_walk(path, len, pattern, argc);
+    TRACE_END("glob", trace_start, *argc - start);
+    if (err == -1) return -1;
+    if (*argc == start) return 0;  // Sin coincidencias: el patrón queda literal
+    qsort(scratch_args + start, *argc - start, sizeof(char *), glob_arg_cmp);
+    memmove(scratch_args + start - 1, scratch_args + start, (*argc - start) * sizeof(char *));
+    (*argc)--;
+    return 0;
+}
+
+// Clase de cada byte para el bucle de tokens: una sola consulta por carácter
+#define TOK_END 0x1    // Termina el token: '\0', ' ', '\t', '&', '>', '|'
+#define TOK_MAGIC 0x2  // Comodín: '*', '?', '['
+static const unsigned char tok_class[256] = {
+    ['\0'] = TOK_END, [' '] = TOK_END, ['\t'] = TOK_END, ['&'] = TOK_END,
+    ['>'] = TOK_END, ['|'] = TOK_END,
+    ['*'] = TOK_MAGIC, ['?'] = TOK_MAGIC, ['['] = TOK_MAGIC,
+};
+
+// Dividir una línea en comandos paralelos (separados por '&') y parsear cada uno
+// Ejemplo: "ls & echo uno > f & pwd" -> [ls], [echo uno > f], [pwd]
+// Cada comando puede ser un pipeline: "ls | wc -l > f" -> [ls]->[wc -l > f]
+// Tokeniza en UNA sola pasada y sin copiar: los separadores (espacio, tab, '&',
+// '|', '>') se reemplazan por '\0' dentro de 'line' y argv apunta a esos tokens.
+// Por eso 'line' debe seguir viva hasta que terminen los comandos.
+// Errores de sintaxis (se reporta uno por comando y ese comando se descarta):
+//   "> f" (sin comando), "ls >" (sin archivo), "ls > a > b", "ls > a b",
+//   "ls > f | wc" ('>' antes del último '|'), "| wc", "ls |", "ls | | wc"
+// line: Línea completa con posibles '&'
+// count: (salida) Número de comandos encontrados
+// Retorna: Array de cmd_t* (en parse_arena), o NULL si no hay comandos
+static cmd_t **split_parallel_commands(char *line, int *count) {
+    *count = 0;
+    size_t ncmds = 0;      // Comandos válidos en scratch_cmds
+    size_t argc = 0;       // Argumentos de la etapa actual
+    char *redir = NULL;    // Archivo de redirección de la etapa actual
+    int saw_gt = 0;        // Se vio '>' en la etapa actual
+    int bad = 0;           // El comando actual tiene un error de sintaxis
+    int trailing_amp = 0;  // El último separador significativo fue '&'
+    int piped = 0;         // Se vio '|' en el comando actual
+    cmd_t *head = NULL;    // Primera etapa del pipeline actual
+    cmd_t *tail = NULL;    // Última etapa agregada
+    char *p = line;
+
+    while (1) {
+        // Saltar espacios entre tokens
+        while (*p == ' ' || *p == '\t') p++;
+        char c = *p;
+
+        if (c == '|') {
+            // Fin de una etapa intermedia: debe tener comando y no tener '>'
+            if (argc == 0 || saw_gt) bad = 1;
+            if (!bad) {
+                cmd_t *stage = build_command(argc, NULL);
+                if (!stage) {
+                    util_print_error();
+                    break;
+                }
+                if (tail) tail->pipe_next = stage;
+                else head = stage;
+                tail = stage;
+            }
+            argc = 0;
+            saw_gt = 0;
+            redir = NULL;
+            trailing_amp = 0;
+            piped = 1;
+            *p++ = '\0';
+            continue;
+        }
+
+        if (c == '\0' || c == '&') {
+            // Fin del comando actual: validar y guardarlo
+            if (saw_gt && !redir) bad = 1;  // "ls >" sin archivo
+            if (argc == 0 && piped) bad = 1;  // "ls |" sin última etapa
+            if (bad) {
+                util_print_error();
+            } else if (argc > 0) {
+                cmd_t *cmd = build_command(argc, redir);
+                if (!cmd ||
+                    scratch_reserve((void ***)&scratch_cmds, &scratch_cmds_cap, ncmds + 1) == -1) {
+                    util_print_error();
+                    break;
+                }
+                if (tail) {
+                    tail->pipe_next = cmd;
+                    cmd = head;
+                }
+                if (apply_prefixes(cmd) == -1) {
+                    util_print_error();
+                } else {
+                    cmd->index = (int)ncmds;
+                    scratch_cmds[ncmds++] = cmd;
+                }
+            }
+            if (c == '\0') break;
+            // Ignorar comandos vacíos (ej: "ls & & pwd" tiene & vacío)
+            trailing_amp = 1;
+            argc = 0;
+            redir = NULL;
+            head = tail = NULL;
+            saw_gt = bad = piped = 0;
+            *p++ = '\0';
+            continue;
+        }
+        trailing_amp = 0;
+
+        if (c == '>') {
+            // '>' sin comando antes, o un segundo '>' -> error
+            if (saw_gt || argc == 0) bad = 1;
+            saw_gt = 1;
+            *p++ = '\0';
+            continue;
+        }
+
+        // Token: avanzar hasta el siguiente separador y terminarlo con '\0'
+        char *tok = p;
+        int magic = 0;  // Tiene '*', '?' o '[': expandir
+        unsigned char cls;
+        while (!((cls = tok_class[(unsigned char)*p]) & TOK_END)) {
+            magic |= cls;
+            p++;
+        }
+        if (saw_gt) {
+            if (redir) bad = 1;  // Varios archivos a la derecha de '>'
+            redir = tok;
+        } else if (!bad) {
+            if (scratch_reserve((void ***)&scratch_args, &scratch_args_cap, argc + 1) == -1) {
+                util_print_error();
+                bad = 1;
+            } else {
+                scratch_args[argc++] = tok;
+                if (magic) {  // Terminar el token un momento para expandirlo
+                    char sep = *p;
+                    *p = '\0';
+                    if (glob_expand(&argc) == -1) {
+                        util_print_error();
+                        bad = 1;
+                    }
+                    *p = sep;
+                }
+            }
+        }
+        if (*p == ' ' || *p == '\t') {
+            *p++ = '\0';
+        }
+        // Si el token terminó en '&', '|', '>' o '\0', el separador se procesa
+        // (y se reemplaza por '\0') en la siguiente iteración
+    }
+
+    if (ncmds == 0) return NULL;  // No se encontró ningún comando válido
+
+    cmd_t **cmds = arena_alloc(parse_arena, ncmds * sizeof(cmd_t*));
+    if (!cmds) {
+        util_print_error();
+        return NULL;
+    }
+    memcpy(cmds, scratch_cmds, ncmds * sizeof(cmd_t*));
+
+    // Ajuste: el último comando NO es background SALVO que la línea termine en '&'
+    // Ejemplo: "ls & pwd" -> pwd NO es background (esperamos a que termine)
+    // Ejemplo: "ls & pwd &" -> pwd SÍ es background
+    cmds[ncmds - 1]->is_background = trailing_amp;
+    *count = (int)ncmds;
+    return cmds;
+}
+
+// Descripción de un proceso a crear (una etapa de un pipeline)
+// Los fds en -1 se heredan del shell; redir_file (si no es NULL) se abre en
+// el hijo y reemplaza stdout y stderr, como pide el enunciado
+typedef struct {
+    const char *exec_path;
+    char **argv;
+    int in_fd;              // Nuevo stdin (extremo de lectura de un pipe)
+    int out_fd;             // Nuevo stdout (extremo de escritura de un pipe)
+    int err_fd;             // Nuevo stderr
+    const char *redir_file;
+    const place_opts_t *place;  // Colocación/prioridad a aplicar (NULL = ninguna; sólo fork)
+    const cpu_set_t *cpus;      // CPUs a las que se fija (NULL = sin cambio)
+    pid_t pgid;                 // Grupo al que entra (-1 = el del shell, 0 = uno nuevo)
+    int foreground;             // Con pgid: el grupo toma la terminal
+    const builtin_t *plugin;    // Comando de plugin a correr en el hijo en vez del exec (sólo fork)
+} spawn_req_t;
+
+// Crear el hijo con fork(): las redirecciones (dup2 / open) se hacen en el hijo
+// Todos los pipes del shell tienen O_CLOEXEC, así que el exec los cierra
+// Retorna: PID del hijo, o -1 si fork falla
+static pid_t spawn_fork(const spawn_req_t *req) {
     pid_t pid = fork();
     if (pid == -1) {  // Error en fork
-        free(exec_path);
         util_print_error();
-        return -1;
+        return -1;
+    }
+
+    if (pid == 0) {  // Código del PROCESO HIJO
+        long long trace_start = TRACE_BEGIN();
+        // Conectar los extremos de pipe que correspondan a esta etapa
+        if ((req->in_fd != -1 && dup2(req->in_fd, STDIN_FILENO) == -1) ||
+            (req->out_fd != -1 && dup2(req->out_fd, STDOUT_FILENO) == -1) ||
+            (req->err_fd != -1 && dup2(req->err_fd, STDERR_FILENO) == -1)) {
+            util_print_error();
+            exit(1);
+        }
+
+        // Configurar redirección de salida si se especificó '>'
+        if (req->redir_file) {
+            // Abrir archivo: crear si no existe, truncar si existe, solo escritura
+            int fd = open(req->redir_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd == -1) {  // Error al abrir archivo
+                util_print_error();
+                exit(1);
+            }
+            // dup2: redirigir stdout (1) y stderr (2) al archivo
+            // Después de esto, printf y fprintf(stderr) escriben al archivo
+            if (dup2(fd, STDOUT_FILENO) == -1 || dup2(fd, STDERR_FILENO) == -1) {
+                util_print_error();
+                close(fd);
+                exit(1);
+            }
+            close(fd);  // Ya no necesitamos el descriptor original
+        }
+        // Control de jobs: entrar al grupo del job (y tomar la terminal si va
+        // en primer plano) antes de restaurar las señales que el shell ignora
+        if (req->pgid != -1) {
+            setpgid(0, req->pgid);
+            if (req->foreground) tcsetpgrp(STDIN_FILENO, getpgrp());
+            static const int sigs[] = { SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGCHLD };
+            struct sigaction sa;
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_handler = SIG_DFL;
+            for (size_t k = 0; k < sizeof(sigs) / sizeof(sigs[0]); k++) sigaction(sigs[k], &sa, NULL);
+            sigset_t none;
+            sigemptyset(&none);
+            sigprocmask(SIG_SETMASK, &none, NULL);
+        }
+        // Afinidad, nice, ioprio y límites (opts / flags)
+        if (req->place && place_apply(req->place, req->cpus) == -1) {
+            util_print_error();
+            exit(1);
+        }
+        // En el buffer compartido: preparación del hijo (dup2/open) hasta el exec
+        TRACE_END("child_setup", trace_start, req->redir_file != NULL);
+
+        if (req->plugin) {  // Comando de plugin con la salida capturada (ver execute_command)
+            _exit(plugin_call(req->plugin, req->argv, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO));
+        }
+
+        // Reemplazar el proceso hijo con el ejecutable usando execv()
+        // execv NO retorna si tiene éxito (el proceso se reemplaza completamente)
+        // Sólo retorna si hay error (ej: el archivo no es ejecutable)
+        execv(req->exec_path, req->argv);
+        if ((errno == ENOENT || errno == EACCES) && !strchr(req->argv[0], '/')) {
+            // La ruta de la caché quedó vieja entre la búsqueda y el exec:
+            // buscar una vez más en el PATH
+            char *fresh = path_search(req->argv[0], NULL);
+            if (fresh && strcmp(fresh, req->exec_path) != 0) execv(fresh, req->argv);
+        }
+        util_print_error();  // Si llegamos aquí, execv falló
+        exit(1);
+    }
+    return pid;
+}
+
+// Crear el hijo con posix_spawn(): las redirecciones se expresan como file
+// actions (dup2 de los pipes; open del archivo en stdout + dup2 de stdout a
+// stderr), que el hijo ejecuta antes del exec. A diferencia de fork, un fallo
+// del open o del exec se reporta aquí en el padre como valor de retorno.
+// Retorna: PID del hijo, o -1 si hubo error
+static pid_t spawn_posix(const spawn_req_t *req) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_t *actions_ptr = NULL;
+
+    if (req->redir_file || req->in_fd != -1 || req->out_fd != -1 || req->err_fd != -1) {
+        if (posix_spawn_file_actions_init(&actions) != 0) {
+            util_print_error();
+            return -1;
+        }
+        actions_ptr = &actions;
+        int err = 0;
+        if (req->in_fd != -1) {
+            err = err || posix_spawn_file_actions_adddup2(&actions, req->in_fd, STDIN_FILENO);
+        }
+        if (req->out_fd != -1) {
+            err = err || posix_spawn_file_actions_adddup2(&actions, req->out_fd, STDOUT_FILENO);
+        }
+        if (req->err_fd != -1) {
+            err = err || posix_spawn_file_actions_adddup2(&actions, req->err_fd, STDERR_FILENO);
+        }
+        if (req->redir_file) {
+            err = err ||
+                  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, req->redir_file,
+                                                   O_WRONLY | O_CREAT | O_TRUNC, 0644) ||
+                  posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+        }
+        if (err) {
+            posix_spawn_file_actions_destroy(&actions);
+            util_print_error();
+            return -1;
+        }
+    }
+
+    // Grupo de procesos propio (timeout, control de jobs); con control de
+    // jobs además las señales que el shell ignora vuelven a su acción normal
+    posix_spawnattr_t attr;
+    posix_spawnattr_t *attr_ptr = NULL;
+    if (req->pgid != -1 && posix_spawnattr_init(&attr) == 0) {
+        attr_ptr = &attr;
+        short flags = POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, req->pgid);
+        if (job_control) {
+            sigset_t def, none;
+            sigemptyset(&def);
+            sigemptyset(&none);
+            sigaddset(&def, SIGINT);
+            sigaddset(&def, SIGQUIT);
+            sigaddset(&def, SIGTSTP);
+            sigaddset(&def, SIGTTIN);
+            sigaddset(&def, SIGTTOU);
+            sigaddset(&def, SIGCHLD);
+            posix_spawnattr_setsigdefault(&attr, &def);
+            posix_spawnattr_setsigmask(&attr, &none);
+            flags |= POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+        }
+        posix_spawnattr_setflags(&attr, flags);
+    }
+
+    pid_t pid;
+    int err = posix_spawn(&pid, req->exec_path, actions_ptr, attr_ptr, req->argv, environ);
+    if ((err == ENOENT || err == EACCES) && !strchr(req->argv[0], '/')) {
+        // La ruta de la caché quedó vieja entre la búsqueda y el exec:
+        // olvidarla y buscar una vez más en el PATH
+        hash_forget(req->argv[0], 0);
+        char *fresh = find_executable(req->argv[0]);
+        if (fresh && strcmp(fresh, req->exec_path) != 0) {
+            err = posix_spawn(&pid, fresh, actions_ptr, attr_ptr, req->argv, environ);
+        }
+        free(fresh);
+    }
+    if (actions_ptr) posix_spawn_file_actions_destroy(actions_ptr);
+    if (attr_ptr) posix_spawnattr_destroy(attr_ptr);
+    if (err != 0) {  // Falló el open de la redirección o el exec
+        util_print_error();
+        return -1;
+    }
+    return pid;
+}
+
+// Preparar la salida de un job en modo --splice: el shell abre el archivo
+// de '>' y la última etapa escribe (stdout y stderr) en un pipe cuyo
+// contenido se mueve al archivo con splice() desde el bucle de eventos
+// Retorna: extremo de escritura del pipe para el hijo, o -1 si hubo error
+static int splice_setup(job_t *job, const char *redir_file) {
+    long long trace_start = TRACE_BEGIN();
+    int file_fd = open(redir_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    TRACE_END("redirect_open", trace_start, file_fd);
+    if (file_fd == -1) {
+        util_print_error();
+        return -1;
+    }
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        close(file_fd);
+        util_print_error();
+        return -1;
+    }
+    fcntl(fds[0], F_SETPIPE_SZ, SPLICE_CHUNK);  // Menos despertares (best effort)
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    job->out.pipe_fd = fds[0];
+    job->out.file_fd = file_fd;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &job->out };
+    if (epoll_ctl(ev_epfd, EPOLL_CTL_ADD, fds[0], &ev) == -1) {
+        close(fds[0]);
+        close(fds[1]);
+        close(file_fd);
+        job->out.pipe_fd = job->out.file_fd = -1;
+        util_print_error();
+        return -1;
+    }
+    job->live++;  // El job termina cuando también se vacía el pipe
+    return fds[1];
+}
+
+// Ejecutar un comando (builtin o externo, simple o pipeline)
+// cmd: Comando parseado con argv, redir_file, is_background (y pipe_next)
+// Retorna: PID del primer proceso hijo (si es externo), 0 (si es builtin), -1 (error)
+// No espera a los hijos: quedan registrados como un job en running_jobs
+static int execute_command(cmd_t *cmd) {
+    if (!cmd || !cmd->argv || !cmd->argv[0]) return -1;  // Validación
+
+    // PASO 1: Verificar si es un builtin (exit, cd, path, ...)
+    // Los builtins modifican el estado del shell, así que no pueden ser
+    // una etapa de un pipeline (correrían en otro proceso)
+    // (los comandos de plugins tampoco: corren dentro del shell)
+    int nstages = 0;
+    for (cmd_t *st = cmd; st; st = st->pipe_next) {
+        const builtin_t *b = cmd->pipe_next ? builtin_lookup(st->argv[0]) : NULL;
+        if (b && (b->shell || b->plugin)) {
+            util_print_error();
+            return -1;
+        }
+        nstages++;
+    }
+    // handle_builtin retorna 1 si es builtin, 0 si no
+    const builtin_t *plugin = NULL;  // Comando de plugin que corre como hijo
+    if (nstages == 1) {
+        const builtin_t *b = builtin_lookup(cmd->argv[0]);
+        if (b && b->plugin) {
+            // Con --keep-order / --tag su salida va a los pipes del job, que
+            // el shell lee mientras corre: un hijo (fork) como cualquier otro
+            // comando. Si no, un job sin procesos
+            if (!(keep_order || tag_output) || !pidfd_supported || cmd->redir_file) {
+                plugin_run(cmd, b);
+                return 0;
+            }
+            plugin = b;
+        }
+        long long start = cmd->timed ? now_ns() : 0;
+        if (!plugin && handle_builtin(cmd)) {
+            if (cmd->timed) {  // 'time' de un builtin: no hay hijo, sólo tiempo real
+                struct rusage none;
+                memset(&none, 0, sizeof(none));
+                print_time_report(now_ns() - start, &none);
+            }
+            return 0;  // Builtin ejecutado (o intentó), no necesitamos fork
+        }
+    }
+
+    // PASO 2: Es un comando externo, buscar el ejecutable de cada etapa en PATH
+    char **exec_paths = arena_alloc(parse_arena, nstages * sizeof(char*));
+    if (!exec_paths) {
+        util_print_error();
+        return -1;
+    }
+    int i = 0;
+    for (cmd_t *st = cmd; st; st = st->pipe_next, i++) {
+        long long trace_start = TRACE_BEGIN();
+        exec_paths[i] = plugin ? strdup(st->argv[0]) : find_executable(st->argv[0]);
+        TRACE_END("find_executable", trace_start, i);
+        if (!exec_paths[i]) {  // No se encontró en PATH
+            while (i > 0) free(exec_paths[--i]);
+            util_print_error();
+            return -1;
+        }
+    }
+
+    // PASO 3: Con el prefijo 'cache' (y --cache), si la clave ya está
+    // guardada se restaura la salida y el job termina sin crear procesos
+    cmd_t *last = cmd;
+    while (last->pipe_next) last = last->pipe_next;
+    int use_cache = cmd->cached && cache_dirfd != -1 && last->redir_file;
+    cache_key_t key = use_cache ? cache_key(cmd, exec_paths) : 0;
+    int cached_status;
+    if (use_cache && cache_lookup(key, last->redir_file, &cached_status)) {
+        for (i = 0; i < nstages; i++) free(exec_paths[i]);
+        cache_hits++;
+        job_t *job = job_new(cmd, nstages);
+        if (job) {
+            job->status = cached_status;
+            job->cache = CACHE_HIT;
+            job_complete(job);
+        }
+        return 0;
+    }
+
+    // PASO 4: Utilidades triviales (echo, true, mkdir, sleep, ...) sin fork
+    // (la salida capturada de --keep-order/--tag sólo existe con procesos)
+    if (nstages == 1 && !external_utils && !keep_order && !tag_output &&
+        inproc_try(cmd, exec_paths[0], key, use_cache)) {
+        free(exec_paths[0]);
+        return 0;
+    }
+
+    // PASO 5: Crear los procesos hijos, conectados por pipes, como un job
+    job_t *job = job_new(cmd, nstages);
+    pid_t first_pid = -1;
+    if (job && use_cache) {
+        cache_misses++;
+        job->cache = CACHE_MISS;
+        job->cache_key = key;
+    }
+    if (job) {
+        int prev_read = -1;  // Extremo de lectura del pipe de la etapa anterior
+        // --keep-order / --tag: stderr de todas las etapas y stdout de la
+        // última van a pipes propios del job (salvo que la salida vaya a '>')
+        int cap_out_w = -1, cap_err_w = -1;
+        int placed = place_active(&place_current);
+        if ((keep_order || tag_output) && pidfd_supported && !last->redir_file) {
+            capture_setup(job, &cap_out_w, &cap_err_w);
+        }
+        i = 0;
+        for (cmd_t *st = cmd; st; st = st->pipe_next, i++) {
+            spawn_req_t req = { exec_paths[i], st->argv, prev_read, -1, cap_err_w, NULL, NULL, NULL, -1, 0, plugin };
+            int next_read = -1;
+            cpu_set_t cpus;
+            // Grupo de procesos: con control de jobs el de la línea; con
+            // timeout uno propio del job, para que el watchdog alcance a
+            // toda la descendencia, salvo que stdin sea una terminal (como
+            // 'timeout --foreground': Ctrl+C debe seguir llegando al hijo y
+            // leer de la terminal no debe detenerlo con SIGTTIN; el watchdog
+            // señala cada etapa por su pidfd)
+            batch_line_t *jl = job_control ? current_batch_line : NULL;
+            pid_t *grp = jl ? &jl->pgid :
+                         cmd->timeout_ns && !isatty(STDIN_FILENO) ? &job->pgid : NULL;
+            if (grp) req.pgid = *grp;
+            if (jl) req.foreground = jl->foreground;
+            if (placed) {
+                req.place = &place_current;
+                if (place_pick(&place_current, i == 0, &cpus)) req.cpus = &cpus;
+            }
+            if (st->pipe_next) {
+                int fds[2];
+                if (pipe2(fds, O_CLOEXEC) == -1) {
+                    util_print_error();
+                    break;
+                }
+                req.out_fd = fds[1];
+                next_read = fds[0];
+            } else if (cap_out_w != -1) {
+                req.out_fd = cap_out_w;  // El bucle de abajo lo cierra tras el spawn
+                cap_out_w = -1;
+            } else if (st->redir_file && splice_mode && pidfd_supported) {
+                req.out_fd = req.err_fd = splice_setup(job, st->redir_file);
+                if (req.out_fd == -1) break;
+            } else {
+                req.redir_file = st->redir_file;
+            }
+
+            // Con posix_spawn el span incluye el exec (vfork espera a que ocurra)
+            // La colocación, la terminal y los comandos de plugins se
+            // resuelven en el hijo, así que requieren fork (el grupo y las
+            // señales los fija posix_spawn)
+            int use_fork = spawn_backend == SPAWN_FORK || req.place || req.foreground || req.plugin;
+            long long trace_start = TRACE_BEGIN();
+            pid_t pid = use_fork ? spawn_fork(&req) : spawn_posix(&req);
+            TRACE_END(use_fork ? "spawn_fork" : "spawn_posix", trace_start, i);
+            // El shell ya no necesita los extremos que heredó el hijo
+            if (prev_read != -1) close(prev_read);
+            if (req.out_fd != -1) close(req.out_fd);
+            prev_read = next_read;
+            if (pid == -1) break;
+            if (grp) {  // También en el padre: el grupo existe antes de seguir
+                setpgid(pid, *grp ? *grp : pid);
+                if (!*grp) *grp = pid;
+            }
+            job_add_proc(job, pid);
+            if (first_pid == -1) first_pid = pid;
+        }
+        if (prev_read != -1) close(prev_read);  // Una etapa falló a medio pipeline
+        if (cap_out_w != -1) close(cap_out_w);  // La última etapa no llegó a lanzarse
+        if (cap_err_w != -1) close(cap_err_w);
+        if (job->nprocs == 0 && job->entry) capture_abort(job);
+        if (job_control && current_batch_line) job->pgid = current_batch_line->pgid;
+        // timeout N / --timeout: el watchdog lo vigila desde el lanzamiento
+        if (job->nprocs > 0 && cmd->timeout_ns && wd_add(job, cmd->timeout_ns) == -1) {
+            util_print_error();
+        }
+        // Si no se lanzó nada (y no hay salida splice pendiente), liberar el slot
+        if (job->live == 0) job_discard(job);
+    }
+
+    for (i = 0; i < nstages; i++) free(exec_paths[i]);  // Ya no necesitamos las rutas
+
+    // PASO 6: la espera la hace el planificador
+    // (reap_children / wait_for_children), tanto con & como sin &
+    return first_pid;  // Retornar PID para tracking
+}
+
+// Esperar a que terminen TODOS los procesos hijos en ejecución
+// Usado después de lanzar los comandos de una línea
+static void wait_for_children(void) {
+    long long trace_start = TRACE_BEGIN();
+    while (running_count > 0) reap_children();
+    TRACE_END("wait_for_children", trace_start, 0);
+}
+
+// Ejecutar los comandos de una línea con a lo sumo jobs_limit hijos a la vez
+// Los comandos se lanzan en orden; cuando no hay slot libre se espera a que
+// termine cualquier hijo y se lanza el siguiente de inmediato
+static void run_commands(cmd_t **cmds, int count) {
+    for (int i = 0; i < count; i++) {
+        while (running_count >= jobs_limit) reap_children();
+        if (execute_command(cmds[i]) == -1) {
+            // Error ejecutando comando: continuar con el siguiente
+            continue;
+        }
+    }
+    // Esperar a que terminen TODOS los comandos lanzados
+    wait_for_children();
+}
+
+// Parsear y ejecutar una línea completa (modo batch e interactivo)
+// Al terminar se libera en O(1) todo lo que el parser asignó para la línea
+static void run_line(char *line) {
+    current_line_no++;
+    // Parsear la línea en comandos (puede haber varios con &)
+    long long trace_start = TRACE_BEGIN();
+    int cmd_count;
+    cmd_t **cmds = split_parallel_commands(line, &cmd_count);
+    TRACE_END("parse", trace_start, cmd_count);
+    if (journal_fd != -1) journal_seq_begin(cmds ? cmd_count : 0);
+    if (cmds) {
+        // Ejecutar los comandos (en paralelo si hay &) y esperarlos
+        run_commands(cmds, cmd_count);
+    }
+    arena_reset(&line_arena);
+    if (trace_flush_requested) trace_flush();
+}
+
+// ====== Lector del archivo batch ======
+// Archivos regulares: se mapean completos con mmap (MAP_PRIVATE y escribible,
+// porque el parser termina los tokens con '\0' en el mismo buffer; sólo las
+// páginas tocadas se copian). Cada BATCH_RELEASE_BYTES ya procesados se
+// descartan con madvise(MADV_DONTNEED) + posix_fadvise(POSIX_FADV_DONTNEED)
+// para que un batch de varios GB no llene la page cache ni el RSS.
+// Pipes y stdin: read() con un buffer grande que crece si una línea no cabe.
+// En ambos casos las líneas se buscan con memchr (vectorizado en glibc) y se
+// entregan sin copiar: el '\n' se reemplaza por '\0' en el buffer.
+typedef struct {
+    int fd;
+    char *map;          // Archivo mapeado (NULL en modo read)
+    size_t map_len;
+    size_t pos;         // Inicio de la próxima línea dentro de map
+    size_t released;    // Bytes de map ya devueltos al kernel
+    char *tail;         // Copia de la última línea si no termina en '\n' (modo mmap)
+    char *buf;          // Buffer de lectura (modo read)
+    size_t buf_cap;
+    size_t buf_start;   // Inicio de la próxima línea dentro de buf
+    size_t buf_end;     // Fin de los datos válidos en buf
+    size_t buf_base;    // Offset en la entrada de buf[0] (para --journal)
+    int eof;            // read() ya retornó 0
+} batch_reader_t;
+
+// Abrir el lector sobre un descriptor ya abierto (el lector lo cierra,
+// salvo que sea stdin). Retorna: 0 si se pudo abrir, -1 si no
+static int batch_open_fd(batch_reader_t *r, int fd) {
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+
+    struct stat sb;
+    if (fstat(r->fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+        r->map_len = (size_t)sb.st_size;
+        r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE, r->fd, 0);
+        if (r->map == MAP_FAILED) {
+            r->map = NULL;  // Fallback: leer con read()
+        } else {
+            madvise(r->map, r->map_len, MADV_SEQUENTIAL);
+            posix_fadvise(r->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            return 0;
+        }
+    } else if (S_ISREG(sb.st_mode)) {
+        r->eof = 1;  // Archivo vacío: no hay nada que mapear ni leer
+    }
+
+    r->buf_cap = BATCH_READ_SIZE;
+    r->buf = malloc(r->buf_cap);
+    if (!r->buf) {
+        if (r->fd != STDIN_FILENO) close(r->fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Abrir el lector sobre un archivo, o sobre stdin si file es NULL o "-"
+// Retorna: 0 si se pudo abrir, -1 si no
+static int batch_open(batch_reader_t *r, const char *file) {
+    int fd = STDIN_FILENO;
+    if (file && strcmp(file, "-") != 0) {
+        fd = open(file, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) return -1;
+    }
+    return batch_open_fd(r, fd);
+}
+
+// Devolver al kernel las páginas del mapeo anteriores a 'upto'
+static void batch_release(batch_reader_t *r, size_t upto) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    upto &= ~(page - 1);
+    if (upto <= r->released) return;
+    madvise(r->map + r->released, upto - r->released, MADV_DONTNEED);
+    posix_fadvise(r->fd, (off_t)r->released, (off_t)(upto - r->released), POSIX_FADV_DONTNEED);
+    r->released = upto;
+}
+
+// Siguiente línea en modo mmap
+static char *batch_next_mapped(batch_reader_t *r) {
+    if (r->pos >= r->map_len) return NULL;
+
+    // La línea anterior ya terminó de ejecutarse: sus páginas se pueden soltar
+    if (r->pos - r->released >= BATCH_RELEASE_BYTES) batch_release(r, r->pos);
+
+    char *line = r->map + r->pos;
+    size_t left = r->map_len - r->pos;
+    char *nl = memchr(line, '\n', left);
+    if (nl) {
+        *nl = '\0';
+        r->pos += (size_t)(nl - line) + 1;
+        return line;
+    }
+
+    // Última línea sin '\n': no hay byte libre en el mapeo para el '\0'
+    free(r->tail);
+    r->tail = malloc(left + 1);
+    if (!r->tail) {
+        util_print_error();
+        return NULL;
+    }
+    memcpy(r->tail, line, left);
+    r->tail[left] = '\0';
+    r->pos = r->map_len;
+    return r->tail;
+}
+
+// Siguiente línea en modo read (pipes, stdin, o si mmap falló)
+static char *batch_next_read(batch_reader_t *r) {
+    while (1) {
+        char *start = r->buf + r->buf_start;
+        size_t avail = r->buf_end - r->buf_start;
+        char *nl = memchr(start, '\n', avail);
+        if (nl) {
+            *nl = '\0';
+            r->buf_start += (size_t)(nl - start) + 1;
+            return start;
+        }
+        if (r->eof) {
+            if (avail == 0) return NULL;
+            // Última línea sin '\n': siempre queda un byte libre (ver abajo)
+            start[avail] = '\0';
+            r->buf_start = r->buf_end;
+            return start;
+        }
+
+        // Mover la línea incompleta al inicio del buffer y crecer si está lleno
+        // (dejando siempre 1 byte libre para el '\0' de la última línea)
+        if (r->buf_start > 0) {
+            memmove(r->buf, start, avail);
+            r->buf_base += r->buf_start;
+            r->buf_start = 0;
+            r->buf_end = avail;
+        }
+        if (r->buf_end + 1 >= r->buf_cap) {
+            char *grown = realloc(r->buf, r->buf_cap * 2);
+            if (!grown) {
+                util_print_error();
+                return NULL;
+            }
+            r->buf = grown;
+            r->buf_cap *= 2;
+        }
+
+        ssize_t n = read(r->fd, r->buf + r->buf_end, r->buf_cap - r->buf_end - 1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            util_print_error();
+            r->eof = 1;
+        } else if (n == 0) {
+            r->eof = 1;
+        } else {
+            r->buf_end += (size_t)n;
+        }
+    }
+}
+
+// Obtener la siguiente línea (sin el '\n'); válida hasta la próxima llamada
+// Retorna: puntero a la línea, o NULL al llegar a EOF
+static char *batch_next_line(batch_reader_t *r) {
+    return r->map ? batch_next_mapped(r) : batch_next_read(r);
+}
+
+// Offset en la entrada donde empieza la próxima línea
+static size_t batch_tell(const batch_reader_t *r) {
+    return r->map ? r->pos : r->buf_base + r->buf_start;
+}
+
+// Posicionar el lector al inicio de la línea que empieza en 'offset' (--resume).
+// Si la entrada no admite lseek (pipe) se leen y descartan las líneas previas
+// Retorna: 0, o -1 si 'offset' no es un inicio de línea de la entrada
+static int batch_seek(batch_reader_t *r, size_t offset) {
+    if (r->map) {
+        if (offset > r->map_len || (offset > 0 && offset < r->map_len && r->map[offset - 1] != '\n')) {
+            return -1;
+        }
+        r->pos = offset;
+        return 0;
+    }
+    if (offset == 0) return 0;
+    if (lseek(r->fd, (off_t)offset, SEEK_SET) != -1) {
+        r->buf_base = offset;
+        r->buf_start = r->buf_end = 0;
+        return 0;
+    }
+    while (batch_tell(r) < offset && batch_next_read(r));
+    return batch_tell(r) == offset ? 0 : -1;
+}
+
+// Cerrar el lector y liberar sus recursos
+static void batch_close(batch_reader_t *r) {
+    if (r->map) munmap(r->map, r->map_len);
+    free(r->tail);
+    free(r->buf);
+    if (r->fd != STDIN_FILENO) close(r->fd);
+}
+
+// ====== Journal de avance del batch (--journal FILE / --resume) ======
+// Cada línea del batch que termina agrega un registro de texto al journal:
+//   L <línea> <offset> <estados>  offset: byte del batch donde empieza la
+//                                 siguiente; estados: salida de cada comando
+//                                 (128+señal si lo mató una; '-' si no se
+//                                 lanzó: builtins, errores)
+//   C <largo> <dir>               directorio actual (al empezar y tras 'cd')
+//   P <largo> <dir>\t<dir>...     PATH (al empezar y tras 'path')
+// El registro se escribe con un solo write() al terminar la línea (sobrevive
+// a un kill del shell) y fdatasync se hace a lo sumo cada JOURNAL_SYNC_NS (si
+// cae el nodo se repiten como mucho las líneas de ese intervalo). Con
+// --resume el batch continúa en la primera línea sin registro: el lector
+// salta directo a su offset, se restauran el directorio y el PATH, y las
+// líneas posteriores que ya habían terminado (--parallel-batch) se omiten.
+// 'exit' no se registra: al retomar se vuelve a ejecutar y termina igual.
+
+#define JOURNAL_SYNC_NS 100000000LL  // Intervalo máximo entre fdatasync (100 ms)
+
+static long long journal_synced_ns = 0;  // Último fdatasync
+static char *journal_buf = NULL;         // Registro en construcción
+static size_t journal_buf_cap = 0;
+static int *journal_seq_status = NULL;   // Estados de la línea actual (modo secuencial)
+static int journal_seq_count = 0;
+static size_t journal_seq_cap = 0;
+static unsigned char *journal_done_bits = NULL;  // --resume: líneas ya terminadas
+static unsigned long journal_done_max = 0;       // Bits en journal_done_bits
+
+// Asegurar espacio para 'more' bytes más en journal_buf
+// Retorna: 0, o -1 si no hay memoria
+static int journal_reserve(size_t len, size_t more) {
+    if (len + more <= journal_buf_cap) return 0;
+    size_t cap = journal_buf_cap ? journal_buf_cap : 4096;
+    while (cap < len + more) cap *= 2;
+    char *grown = realloc(journal_buf, cap);
+    if (!grown) return -1;
+    journal_buf = grown;
+    journal_buf_cap = cap;
+    return 0;
+}
+
+// Agregar al registro en construcción los registros C y P del estado actual
+static size_t journal_put_state(size_t len) {
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) && journal_reserve(len, strlen(cwd) + 32) == 0) {
+        len += sprintf(journal_buf + len, "C %zu %s\n", strlen(cwd), cwd);
+    }
+    size_t plen = 0;
+    for (size_t i = 0; i < path_count; i++) plen += strlen(path_dirs[i]) + 1;
+    if (journal_reserve(len, plen + 32) == 0) {
+        len += sprintf(journal_buf + len, "P %zu ", plen ? plen - 1 : 0);
+        for (size_t i = 0; i < path_count; i++) {
+            len += sprintf(journal_buf + len, i ? "\t%s" : "%s", path_dirs[i]);
+        }
+        journal_buf[len++] = '\n';
+    }
+    return len;
+}
+
+// Escribir el registro construido y sincronizar si pasó el intervalo
+static void journal_commit(size_t len) {
+    write_all(journal_fd, journal_buf, len);
+    long long now = now_ns();
+    if (now - journal_synced_ns >= JOURNAL_SYNC_NS) {
+        fdatasync(journal_fd);
+        journal_synced_ns = now;
+    }
+}
+
+// Registrar que la línea line_no terminó; 'end' es el offset de la siguiente
+static void journal_line_done(unsigned long line_no, size_t end, const int *statuses, int count) {
+    size_t len = 0;
+    if (journal_state_dirty) {  // cd / path en esta línea
+        len = journal_put_state(len);
+        journal_state_dirty = 0;
+    }
+    if (journal_reserve(len, 64 + (size_t)count * 5) == -1) {
+        util_print_error();
+        return;
+    }
+    len += sprintf(journal_buf + len, "L %lu %zu", line_no, end);
+    for (int i = 0; i < count; i++) {
+        if (statuses[i] < 0) len += sprintf(journal_buf + len, " -");
+        else len += sprintf(journal_buf + len, " %d", statuses[i]);
+    }
+    journal_buf[len++] = '\n';
+    journal_commit(len);
+}
+
+// Preparar los estados de una línea secuencial de 'count' comandos
+static void journal_seq_begin(int count) {
+    if ((size_t)count > journal_seq_cap) {
+        int *grown = realloc(journal_seq_status, count * sizeof(int));
+        if (!grown) {
+            util_print_error();
+            count = 0;
+        } else {
+            journal_seq_status = grown;
+            journal_seq_cap = count;
+        }
+    }
+    for (int i = 0; i < count; i++) journal_seq_status[i] = -1;
+    journal_seq_count = count;
+}
+
+// Anotar el estado de un job terminado en su línea (llamado desde job_complete)
+static void journal_note(const job_t *job) {
+    int *statuses = job->line ? job->line->statuses : journal_seq_status;
+    int count = job->line ? (job->line->statuses ? job->line->count : 0) : journal_seq_count;
+    int index = job->cmd->index;
+    if (index >= count) return;
+    statuses[index] = WIFEXITED(job->status) ? WEXITSTATUS(job->status) :
+                      WIFSIGNALED(job->status) ? 128 + WTERMSIG(job->status) : 0;
+}
+
+// ¿La línea line_no ya había terminado en la ejecución anterior? (--resume)
+static int journal_skip(unsigned long line_no) {
+    return line_no < journal_done_max && (journal_done_bits[line_no >> 3] >> (line_no & 7) & 1);
+}
+
+// Marcar line_no como terminada en journal_done_bits
+// Retorna: 0, o -1 si no hay memoria
+static int journal_mark(unsigned long line_no) {
+    if (line_no >= journal_done_max) {
+        unsigned long bits = journal_done_max ? journal_done_max : 1 << 16;
+        while (bits <= line_no) bits *= 2;
+        unsigned char *grown = realloc(journal_done_bits, bits / 8);
+        if (!grown) return -1;
+        memset(grown + journal_done_max / 8, 0, (bits - journal_done_max) / 8);
+        journal_done_bits = grown;
+        journal_done_max = bits;
+    }
+    journal_done_bits[line_no >> 3] |= 1 << (line_no & 7);
+    return 0;
+}
+
+// Leer el journal existente (--resume), restaurar el directorio y el PATH,
+// y posicionar el lector en la primera línea sin terminar. Los registros
+// incompletos del final (el shell murió a medio write) se descartan
+// Retorna: 0, o -1 si el journal no corresponde al batch o no se puede leer
+static int journal_replay(batch_reader_t *r) {
+    struct stat st;
+    if (fstat(journal_fd, &st) == -1) return -1;
+    if (st.st_size == 0) return 0;  // Journal nuevo: empezar desde el principio
+    size_t size = (size_t)st.st_size;
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, journal_fd, 0);
+    if (map == MAP_FAILED) return -1;
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    // Primera pasada: líneas terminadas y último estado (cwd / PATH)
+    const char *cwd = NULL, *path = NULL;
+    size_t cwd_len = 0, path_len = 0, valid = 0;
+    unsigned long last = 0;
+    for (size_t pos = 0; pos < size;) {
+        const char *rec = map + pos;
+        const char *nl = memchr(rec, '\n', size - pos);  // El número termina antes
+        char *end;
+        if (!nl) break;
+        if (*rec == '#') {  // Cabecera
+            pos = valid = (size_t)(nl - map) + 1;
+            continue;
+        }
+        if ((*rec != 'L' && *rec != 'C' && *rec != 'P') || rec[1] != ' ') break;
+        unsigned long n = strtoul(rec + 2, &end, 10);
+        if (end == rec + 2) break;
+        if (*rec == 'L') {
+            if (n == 0) break;
+            if (journal_mark(n) == -1) {
+                munmap(map, size);
+                return -1;
+            }
+            if (n > last) last = n;
+            pos = (size_t)(nl - map) + 1;
+        } else {  // C / P: "<largo> <texto>\n" (el texto puede tener '\n')
+            if (*end != ' ' || (size_t)(end + 1 - map) + n >= size || end[1 + n] != '\n') break;
+            if (*rec == 'C') cwd = end + 1, cwd_len = n;
+            else path = end + 1, path_len = n;
+            pos = (size_t)(end + 1 + n - map) + 1;
+        }
+        valid = pos;
+    }
+    if (valid < size && ftruncate(journal_fd, (off_t)valid) == -1) {
+        munmap(map, size);
+        return -1;
+    }
+
+    // Primera línea sin registro: el batch sigue desde el offset de la anterior
+    unsigned long frontier = 0;
+    while (frontier < last && journal_skip(frontier + 1)) frontier++;
+    size_t offset = 0;
+    for (size_t pos = 0; frontier > 0 && pos < valid;) {
+        const char *rec = map + pos;
+        const char *nl = memchr(rec, '\n', valid - pos);
+        char *end;
+        unsigned long n = *rec == '#' ? 0 : strtoul(rec + 2, &end, 10);
+        if (*rec == 'L' && n == frontier) {
+            offset = strtoull(end, NULL, 10);
+            break;
+        }
+        if (*rec == 'C' || *rec == 'P') nl = end + 1 + n;
+        pos = (size_t)(nl - map) + 1;
+    }
+
+    int err = 0;
+    if (cwd) {
+        char dir[PATH_MAX];
+        if (cwd_len >= sizeof(dir)) cwd_len = sizeof(dir) - 1;
+        memcpy(dir, cwd, cwd_len);
+        dir[cwd_len] = '\0';
+        if (chdir(dir) == -1) err = -1;
+        else path_state_chdir();
+    }
+    if (path) {
+        char *copy = strndup(path, path_len);
+        char **dirs = calloc(path_len / 2 + 2, sizeof(char *));
+        size_t count = 0;
+        if (!copy || !dirs) {
+            err = -1;
+        } else {
+            for (char *dir = copy, *tab; path_len > 0 && dir; dir = tab) {
+                tab = strchr(dir, '\t');
+                if (tab) *tab++ = '\0';
+                dirs[count++] = dir;
+            }
+            update_path(dirs, count);
+        }
+        free(dirs);
+        free(copy);
+    }
+    munmap(map, size);
+    if (err == 0 && batch_seek(r, offset) == -1) err = -1;
+    current_line_no = frontier;
+    return err;
+}
+
+// Forzar a disco los registros pendientes (al salir)
+static void journal_close(void) {
+    if (journal_fd != -1) fdatasync(journal_fd);
+}
+
+// Abrir el journal del batch 'batch_name' sobre el lector r. Sin --resume
+// se empieza uno nuevo; con --resume se agrega al existente (si lo hay)
+// después de retomar desde donde quedó. Errores: mensaje y exit(1)
+static void journal_open(batch_reader_t *r, const char *batch_name) {
+    int flags = O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC | (journal_resume ? 0 : O_TRUNC);
+    journal_fd = open(journal_path, flags, 0644);
+    if (journal_fd == -1 || (journal_resume && journal_replay(r) == -1)) {
+        util_print_error();
+        exit(1);
+    }
+    journal_synced_ns = now_ns();
+    atexit(journal_close);
+    if (lseek(journal_fd, 0, SEEK_END) == 0) {  // Nuevo: cabecera y estado inicial
+        size_t len = 0;
+        if (journal_reserve(0, strlen(batch_name) + 32) == 0) {
+            len = sprintf(journal_buf, "# gtesh-journal 1 %s\n", batch_name);
+            len = journal_put_state(len);
+            journal_commit(len);
+        }
+    }
+    journal_state_dirty = 0;
+}
+
+// ====== Ejecución paralela del batch (--parallel-batch) ======
+// Varias líneas del batch se ejecutan a la vez, compartiendo los jobs_limit
+// slots. El shell no ve qué archivos escribe un programa por sus argumentos
+// (cp, mv, tee, scripts), así que sólo se solapan las líneas "puras": cada
+// etapa es una utilidad conocida de /bin o /usr/bin que sólo lee los
+// archivos que nombra y escribe en stdout (cat, grep, wc, ...). Las que
+// leen el directorio (ls) o stdin (cat, wc, tr sin archivos, en la primera
+// etapa) no son puras. Una línea pura espera a las anteriores todavía en
+// ejecución sólo si una escribe por '>' un archivo que la otra lee o
+// escribe, o que está dentro de un directorio que la otra nombra. Las rutas
+// se comparan canónicas (batch_canonical): "f", "./f" y un enlace a f son
+// el mismo archivo. Una línea no pura choca con todas: espera a las
+// anteriores y las siguientes la esperan a ella. Las líneas con builtins
+// (cd, path, exit, ...) son barreras, y las que tienen comodines se parsean
+// recién cuando terminaron todas las anteriores (la expansión ve el
+// directorio como en la ejecución secuencial). La salida a la terminal
+// puede intercalarse.
+
+static batch_line_t *lines_in_flight = NULL;  // Líneas con jobs pendientes
+static batch_line_t *free_lines = NULL;       // Para reutilizar (con su arena)
+
+// Utilidades que sólo leen archivos y escriben en stdout
+static const struct {
+    const char *name;
+    int input;             // 0: no lee; 1: sus operandos (stdin si no hay); 2: sólo stdin
+    const char *opt_args;  // Opciones cortas que llevan argumento ("-n 5", "-n5")
+} batch_pure_utils[] = {
+    { "basename", 0, "" }, { "cat", 1, "" }, { "cut", 1, "bcdf" }, { "dirname", 0, "" },
+    { "echo", 0, "" }, { "false", 0, "" }, { "grep", 1, "efmABCD" }, { "head", 1, "nc" },
+    { "md5sum", 1, "" }, { "nproc", 0, "" }, { "printf", 0, "" }, { "pwd", 0, "" },
+    { "seq", 0, "" }, { "sha1sum", 1, "" }, { "sha256sum", 1, "" }, { "sleep", 0, "" },
+    { "sort", 1, "kStT" }, { "stat", 1, "c" }, { "tail", 1, "nc" }, { "tr", 2, "" },
+    { "true", 0, "" }, { "wc", 1, "" }, { NULL, 0, NULL }
+};
+
+// Ruta canónica de 'name' (en la arena de bl): absoluta y con los enlaces
+// simbólicos resueltos. Si name no existe se resuelve su directorio; si
+// tampoco existe, la ruta absoluta tal cual (abrirla fallaría igual)
+// Retorna: la ruta, o NULL sin memoria o si es demasiado larga
+static char *batch_canonical(batch_line_t *bl, const char *name) {
+    char path[PATH_MAX], dir[PATH_MAX];
+    if (!realpath(name, path)) {
+        size_t len = strlen(name);
+        while (len > 1 && name[len - 1] == '/') len--;
+        const char *slash = memrchr(name, '/', len);
+        const char *base = slash ? slash + 1 : name;
+        int n;
+        if (slash == name) {
+            strcpy(dir, "/");
+        } else if (!slash) {
+            strcpy(dir, ".");
+        } else if ((size_t)(slash - name) < sizeof(dir)) {
+            memcpy(dir, name, slash - name);
+            dir[slash - name] = '\0';
+        } else {
+            return NULL;
+        }
+        if (realpath(dir, path)) {
+            n = snprintf(dir, sizeof(dir), "%s/%.*s", strcmp(path, "/") ? path : "",
+                         (int)(len - (base - name)), base);
+        } else if (name[0] == '/') {
+            n = snprintf(dir, sizeof(dir), "%s", name);
+        } else {
+            if (!getcwd(path, sizeof(path))) return NULL;
+            n = snprintf(dir, sizeof(dir), "%s/%s", path, name);
+        }
+        if (n < 0 || (size_t)n >= sizeof(dir)) return NULL;
+        strcpy(path, dir);
+    }
+    char *copy = arena_alloc(&bl->arena, strlen(path) + 1);
+    if (copy) strcpy(copy, path);
+    return copy;
+}
+
+// Agregar la ruta canónica de 'name' a las que lee bl
+// Retorna: 0, o -1 si no se pudo
+static int batch_line_reads(batch_line_t *bl, const char *name) {
+    char *path = batch_canonical(bl, name);
+    if (!path) return -1;
+    bl->reads[bl->nreads++] = path;
+    return 0;
+}
+
+// ¿La etapa st sólo lee los archivos que nombra y escribe en stdout?
+// (utilidades del sistema conocidas; un programa con el mismo nombre fuera
+// de /bin o /usr/bin, o sort -o, puede escribir cualquier archivo). 'first':
+// st es la primera etapa, así que leer stdin es leer el del shell. Agrega
+// a bl->reads lo que lee
+static int batch_stage_pure(batch_line_t *bl, const cmd_t *st, int first) {
+    const char *name = st->argv[0];
+    int u = 0;
+    while (batch_pure_utils[u].name && strcmp(name, batch_pure_utils[u].name) != 0) u++;
+    if (!batch_pure_utils[u].name) return 0;
+    if (strcmp(name, "sort") == 0) {  // -o FILE / --output=FILE escribe un archivo
+        for (int a = 1; st->argv[a]; a++) {
+            if (st->argv[a][0] == '-' && strchr(st->argv[a], 'o')) return 0;
+        }
+    }
+    char *exec_path = find_executable(name);
+    if (!exec_path) return 1;  // No se ejecutará: error sin efectos
+    const char *slash = strrchr(exec_path, '/');
+    size_t dir_len = (size_t)(slash - exec_path);
+    int system = (dir_len == 4 && strncmp(exec_path, "/bin", 4) == 0) ||
+                 (dir_len == 8 && strncmp(exec_path, "/usr/bin", 8) == 0);
+    free(exec_path);
+    if (!system) return 0;
+    if (batch_pure_utils[u].input == 0) return 1;
+    if (batch_pure_utils[u].input == 2) return !first;
+
+    // Operandos (archivos a leer; "-" es stdin). En grep el primero es el
+    // patrón, salvo que venga con -e o -f
+    int grep = strcmp(name, "grep") == 0, pattern = grep, options = 1;
+    int operands = 0, stdin_read = 0;
+    for (int a = 1; st->argv[a]; a++) {
+        const char *arg = st->argv[a];
+        if (options && strcmp(arg, "--") == 0) {
+            options = 0;
+        } else if (options && arg[0] == '-' && arg[1] == '-') {
+            if (!strchr(arg, '=')) return 0;  // "--opción ARG": no se sabe si lleva argumento
+        } else if (options && arg[0] == '-' && arg[1]) {
+            for (const char *f = arg + 1; *f; f++) {
+                if (grep && (*f == 'r' || *f == 'R')) return 0;  // Recorre directorios
+                if (!strchr(batch_pure_utils[u].opt_args, *f)) continue;
+                if (grep && (*f == 'e' || *f == 'f')) pattern = 0;
+                const char *optarg = f[1] ? f + 1 : st->argv[++a];
+                if (!optarg || batch_line_reads(bl, optarg) == -1) return 0;  // (grep -f FILE)
+                break;
+            }
+        } else if (pattern) {
+            pattern = 0;
+        } else if (strcmp(arg, "-") == 0) {
+            stdin_read = 1;
+        } else {
+            if (batch_line_reads(bl, arg) == -1) return 0;
+            operands++;
+        }
+    }
+    return !first || (operands > 0 && !stdin_read);
+}
+
+// ¿Todas las etapas de todos los comandos de bl son puras? Si lo son, deja
+// en bl->reads y bl->writes las rutas que la línea lee y escribe
+static int batch_line_pure(batch_line_t *bl) {
+    int nargs = 0, nstages = 0;
+    for (int i = 0; i < bl->count; i++) {
+        for (const cmd_t *st = bl->cmds[i]; st; st = st->pipe_next) {
+            for (int a = 1; st->argv[a]; a++) nargs++;
+            nstages++;
+        }
+    }
+    bl->reads = arena_alloc(&bl->arena, (nargs + 1) * sizeof(char *));
+    bl->writes = arena_alloc(&bl->arena, nstages * sizeof(char *));
+    if (!bl->reads || !bl->writes) return 0;
+    for (int i = 0; i < bl->count; i++) {
+        for (const cmd_t *st = bl->cmds[i]; st; st = st->pipe_next) {
+            if (!batch_stage_pure(bl, st, st == bl->cmds[i])) return 0;
+            if (!st->redir_file) continue;
+            if (!(bl->writes[bl->nwrites] = batch_canonical(bl, st->redir_file))) return 0;
+            bl->nwrites++;
+        }
+    }
+    return 1;
+}
+
+// ¿Las rutas canónicas a y b son la misma o una es un directorio que
+// contiene a la otra?
+static int batch_paths_overlap(const char *a, const char *b) {
+    size_t la = strlen(a), lb = strlen(b);
+    if (la > lb) {
+        const char *t = a;
+        a = b, b = t;
+        size_t tl = la;
+        la = lb, lb = tl;
+    }
+    return strncmp(a, b, la) == 0 && (b[la] == '\0' || b[la] == '/' || la == 1);
+}
+
+// ¿Lo que escribe 'w' choca con lo que lee o escribe 'other'?
+static int batch_writes_conflict(const batch_line_t *w, const batch_line_t *other) {
+    for (int i = 0; i < w->nwrites; i++) {
+        for (int j = 0; j < other->nreads; j++) {
+            if (batch_paths_overlap(w->writes[i], other->reads[j])) return 1;
+        }
+        for (int j = 0; j < other->nwrites; j++) {
+            if (batch_paths_overlap(w->writes[i], other->writes[j])) return 1;
+        }
+    }
+    return 0;
+}
+
+// ¿La línea 'a' depende de 'b' (o viceversa)? Siempre si alguna no es pura;
+// si no, por algún archivo de redirección
+static int batch_lines_conflict(const batch_line_t *a, const batch_line_t *b) {
+    if (!a->pure || !b->pure) return 1;
+    return batch_writes_conflict(a, b) || batch_writes_conflict(b, a);
+}
+
+// ¿Alguna línea en ejecución choca con bl?
+static int batch_line_blocked(const batch_line_t *bl) {
+    for (const batch_line_t *other = lines_in_flight; other; other = other->next) {
+        if (batch_lines_conflict(bl, other)) return 1;
+    }
+    return 0;
+}
+
+// ¿La línea contiene algún builtin? (se ejecuta como barrera)
+static int batch_line_is_barrier(const batch_line_t *bl) {
+    for (int i = 0; i < bl->count; i++) {
+        if (is_builtin_name(bl->cmds[i]->argv[0])) return 1;
+    }
+    return 0;
+}
+
+// Devolver una línea terminada al pool (su arena se conserva)
+static void batch_line_free(batch_line_t *bl) {
+    if (bl->job_id && !bl->foreground) jc_job_done(bl);  // "[N]   Done ..."
+    if (journal_fd != -1 && bl->cmds) {  // Las que no se parsearon las registra el bucle
+        journal_line_done(bl->line_no, bl->end, bl->statuses, bl->count);
+    }
+    if (bl->prev) bl->prev->next = bl->next;
+    else if (lines_in_flight == bl) lines_in_flight = bl->next;
+    if (bl->next) bl->next->prev = bl->prev;
+    arena_reset(&bl->arena);
+    bl->next = free_lines;
+    bl->prev = NULL;
+    free_lines = bl;
+}
+
+// Un job de la línea terminó (llamado desde job_complete)
+static void batch_line_job_done(batch_line_t *bl) {
+    if (--bl->pending == 0 && bl->launched) batch_line_free(bl);
+}
+
+// Copiar y parsear una línea del batch en su propia arena
+// Retorna: la línea, o NULL si está vacía o no hay memoria
+static batch_line_t *batch_line_parse(const char *text) {
+    batch_line_t *bl = free_lines;
+    if (bl) {
+        free_lines = bl->next;
+    } else {
+        bl = calloc(1, sizeof(batch_line_t));
+        if (!bl) {
+            util_print_error();
+            return NULL;
+        }
+    }
+    bl->next = bl->prev = NULL;
+    bl->pending = 0;
+    bl->launched = 0;
+    bl->line_no = current_line_no;
+    bl->text = NULL;
+    bl->job_id = 0;
+    bl->seq = 0;
+    bl->pgid = 0;
+    bl->stopped = bl->foreground = bl->status = 0;
+    bl->statuses = NULL;
+    bl->end = 0;
+    bl->pure = 0;
+    bl->reads = bl->writes = NULL;
+    bl->nreads = bl->nwrites = 0;
+
+    // El lector reutiliza su buffer: la línea se copia para que viva
+    // mientras sus comandos corren
+    size_t len = strlen(text) + 1;
+    arena_t *saved = parse_arena;
+    parse_arena = &bl->arena;
+    char *copy = arena_alloc(&bl->arena, len);
+    bl->cmds = NULL;
+    if (copy && job_control) {  // El parser corta 'copy': otra copia para 'jobs'
+        bl->text = arena_alloc(&bl->arena, len);
+        if (bl->text) memcpy(bl->text, text, len);
+        else copy = NULL;
+    }
+    if (copy) {
+        memcpy(copy, text, len);
+        long long trace_start = TRACE_BEGIN();
+        bl->cmds = split_parallel_commands(copy, &bl->count);
+        TRACE_END("parse", trace_start, bl->count);
+        if (bl->cmds && journal_fd != -1) {  // Estado de cada comando para el journal
+            bl->statuses = arena_alloc(&bl->arena, bl->count * sizeof(int));
+            if (!bl->statuses) {
+                bl->cmds = NULL;
+                copy = NULL;  // Reportar la falta de memoria
+            }
+            for (int i = 0; bl->statuses && i < bl->count; i++) bl->statuses[i] = -1;
+        }
+    }
+    parse_arena = saved;
+    if (!bl->cmds) {
+        if (!copy) util_print_error();
+        batch_line_free(bl);
+        return NULL;
+    }
+    return bl;
+}
+
+// Lanzar todos los comandos de una línea independiente (sin esperarlos)
+static void batch_line_launch(batch_line_t *bl) {
+    bl->next = lines_in_flight;
+    if (lines_in_flight) lines_in_flight->prev = bl;
+    lines_in_flight = bl;
+
+    for (int i = 0; i < bl->count; i++) {
+        while (running_count >= jobs_limit) reap_children();
+        // Estado que job_new toma para el job de este comando
+        arena_t *saved = parse_arena;
+        parse_arena = &bl->arena;
+        current_batch_line = bl;
+        current_line_no = bl->line_no;
+        execute_command(bl->cmds[i]);
+        current_batch_line = NULL;
+        parse_arena = saved;
+    }
+    bl->launched = 1;
+    if (bl->pending == 0) batch_line_free(bl);  // Nada quedó corriendo
+}
+
+// Bucle del modo --parallel-batch
+static void run_batch_parallel(batch_reader_t *batch) {
+    char *text;
+    while ((text = batch_next_line(batch)) != NULL) {
+        current_line_no++;
+        if (journal_skip(current_line_no)) continue;  // --resume: ya había terminado
+        // Comodines: expandirlos con el directorio que dejaron las líneas anteriores
+        if (strpbrk(text, "*?[")) wait_for_children();
+        batch_line_t *bl = batch_line_parse(text);
+        if (!bl) {
+            if (journal_fd != -1) journal_line_done(current_line_no, batch_tell(batch), NULL, 0);
+            continue;
+        }
+        bl->end = batch_tell(batch);
+
+        if (batch_line_is_barrier(bl)) {
+            // Barrera: terminar todo lo anterior y ejecutarla sola, en orden
+            wait_for_children();
+            current_batch_line = bl;
+            arena_t *saved = parse_arena;
+            parse_arena = &bl->arena;
+            run_commands(bl->cmds, bl->count);
+            parse_arena = saved;
+            current_batch_line = NULL;
+            batch_line_free(bl);
+            continue;
+        }
+
+        // Esperar sólo a las líneas anteriores de las que depende
+        bl->pure = batch_line_pure(bl);
+        while (batch_line_blocked(bl)) reap_children();
+        batch_line_launch(bl);
+        if (trace_flush_requested) trace_flush();
+    }
+    wait_for_children();
+}
+
+// Ejecutar un batch ya abierto hasta el final (o hasta 'exit') y terminar
+// el shell con exit(0). No retorna
+static void run_batch(batch_reader_t *batch) {
+    char *line;
+    if (parallel_batch) {
+        run_batch_parallel(batch);  // Líneas independientes en paralelo
+    } else {
+        // Leer línea por línea (sin copiar: la línea vive en el buffer del lector)
+        while ((line = batch_next_line(batch)) != NULL) {
+            if (journal_skip(current_line_no + 1)) {  // --resume: ya había terminado
+                current_line_no++;
+                continue;
+            }
+            run_line(line);
+            if (journal_fd != -1) {
+                journal_line_done(current_line_no, batch_tell(batch), journal_seq_status,
+                                  journal_seq_count);
+            }
+        }
+    }
+    batch_close(batch);
+    exit(0);  // Terminar con código 0 (batch exitoso)
+}
+
+// ====== Control de jobs (modo interactivo) ======
+// Con una terminal y pidfd, cada línea interactiva es un job (batch_line_t,
+// la misma estructura de --parallel-batch) con su propio grupo de procesos:
+//   - Sin '&' final, el grupo recibe la terminal y el shell lo espera;
+//     Ctrl+C le llega sólo a él y Ctrl+Z lo detiene ("[N]+  Stopped").
+//   - Con '&' final el prompt vuelve de inmediato ("[N] PGID") y, cuando
+//     termina, se avisa "[N]   Done ..." antes del siguiente prompt.
+// readline corre en modo callback: el bucle principal espera en un epoll con
+// stdin y el epoll del planificador, así los hijos se recolectan (pidfd)
+// mientras el usuario escribe y ningún job en segundo plano queda zombie.
+// Los cambios a detenido/continuado llegan por un signalfd de SIGCHLD.
+
+static char *jc_notices = NULL;    // Avisos pendientes para el próximo prompt
+static size_t jc_notices_len = 0;
+static unsigned long jc_seq = 0;   // Contador para batch_line_t.seq
+static int jc_eof = 0;             // readline recibió Ctrl+D
+
+// Job actual ('+'): el usado más recientemente (fg, bg, Ctrl+Z, '&')
+static batch_line_t *jc_current(void) {
+    batch_line_t *best = NULL;
+    for (batch_line_t *bl = lines_in_flight; bl; bl = bl->next) {
+        if (bl->job_id && (!best || bl->seq > best->seq)) best = bl;
+    }
+    return best;
+}
+
+static batch_line_t *jc_by_id(int id) {
+    for (batch_line_t *bl = lines_in_flight; bl; bl = bl->next) {
+        if (bl->job_id == id) return bl;
+    }
+    return NULL;
+}
+
+// Número para un job nuevo: uno más que el mayor en uso (como bash)
+static int jc_new_id(void) {
+    int id = 0;
+    for (batch_line_t *bl = lines_in_flight; bl; bl = bl->next) {
+        if (bl->job_id > id) id = bl->job_id;
+    }
+    return id + 1;
+}
+
+// Formatear la línea de un job como en 'jobs': "[N]+  Running   texto"
+static int jc_format(const batch_line_t *bl, char *buf, size_t n) {
+    char state[32];
+    if (bl->stopped) {
+        snprintf(state, sizeof(state), "Stopped");
+    } else if (bl->pending > 0) {
+        snprintf(state, sizeof(state), "Running");
+    } else if (WIFSIGNALED(bl->status)) {
+        snprintf(state, sizeof(state), "Signal %d", WTERMSIG(bl->status));
+    } else if (WEXITSTATUS(bl->status)) {
+        snprintf(state, sizeof(state), "Exit %d", WEXITSTATUS(bl->status));
+    } else {
+        snprintf(state, sizeof(state), "Done");
+    }
+    int len = snprintf(buf, n, "[%d]%c  %-10s %s\n", bl->job_id,
+                       bl == jc_current() ? '+' : ' ', state, bl->text ? bl->text : "");
+    return len < (int)n ? len : (int)n - 1;
+}
+
+// Un job con número terminó (llamado desde batch_line_free): dejar el aviso
+static void jc_job_done(batch_line_t *bl) {
+    char buf[512];
+    int len = jc_format(bl, buf, sizeof(buf));
+    char *grown = realloc(jc_notices, jc_notices_len + len + 1);
+    if (!grown) return;  // Sin memoria: se pierde sólo el aviso
+    memcpy(grown + jc_notices_len, buf, len + 1);
+    jc_notices = grown;
+    jc_notices_len += len;
+}
+
+// Imprimir los avisos pendientes. Retorna: 1 si había alguno
+static int jc_flush_notices(void) {
+    if (!jc_notices_len) return 0;
+    fwrite(jc_notices, 1, jc_notices_len, stdout);
+    fflush(stdout);
+    free(jc_notices);
+    jc_notices = NULL;
+    jc_notices_len = 0;
+    return 1;
+}
+
+// Poner un job en primer plano y esperarlo hasta que termine o se detenga
+// El que llama retiene la línea (pending + 1) para que no se libere aquí
+static void jc_foreground(batch_line_t *bl) {
+    bl->foreground = 1;
+    bl->seq = ++jc_seq;
+    if (bl->pgid > 0) tcsetpgrp(STDIN_FILENO, bl->pgid);
+    while (bl->pending > 1 && !bl->stopped) reap_children();
+    // Recuperar la terminal (y sus modos, por si el job los cambió)
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+    if (!bl->stopped && bl->pending <= 1 && WIFSIGNALED(bl->status) &&
+        WTERMSIG(bl->status) == SIGINT) {
+        putchar('\n');  // Ctrl+C: el prompt en una línea nueva, tras el "^C"
+        fflush(stdout);
+    }
+    if (bl->stopped) {
+        char buf[512];
+        if (!bl->job_id) bl->job_id = jc_new_id();
+        bl->foreground = 0;
+        jc_format(bl, buf, sizeof(buf));
+        printf("\n%s", buf);
+        fflush(stdout);
+    }
+}
+
+// Ejecutar una línea del modo interactivo como job
+// Sin límite de jobs: en modo interactivo los jobs los controla el usuario
+static void jc_run_line(const char *text) {
+    current_line_no++;
+    batch_line_t *bl = batch_line_parse(text);
+    if (!bl) return;
+    bl->foreground = !bl->cmds[bl->count - 1]->is_background;
+
+    bl->next = lines_in_flight;
+    if (lines_in_flight) lines_in_flight->prev = bl;
+    lines_in_flight = bl;
+    bl->pending++;  // Retener la línea mientras se lanza
+    for (int i = 0; i < bl->count; i++) {
+        arena_t *saved = parse_arena;
+        parse_arena = &bl->arena;
+        current_batch_line = bl;
+        execute_command(bl->cmds[i]);
+        current_batch_line = NULL;
+        parse_arena = saved;
+    }
+    bl->launched = 1;
+
+    if (bl->foreground) {
+        jc_foreground(bl);
+    } else if (bl->pending > 1) {  // Quedó algo corriendo: anunciar el job
+        bl->job_id = jc_new_id();
+        bl->seq = ++jc_seq;
+        if (bl->pgid > 0) printf("[%d] %d\n", bl->job_id, (int)bl->pgid);
+        else printf("[%d]\n", bl->job_id);
+        fflush(stdout);
+    }
+    batch_line_job_done(bl);  // Soltar la retención (libera si ya terminó)
+}
+
+// Buscar el job de un argumento "N" o "%N" (sin argumento: el actual)
+// Retorna: la línea, o NULL (con el error ya reportado)
+static batch_line_t *jc_find(char **args) {
+    if (!args[0]) {
+        batch_line_t *bl = jc_current();
+        if (!bl) util_print_error();
+        return bl;
+    }
+    const char *s = args[0][0] == '%' ? args[0] + 1 : args[0];
+    char *end;
+    errno = 0;
+    long id = strtol(s, &end, 10);
+    batch_line_t *bl = NULL;
+    if (!args[1] && *s && !*end && !errno && id > 0 && id <= INT32_MAX) bl = jc_by_id((int)id);
+    if (!bl) util_print_error();
+    return bl;
+}
+
+// Builtin: jobs
+// Lista los jobs con número, en orden: "[N]+  Running    sleep 10 &"
+static void builtin_jobs(char **args) {
+    if (args[0]) {
+        util_print_error();
+        return;
+    }
+    int max = jc_new_id();
+    for (int id = 1; id < max; id++) {
+        batch_line_t *bl = jc_by_id(id);
+        if (!bl) continue;
+        char buf[512];
+        jc_format(bl, buf, sizeof(buf));
+        fputs(buf, stdout);
+    }
+    fflush(stdout);
+}
+
+// Builtin: fg [N]
+// Continúa el job (si estaba detenido) en primer plano y lo espera
+static void builtin_fg(char **args) {
+    batch_line_t *bl = job_control ? jc_find(args) : NULL;
+    if (!bl) {
+        if (!job_control) util_print_error();
+        return;
+    }
+    printf("%s\n", bl->text ? bl->text : "");
+    fflush(stdout);
+    if (bl->pgid > 0) {
+        tcsetpgrp(STDIN_FILENO, bl->pgid);  // Antes de SIGCONT: que no pare por leer
+        bl->stopped = 0;
+        kill(-bl->pgid, SIGCONT);
+    }
+    bl->pending++;  // Retener la línea mientras se espera
+    jc_foreground(bl);
+    batch_line_job_done(bl);  // Soltar la retención (libera si ya terminó)
+}
+
+// Builtin: bg [N]
+// Continúa un job detenido en segundo plano
+static void builtin_bg(char **args) {
+    batch_line_t *bl = job_control ? jc_find(args) : NULL;
+    if (!bl) {
+        if (!job_control) util_print_error();
+        return;
+    }
+    bl->seq = ++jc_seq;
+    if (bl->pgid > 0) {
+        bl->stopped = 0;
+        kill(-bl->pgid, SIGCONT);
+    }
+    const char *text = bl->text ? bl->text : "";
+    size_t len = strlen(text);
+    while (len > 0 && (text[len - 1] == ' ' || text[len - 1] == '\t')) len--;
+    printf("[%d]+ %.*s%s\n", bl->job_id, (int)len, text,
+           len > 0 && text[len - 1] == '&' ? "" : " &");
+    fflush(stdout);
+}
+
+// Builtin: wait [N]
+// Espera a que termine el job N, o todos los jobs en segundo plano. Los
+// detenidos no se esperan (no avanzarían nunca). Sin control de jobs (batch)
+// cada línea ya espera a sus comandos, así que no hay nada que esperar
+static void builtin_wait(char **args) {
+    if (!job_control) {
+        if (args[0]) util_print_error();
+        return;
+    }
+    if (args[0]) {
+        batch_line_t *bl = jc_find(args);
+        if (!bl) return;
+        int id = bl->job_id;
+        while ((bl = jc_by_id(id)) && bl->pending > 0 && !bl->stopped) reap_children();
+        return;
+    }
+    while (1) {
+        int busy = 0;
+        for (batch_line_t *bl = lines_in_flight; bl; bl = bl->next) {
+            if (bl->job_id && bl->pending > 0 && !bl->stopped) busy = 1;
+        }
+        if (!busy) return;
+        reap_children();
+    }
+}
+
+// Activar el control de jobs: el shell en su propio grupo, dueño de la
+// terminal, ignorando las señales de teclado; SIGCHLD bloqueada y entregada
+// por signalfd al epoll del planificador
+// Retorna: 0, o -1 si no se puede (sin pidfd, sin terminal)
+static int jc_init(void) {
+    int probe = (int)syscall(SYS_pidfd_open, getpid(), 0);
+    if (probe == -1) return -1;
+    close(probe);
+
+    // Si el shell arrancó en segundo plano, esperar a tener la terminal
+    while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp())) {
+        kill(-shell_pgid, SIGTTIN);
+    }
+    static const int sigs[] = { SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU };
+    for (size_t i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i++) signal(sigs[i], SIG_IGN);
+    if (setpgid(0, 0) == 0) shell_pgid = getpid();  // Un líder de sesión ya lo es
+    if (tcsetpgrp(STDIN_FILENO, shell_pgid) == -1 ||
+        tcgetattr(STDIN_FILENO, &shell_tmodes) == -1) {
+        return -1;
+    }
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+    sigchld_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &sigchld_src };
+    if (sigchld_fd == -1 || epoll_ctl(ev_epfd, EPOLL_CTL_ADD, sigchld_fd, &ev) == -1) {
+        sigprocmask(SIG_UNBLOCK, &set, NULL);
+        return -1;
+    }
+    job_control = 1;
+    return 0;
+}
+
+// readline (modo callback) entrega una línea completa; NULL es EOF (Ctrl+D)
+// Se llama con la terminal ya restaurada, así que la línea corre aquí mismo
+static void jc_line_handler(char *line) {
+    if (!line) {
+        jc_eof = 1;
+        rl_callback_handler_remove();
+        return;
+    }
+    // Si la línea no está vacía, agregarla al historial (↑/↓)
+    if (*line) add_history(line);
+    jc_run_line(line);
+    free(line);
+    jc_flush_notices();
+    if (trace_flush_requested) trace_flush();
+}
+
+// Bucle interactivo con control de jobs: esperar a la vez teclado y eventos
+// de los hijos. Los avisos de jobs que terminan mientras se escribe se
+// imprimen sobre el prompt, que readline vuelve a dibujar con lo ya escrito
+static void jc_loop(void) {
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = 0 };
+    if (ep == -1 || epoll_ctl(ep, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == -1) {
+        util_print_error();
+        exit(1);
+    }
+    ev.data.u32 = 1;
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, ev_epfd, &ev) == -1) {
+        util_print_error();
+        exit(1);
+    }
+    rl_callback_handler_install(PROMPT, jc_line_handler);
+    while (!jc_eof) {
+        struct epoll_event events[2];
+        int n = epoll_wait(ep, events, 2, -1);
+        for (int i = 0; i < n && !jc_eof; i++) {
+            if (events[i].data.u32 == 0) {
+                rl_callback_read_char();
+                continue;
+            }
+            reap_events(0);
+            if (jc_notices_len) {
+                rl_clear_visible_line();
+                jc_flush_notices();
+                rl_forced_update_display();
+            }
+        }
+    }
+    close(ep);
+}
+
+// ====== Modo servidor (--serve SOCKET / --client SOCKET) ======
+// Un proceso gtesh ya inicializado atiende batches por un socket Unix, para
+// no pagar el arranque del shell en cada invocación:
+//   - El cliente envía un encabezado y, con SCM_RIGHTS, sus descriptores:
+//     el batch, stdin, stdout, stderr y su directorio actual.
+//   - El servidor crea un worker (fork) por conexión: cada cliente tiene su
+//     propio cwd, PATH y caché (copias del servidor) y corren a la vez.
+//   - Los hijos del worker escriben directo en la terminal del cliente; por
+//     el socket vuelven los registros de --stats (si el cliente los pidió)
+//     y, al terminar, uno final con el estado de salida y el consumo total:
+//     {"exit":0,"signal":0,"wall_ms":...,"user_ms":...,"sys_ms":...,"maxrss_kb":...}
+
+#define SERVE_MAGIC 0x67747368u  // "gtsh"
+#define SERVE_STATS 0x1u         // El cliente quiere los registros de --stats
+#define SERVE_NFDS 5             // batch, stdin, stdout, stderr, cwd
+
+typedef struct {
+    uint32_t magic;
+    uint32_t flags;
+} serve_hdr_t;
+
+// Un worker atendiendo a un cliente
+typedef struct serve_worker {
+    pid_t pid;
+    int pidfd;             // -1 sin pidfd (se recolecta con wait4(-1, WNOHANG))
+    int conn_fd;           // Conexión con el cliente (para el registro final)
+    long long start_ns;
+    struct serve_worker *next;
+} serve_worker_t;
+
+static const char *serve_path = NULL;   // --serve SOCKET
+static const char *client_path = NULL;  // --client SOCKET
+
+// Llenar la dirección de un socket Unix. Retorna: 0, o -1 si la ruta es muy larga
+static int serve_addr(struct sockaddr_un *addr, const char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) return -1;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+// Código del worker: recibir los descriptores del cliente, adoptarlos y
+// ejecutar su batch como lo haría './gtesh archivo'. No retorna
+static void serve_worker_run(int conn) {
+    serve_hdr_t hdr;
+    struct iovec iov = { &hdr, sizeof(hdr) };
+    union {
+        char buf[CMSG_SPACE(SERVE_NFDS * sizeof(int))];
+        struct cmsghdr align;
+    } ctrl;
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = ctrl.buf, .msg_controllen = sizeof(ctrl.buf)
+    };
+    ssize_t n;
+    while ((n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (n != sizeof(hdr) || hdr.magic != SERVE_MAGIC || !cm ||
+        cm->cmsg_type != SCM_RIGHTS ||
+        cm->cmsg_len != CMSG_LEN(SERVE_NFDS * sizeof(int))) {
+        exit(1);
+    }
+    int fds[SERVE_NFDS];
+    memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+
+    // PASO 1: adoptar stdin/stdout/stderr y el directorio del cliente
+    if (dup2(fds[1], STDIN_FILENO) == -1 || dup2(fds[2], STDOUT_FILENO) == -1 ||
+        dup2(fds[3], STDERR_FILENO) == -1) {
+        exit(1);
+    }
+    if (fchdir(fds[4]) == -1) {
+        util_print_error();
+        exit(1);
+    }
+    path_state_chdir();  // Los dirs relativos del PATH cambiaron de destino
+    for (int i = 1; i < SERVE_NFDS; i++) close(fds[i]);
+
+    // PASO 2: los registros de --stats van al cliente por el socket
+    if (stats_file) fclose(stats_file);  // El del servidor no se comparte
+    stats_file = NULL;
+    if (hdr.flags & SERVE_STATS) {
+        stats_file = fdopen(conn, "w");
+        if (stats_file) setvbuf(stats_file, NULL, _IOLBF, 0);  // Uno por línea, al momento
+    }
+
+    // PASO 3: ejecutar el batch con un planificador propio
+    sched_init();
+    batch_reader_t batch;
+    if (batch_open_fd(&batch, fds[0]) == -1) {
+        util_print_error();
+        exit(1);
+    }
+    run_batch(&batch);
+}
+
+// Un worker terminó: enviar al cliente el registro final y cerrar la conexión
+static void serve_worker_done(serve_worker_t *w, int status, const struct rusage *ru) {
+    char buf[256];
+    int exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    int len = snprintf(buf, sizeof(buf),
+                       "{\"exit\":%d,\"signal\":%d,\"wall_ms\":%.3f,\"user_ms\":%.3f,"
+                       "\"sys_ms\":%.3f,\"maxrss_kb\":%ld}\n",
+                       exit_code, WIFSIGNALED(status) ? WTERMSIG(status) : 0,
+                       (now_ns() - w->start_ns) / 1e6, timeval_ms(ru->ru_utime),
+                       timeval_ms(ru->ru_stime), ru->ru_maxrss);
+    send(w->conn_fd, buf, len, MSG_NOSIGNAL);  // El cliente pudo haberse ido
+    close(w->conn_fd);
+    free(w);
+}
+
+// Bucle del servidor: aceptar conexiones y recolectar workers. No retorna
+static void run_server(void) {
+    struct sockaddr_un addr;
+    if (serve_addr(&addr, serve_path) == -1) {
+        util_print_error();
+        exit(1);
+    }
+    // Reemplazar un socket viejo (de un servidor anterior), nunca otro archivo
+    struct stat sb;
+    if (lstat(serve_path, &sb) == 0 && S_ISSOCK(sb.st_mode)) unlink(serve_path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event lev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (listen_fd == -1 || epfd == -1 ||
+        bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, SOMAXCONN) == -1 ||
+        epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &lev) == -1) {
+        util_print_error();
+        exit(1);
+    }
+
+    serve_worker_t *workers = NULL;  // Workers sin pidfd (esperados con wait4)
+    while (1) {
+        struct epoll_event events[EV_MAX_EVENTS];
+        // Sin pidfd no hay evento al terminar un worker: revisar cada 100 ms
+        int n = epoll_wait(epfd, events, EV_MAX_EVENTS, workers ? 100 : -1);
+        for (int i = 0; i < n; i++) {
+            serve_worker_t *w = events[i].data.ptr;
+            if (w) {  // pidfd de un worker legible: terminó
+                int status;
+                struct rusage ru;
+                while (wait4(w->pid, &status, 0, &ru) == -1 && errno == EINTR);
+                epoll_ctl(epfd, EPOLL_CTL_DEL, w->pidfd, NULL);
+                close(w->pidfd);
+                serve_worker_done(w, status, &ru);
+                continue;
+            }
+            // Socket de escucha: aceptar todas las conexiones pendientes
+            int conn;
+            while ((conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) != -1) {
+                w = malloc(sizeof(serve_worker_t));
+                if (!w) {
+                    close(conn);
+                    continue;
+                }
+                w->conn_fd = conn;
+                w->start_ns = now_ns();
+                w->pid = fork();
+                if (w->pid == 0) {  // Worker: no necesita nada del servidor
+                    close(listen_fd);
+                    close(epfd);
+                    serve_worker_run(conn);
+                }
+                if (w->pid == -1) {
+                    util_print_error();
+                    close(conn);
+                    free(w);
+                    continue;
+                }
+                w->pidfd = (int)syscall(SYS_pidfd_open, w->pid, 0);
+                struct epoll_event wev = { .events = EPOLLIN, .data.ptr = w };
+                if (w->pidfd != -1 && epoll_ctl(epfd, EPOLL_CTL_ADD, w->pidfd, &wev) == -1) {
+                    close(w->pidfd);
+                    w->pidfd = -1;
+                }
+                if (w->pidfd == -1) {
+                    w->next = workers;
+                    workers = w;
+                }
+            }
+        }
+        // Recolectar los workers sin pidfd que ya terminaron
+        serve_worker_t **link = &workers;
+        while (*link) {
+            serve_worker_t *w = *link;
+            int status;
+            struct rusage ru;
+            if (wait4(w->pid, &status, WNOHANG, &ru) == w->pid) {
+                *link = w->next;
+                serve_worker_done(w, status, &ru);
+            } else {
+                link = &w->next;
+            }
+        }
+    }
+}
+
+// Modo cliente: enviar el batch (archivo o stdin) al servidor, copiar los
+// registros de vuelta a --stats y salir con el estado del batch. No retorna
+static void run_client(const char *file) {
+    struct sockaddr_un addr;
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1 || serve_addr(&addr, client_path) == -1 ||
+        connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        util_print_error();
+        exit(1);
+    }
+    int batch_fd = STDIN_FILENO;
+    if (file && strcmp(file, "-") != 0) {
+        batch_fd = open(file, O_RDONLY | O_CLOEXEC);
+        if (batch_fd == -1) {  // Archivo no existe o no se puede abrir
+            util_print_error();
+            exit(1);
+        }
+    }
+    int cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (cwd_fd == -1) {
+        util_print_error();
+        exit(1);
     }
 
-    if (pid == 0) {  // Código del PROCESO HIJO
-        // PASO 4a: Configurar redirección de salida si se especificó '>'
-        if (cmd->redir_file) {
-            // Abrir archivo: crear si no existe, truncar si existe, solo escritura
-            int fd = open(cmd->redir_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (fd == -1) {  // Error al abrir archivo
-                util_print_error();
-                exit(1);
+    // PASO 1: encabezado + descriptores en un solo mensaje
+    serve_hdr_t hdr = { SERVE_MAGIC, stats_file ? SERVE_STATS : 0 };
+    int fds[SERVE_NFDS] = { batch_fd, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, cwd_fd };
+    struct iovec iov = { &hdr, sizeof(hdr) };
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } ctrl;
+    memset(&ctrl, 0, sizeof(ctrl));
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = ctrl.buf, .msg_controllen = sizeof(ctrl.buf)
+    };
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(hdr)) {
+        util_print_error();
+        exit(1);
+    }
+
+    // PASO 2: leer los registros hasta EOF; el último es el estado final
+    char buf[4096];
+    size_t len = 0;
+    int exit_code = -1, signo = 0;
+    while (1) {
+        ssize_t n = read(sock, buf + len, sizeof(buf) - len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len += (size_t)n;
+        char *start = buf, *nl;
+        while ((nl = memchr(start, '\n', buf + len - start)) != NULL) {
+            if (strncmp(start, "{\"exit\":", 8) == 0) {
+                sscanf(start, "{\"exit\":%d,\"signal\":%d", &exit_code, &signo);
             }
-            // dup2: redirigir stdout (1) y stderr (2) al archivo
-            // Después de esto, printf y fprintf(stderr) escriben al archivo
-            if (dup2(fd, STDOUT_FILENO) == -1 || dup2(fd, STDERR_FILENO) == -1) {
-                util_print_error();
-                close(fd);
-                exit(1);
+            if (stats_file) fwrite(start, 1, nl - start + 1, stats_file);
+            start = nl + 1;
+        }
+        len -= start - buf;
+        memmove(buf, start, len);
+        if (len == sizeof(buf)) len = 0;  // Registro demasiado largo: descartarlo
+    }
+    if (stats_file) fclose(stats_file);
+    if (exit_code == -1 && signo == 0) {  // Sin registro final: el servidor falló
+        util_print_error();
+        exit(1);
+    }
+    exit(signo ? 128 + signo : exit_code);
+}
+
+// ====== Autocompletado de comandos (trie de ejecutables del PATH) ======
+// Con Tab en la posición de un comando (inicio de línea, o después de '&',
+// '|' o un prefijo como 'time'), readline completa con los builtins y los
+// ejecutables de path_dirs. Los nombres viven en un trie compacto (nodos en
+// un solo array, hijos como lista de hermanos ordenada por carácter); cada
+// directorio del PATH se indexa por separado y sólo se vuelve a leer cuando
+// cambia su mtime, o cuando 'path' lo agrega/quita (el resto no se toca).
+// En otras posiciones se deja la completación de archivos de readline.
+
+#define TRIE_NIL 0              // Índice nulo (el nodo 0 es la raíz)
+
+typedef struct {
+    uint32_t child;        // Primer hijo (TRIE_NIL si no hay)
+    uint32_t sibling;      // Siguiente hermano (orden creciente de 'c')
+    uint32_t words;        // Nombres (con repeticiones entre dirs) bajo este nodo
+    uint16_t term;         // Directorios donde termina aquí un nombre
+    unsigned char c;
+} trie_node_t;
+
+static trie_node_t *trie_nodes = NULL;
+static uint32_t trie_used = 0, trie_cap = 0;
+static uint32_t trie_dead = 0;  // Nodos con words == 0 (se compactan al rearmar)
+
+// Un directorio indexado: sus nombres, para poder sacarlos del trie
+typedef struct compl_dir {
+    char *path;            // Como aparece en path_dirs ("" = builtins)
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    char *names;           // Nombres separados por '\0'
+    size_t names_len;
+    int seen;              // Marca de compl_sync: sigue en el PATH
+    struct compl_dir *next;
+} compl_dir_t;
+
+static compl_dir_t *compl_dirs = NULL;
+static compl_dir_t *compl_builtins = NULL;   // Builtins y plugins (path "")
+static unsigned long compl_builtins_gen = 0;  // builtin_gen indexado
+
+// Nodo nuevo (o NIL si no hay memoria)
+static uint32_t trie_alloc(unsigned char c) {
+    if (trie_used == trie_cap) {
+        uint32_t new_cap = trie_cap ? trie_cap * 2 : 1024;
+        trie_node_t *grown = realloc(trie_nodes, new_cap * sizeof(trie_node_t));
+        if (!grown) return TRIE_NIL;
+        trie_nodes = grown;
+        trie_cap = new_cap;
+    }
+    trie_node_t *n = &trie_nodes[trie_used];
+    memset(n, 0, sizeof(*n));
+    n->c = c;
+    trie_dead++;  // Hasta que trie_count le sume un nombre
+    return trie_used++;
+}
+
+// Ajustar la cantidad de nombres bajo un nodo (y la cuenta de nodos sin uso)
+static void trie_count(uint32_t node, int delta) {
+    if (trie_nodes[node].words == 0) trie_dead--;
+    trie_nodes[node].words += delta;
+    if (trie_nodes[node].words == 0) trie_dead++;
+}
+
+// Agregar (delta = 1) o quitar (delta = -1) una aparición de 'name'
+static void trie_update(const char *name, int delta) {
+    if (trie_used == 0 && trie_alloc(0) == TRIE_NIL) return;  // Raíz
+    uint32_t node = 0;
+    trie_count(0, delta);
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        // Buscar (o insertar en orden) el hijo con el carácter *p
+        uint32_t *link = &trie_nodes[node].child;
+        while (*link != TRIE_NIL && trie_nodes[*link].c < *p) link = &trie_nodes[*link].sibling;
+        if (*link == TRIE_NIL || trie_nodes[*link].c != *p) {
+            if (delta < 0) return;  // No estaba (no debería pasar)
+            uint32_t n = trie_alloc(*p);  // Puede mover trie_nodes: recalcular link
+            if (n == TRIE_NIL) return;
+            link = &trie_nodes[node].child;
+            while (*link != TRIE_NIL && trie_nodes[*link].c < *p) link = &trie_nodes[*link].sibling;
+            trie_nodes[n].sibling = *link;
+            *link = n;
+        }
+        node = *link;
+        trie_count(node, delta);
+    }
+    trie_nodes[node].term += delta;
+}
+
+// Agregar o quitar todos los nombres de un directorio indexado
+static void compl_dir_apply(const compl_dir_t *d, int delta) {
+    for (size_t off = 0; off < d->names_len; off += strlen(d->names + off) + 1) {
+        trie_update(d->names + off, delta);
+    }
+}
+
+static int compl_name_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Volver a leer un directorio y aplicar al trie sólo la diferencia con lo
+// indexado antes: d->names está ordenado, así que se recorren ambas listas
+// en orden. Sólo los nombres nuevos se revisan con faccessat (un cambio de
+// permisos no cambia el mtime del directorio, así que no se detectaría igual)
+static void compl_dir_rescan(compl_dir_t *d, int dirfd) {
+    // PASO 1: todos los nombres candidatos del directorio, ordenados
+    int fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    if (!dir) return;
+    char *raw = NULL;
+    size_t raw_len = 0, raw_cap = 0, count = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.' || de->d_type == DT_DIR) continue;
+        size_t len = strlen(de->d_name) + 1;
+        if (raw_len + len > raw_cap) {
+            size_t new_cap = raw_cap ? raw_cap * 2 : 4096;
+            while (new_cap < raw_len + len) new_cap *= 2;
+            char *grown = realloc(raw, new_cap);
+            if (!grown) break;
+            raw = grown;
+            raw_cap = new_cap;
+        }
+        memcpy(raw + raw_len, de->d_name, len);
+        raw_len += len;
+        count++;
+    }
+    closedir(dir);
+    char **list = malloc((count ? count : 1) * sizeof(char *));
+    char *names = malloc(raw_len ? raw_len : 1);
+    if (!list || !names) {
+        free(raw);
+        free(list);
+        free(names);
+        return;
+    }
+    size_t off = 0;
+    for (size_t k = 0; k < count; k++, off += strlen(raw + off) + 1) list[k] = raw + off;
+    qsort(list, count, sizeof(char *), compl_name_cmp);
+
+    // PASO 2: recorrer lo viejo y lo nuevo en orden
+    size_t old_off = 0, names_len = 0, k = 0;
+    while (old_off < d->names_len || k < count) {
+        const char *old = old_off < d->names_len ? d->names + old_off : NULL;
+        int cmp = !old ? 1 : k == count ? -1 : strcmp(old, list[k]);
+        const char *keep = NULL;
+        if (cmp < 0) {  // Ya no está
+            trie_update(old, -1);
+        } else if (cmp == 0) {  // Sigue
+            keep = old;
+        } else {  // Nuevo: ¿es un ejecutable?
+            struct stat sb;
+            if (fstatat(dirfd, list[k], &sb, 0) == 0 && S_ISREG(sb.st_mode) &&
+                faccessat(dirfd, list[k], X_OK, 0) == 0) {
+                trie_update(list[k], 1);
+                keep = list[k];
             }
-            close(fd);  // Ya no necesitamos el descriptor original
         }
+        if (keep) {
+            size_t len = strlen(keep) + 1;
+            memcpy(names + names_len, keep, len);
+            names_len += len;
+        }
+        if (cmp <= 0) old_off += strlen(old) + 1;
+        if (cmp >= 0) k++;
+    }
+    free(d->names);
+    d->names = names;
+    d->names_len = names_len;
+    free(list);
+    free(raw);
+}
 
-        // PASO 4b: Reemplazar el proceso hijo con el ejecutable usando execv()
-        // execv NO retorna si tiene éxito (el proceso se reemplaza completamente)
-        // Sólo retorna si hay error (ej: el archivo no es ejecutable)
-        execv(exec_path, cmd->argv);
-        util_print_error();  // Si llegamos aquí, execv falló
-        exit(1);
+// Rearmar el trie desde cero cuando la mayoría de sus nodos quedó sin uso
+static void trie_compact(void) {
+    trie_used = 0;
+    trie_dead = 0;
+    for (compl_dir_t *d = compl_dirs; d; d = d->next) compl_dir_apply(d, 1);
+}
+
+// Poner el índice al día con path_dirs: indexar dirs nuevos o modificados
+// y sacar los que ya no están en el PATH
+static void compl_sync(void) {
+    if (!compl_builtins || compl_builtins_gen != builtin_gen) {
+        // Los builtins, los comandos de plugins y los prefijos, como un
+        // directorio más (se rehace cuando 'load' agrega comandos). 'cache'
+        // también es builtin: no repetirlo
+        compl_dir_t *d = compl_builtins;
+        if (!d) {
+            d = calloc(1, sizeof(compl_dir_t));
+            if (!d || !(d->path = strdup(""))) {
+                free(d);
+                return;
+            }
+            d->next = compl_dirs;
+            compl_dirs = d;
+            compl_builtins = d;
+        }
+        compl_dir_apply(d, -1);
+        free(d->names);
+        d->names_len = 0;
+        for (int i = 0; cmd_prefixes[i].name; i++) {
+            if (!builtin_lookup(cmd_prefixes[i].name)) d->names_len += strlen(cmd_prefixes[i].name) + 1;
+        }
+        for (size_t i = 0; i < builtin_cap; i++) {
+            const builtin_t *b = &builtin_table[i];
+            if (b->name && (b->shell || b->plugin)) d->names_len += strlen(b->name) + 1;
+        }
+        d->names = malloc(d->names_len);
+        if (!d->names) {
+            d->names_len = 0;
+            return;
+        }
+        size_t off = 0;
+        for (int i = 0; cmd_prefixes[i].name; i++) {
+            if (builtin_lookup(cmd_prefixes[i].name)) continue;
+            memcpy(d->names + off, cmd_prefixes[i].name, strlen(cmd_prefixes[i].name) + 1);
+            off += strlen(cmd_prefixes[i].name) + 1;
+        }
+        for (size_t i = 0; i < builtin_cap; i++) {
+            const builtin_t *b = &builtin_table[i];
+            if (b->name && (b->shell || b->plugin)) {
+                memcpy(d->names + off, b->name, strlen(b->name) + 1);
+                off += strlen(b->name) + 1;
+            }
+        }
+        compl_dir_apply(d, 1);
+        compl_builtins_gen = builtin_gen;
     }
 
-    // Código del PROCESO PADRE (el shell)
-    free(exec_path);  // Ya no necesitamos la ruta
-    
-    // Decidir si esperamos al hijo o no
-    if (!cmd->is_background) {
-        // Comando normal (sin &): esperar a que termine antes de continuar
-        int status;
-        waitpid(pid, &status, 0);  // Bloquea hasta que el hijo termine
+    for (compl_dir_t *d = compl_dirs; d; d = d->next) d->seen = d->path[0] == '\0';
+    for (size_t i = 0; i < path_count; i++) {
+        compl_dir_t *d = compl_dirs;
+        while (d && (d->seen || strcmp(d->path, path_dirs[i]) != 0)) d = d->next;
+        if (!d) {  // Directorio nuevo en el PATH (o repetido en path_dirs)
+            int repeated = 0;
+            for (compl_dir_t *o = compl_dirs; o; o = o->next) {
+                if (o->seen && strcmp(o->path, path_dirs[i]) == 0) repeated = 1;
+            }
+            if (repeated) continue;
+            d = calloc(1, sizeof(compl_dir_t));
+            if (!d || !(d->path = strdup(path_dirs[i]))) {
+                free(d);
+                continue;
+            }
+            d->next = compl_dirs;
+            compl_dirs = d;
+        }
+        d->seen = 1;
+        struct stat sb;
+        int dirfd = open(path_dirs[i], O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (dirfd == -1 || fstat(dirfd, &sb) == -1) {
+            memset(&sb, 0, sizeof(sb));  // No existe: índice vacío
+        }
+        if (sb.st_dev != d->dev || sb.st_ino != d->ino ||
+            sb.st_mtim.tv_sec != d->mtime.tv_sec || sb.st_mtim.tv_nsec != d->mtime.tv_nsec ||
+            (!d->names && dirfd != -1)) {
+            if (dirfd != -1) {
+                compl_dir_rescan(d, dirfd);
+            } else {  // El directorio desapareció
+                compl_dir_apply(d, -1);
+                d->names_len = 0;
+            }
+            d->dev = sb.st_dev;
+            d->ino = sb.st_ino;
+            d->mtime = sb.st_mtim;
+        }
+        if (dirfd != -1) close(dirfd);
     }
-    // Si is_background==1, NO esperamos aquí; seguimos inmediatamente
-    // La espera se hace después con wait_for_children()
-    
-    return pid;  // Retornar PID para tracking (aunque no se usa mucho)
+
+    // Quitar los directorios que salieron del PATH
+    compl_dir_t **link = &compl_dirs;
+    while (*link) {
+        compl_dir_t *d = *link;
+        if (d->seen) {
+            link = &d->next;
+            continue;
+        }
+        compl_dir_apply(d, -1);
+        *link = d->next;
+        free(d->path);
+        free(d->names);
+        free(d);
+    }
+    if (trie_dead > trie_used / 2 && trie_dead > 1024) trie_compact();
 }
 
-// Esperar a que terminen TODOS los procesos hijos en background
-// Usado después de lanzar comandos paralelos con &
-// waitpid(-1, ...) espera a CUALQUIER hijo; retorna -1 cuando no quedan hijos
-static void wait_for_children(void) {
-    while (waitpid(-1, NULL, 0) > 0);  // Bucle hasta que no haya más hijos
+// Juntar en matches[] todos los nombres bajo 'node' (buf tiene su prefijo)
+// Retorna: 0, o -1 si no hay memoria
+static int trie_collect(uint32_t node, char *buf, size_t len, size_t buf_cap,
+                        char ***matches, size_t *count, size_t *cap) {
+    if (trie_nodes[node].term > 0) {
+        if (*count + 2 > *cap) {
+            size_t new_cap = *cap * 2;
+            char **grown = realloc(*matches, new_cap * sizeof(char *));
+            if (!grown) return -1;
+            *matches = grown;
+            *cap = new_cap;
+        }
+        char *word = malloc(len + 1);
+        if (!word) return -1;
+        memcpy(word, buf, len);
+        word[len] = '\0';
+        (*matches)[++*count] = word;  // [0] queda para el prefijo común
+    }
+    if (len + 1 >= buf_cap) return 0;  // Nombre absurdamente largo
+    for (uint32_t ch = trie_nodes[node].child; ch != TRIE_NIL; ch = trie_nodes[ch].sibling) {
+        if (trie_nodes[ch].words == 0) continue;
+        buf[len] = (char)trie_nodes[ch].c;
+        if (trie_collect(ch, buf, len + 1, buf_cap, matches, count, cap) == -1) return -1;
+    }
+    return 0;
+}
+
+// Completar un nombre de comando
+// Retorna: array para readline ([0] = prefijo común, luego los nombres, NULL),
+// o NULL si ningún nombre empieza con 'prefix'
+static char **compl_commands(const char *prefix) {
+    compl_sync();
+    if (trie_used == 0) return NULL;
+    uint32_t node = 0;
+    for (const unsigned char *p = (const unsigned char *)prefix; *p; p++) {
+        uint32_t ch = trie_nodes[node].child;
+        while (ch != TRIE_NIL && trie_nodes[ch].c < *p) ch = trie_nodes[ch].sibling;
+        if (ch == TRIE_NIL || trie_nodes[ch].c != *p || trie_nodes[ch].words == 0) return NULL;
+        node = ch;
+    }
+    if (trie_nodes[node].words == 0) return NULL;
+
+    char buf[4096];
+    size_t len = strlen(prefix);
+    if (len >= sizeof(buf)) return NULL;
+    memcpy(buf, prefix, len);
+    // Prefijo común: bajar mientras haya un solo camino posible
+    uint32_t common = node;
+    size_t common_len = len;
+    while (trie_nodes[common].term == 0 && common_len + 1 < sizeof(buf)) {
+        uint32_t only = TRIE_NIL;
+        int live = 0;
+        for (uint32_t ch = trie_nodes[common].child; ch != TRIE_NIL; ch = trie_nodes[ch].sibling) {
+            if (trie_nodes[ch].words > 0) {
+                only = ch;
+                live++;
+            }
+        }
+        if (live != 1) break;
+        buf[common_len++] = (char)trie_nodes[only].c;
+        common = only;
+    }
+
+    size_t count = 0, cap = 16;
+    char **matches = malloc(cap * sizeof(char *));
+    if (!matches) return NULL;
+    matches[0] = strndup(buf, common_len);
+    if (!matches[0] || trie_collect(common, buf, common_len, sizeof(buf),
+                                    &matches, &count, &cap) == -1) {
+        for (size_t i = 0; i <= count; i++) free(matches[i]);
+        free(matches);
+        return NULL;
+    }
+    matches[count + 1] = NULL;
+    return matches;
+}
+
+// Función de completación de readline (rl_attempted_completion_function)
+// Los comandos se completan con el trie; los argumentos, como archivos
+// Palabra de rl_line_buffer que termina antes de pos (saltando blancos)
+// Retorna: su fin; *word_start queda en su inicio (igual al fin si no hay)
+static int compl_word_before(int pos, int *word_start) {
+    while (pos > 0 && (rl_line_buffer[pos - 1] == ' ' || rl_line_buffer[pos - 1] == '\t')) pos--;
+    int word_end = pos;
+    while (pos > 0 && !strchr(" \t&|>", rl_line_buffer[pos - 1])) pos--;
+    *word_start = pos;
+    return word_end;
+}
+
+// Retorna: índice en cmd_prefixes de la palabra [start, end), o -1
+static int compl_prefix_at(int start, int end) {
+    for (int i = 0; cmd_prefixes[i].name; i++) {
+        size_t len = strlen(cmd_prefixes[i].name);
+        if ((size_t)(end - start) == len && strncmp(rl_line_buffer + start, cmd_prefixes[i].name, len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static char **compl_readline(const char *text, int start, int end) {
+    (void)end;
+    // ¿Hay una palabra de comando antes? Retroceder sobre los prefijos y
+    // sus argumentos ("time", "cache", "timeout 5")
+    int pos = start;
+    while (1) {
+        int word_start, word_end = compl_word_before(pos, &word_start);
+        int p = compl_prefix_at(word_start, word_end);
+        if (p >= 0 && cmd_prefixes[p].args == 0) {
+            pos = word_start;
+            continue;
+        }
+        if (p < 0 && word_start < word_end && word_end - word_start < 32) {
+            // ¿Es la duración de 'timeout'? (como en apply_prefixes)
+            int prev_start, prev_end = compl_word_before(word_start, &prev_start);
+            p = compl_prefix_at(prev_start, prev_end);
+            char arg[32];
+            memcpy(arg, rl_line_buffer + word_start, word_end - word_start);
+            arg[word_end - word_start] = '\0';
+            if (p >= 0 && cmd_prefixes[p].args == 1 && parse_duration(arg) >= 0) {
+                pos = prev_start;
+                continue;
+            }
+        }
+        pos = word_end;
+        break;
+    }
+    int command_pos = pos == 0 || rl_line_buffer[pos - 1] == '&' || rl_line_buffer[pos - 1] == '|';
+    if (!command_pos || strchr(text, '/')) return NULL;  // Archivos (default de readline)
+    rl_attempted_completion_over = 1;  // Sin coincidencias: no ofrecer archivos
+    return compl_commands(text);
+}
+
+// ====== Modo benchmark (--bench) ======
+// Mide el costo propio del shell con cargas sintéticas y escribe un registro
+// JSON por línea en stdout, para comparar entre builds (ej: desde un script):
+//   parse   -> líneas/seg de split_parallel_commands por tipo de carga
+//   lookup  -> ns por búsqueda en un PATH largo (legacy, sin caché, con caché)
+//   spawn   -> latencia de lanzar+esperar /bin/true (p50/p99) por backend
+//   e2e     -> líneas/seg del camino completo y tiempo en cada etapa
+//              (split_parallel_commands -> execute_command -> wait_for_children)
+//   cpu     -> jobs/seg de un abanico de jobs CPU-bound con cada política de
+//              afinidad (none, rr, numa)
+//   complete-> tiempo de indexar un dir con muchos ejecutables y latencia
+//              (p50/p99) de completar un prefijo con el trie
+#define BENCH_DEFAULT_ITERS 2000   // Iteraciones base (--bench-iters)
+#define BENCH_PATH_DIRS 64         // Directorios vacíos antes de /bin en 'lookup'
+
+static const char *bench_suites = NULL;   // --bench[=lista]: suites a correr
+static long bench_iters = BENCH_DEFAULT_ITERS;
+static char bench_dir[] = "/tmp/gtesh-bench-XXXXXX";  // Archivos temporales
+
+// ¿La suite 'name' está en la lista separada por comas? ("all" = todas)
+static int bench_selected(const char *name) {
+    if (strcmp(bench_suites, "all") == 0) return 1;
+    size_t len = strlen(name);
+    for (const char *p = bench_suites; *p;) {
+        const char *end = strchr(p, ',');
+        size_t n = end ? (size_t)(end - p) : strlen(p);
+        if (n == len && strncmp(p, name, len) == 0) return 1;
+        if (!end) break;
+        p = end + 1;
+    }
+    return 0;
+}
+
+static int bench_cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Percentil p (0..100) de un array ya ordenado
+static long long bench_percentile(const long long *sorted, long n, double p) {
+    long idx = (long)(p / 100.0 * (n - 1) + 0.5);
+    return sorted[idx];
+}
+
+// Generar la línea i de una carga sintética en buf
+static void bench_make_line(const char *workload, long i, char *buf, size_t size) {
+    size_t len = 0;
+    if (strcmp(workload, "short") == 0) {
+        snprintf(buf, size, "ls -la /tmp/dir%ld", i % 100);
+    } else if (strcmp(workload, "fanout") == 0) {  // 32 comandos con &
+        for (int k = 0; k < 32 && len < size; k++) {
+            len += snprintf(buf + len, size - len, "%secho %ld %d", k ? " & " : "", i, k);
+        }
+    } else if (strcmp(workload, "longargv") == 0) {  // 512 argumentos
+        len = snprintf(buf, size, "cmd");
+        for (int k = 0; k < 512 && len < size; k++) {
+            len += snprintf(buf + len, size - len, " arg%d", k);
+        }
+    } else if (strcmp(workload, "redir") == 0) {
+        snprintf(buf, size, "gcc -O2 -c file%ld.c -o file%ld.o > build%ld.log & "
+                 "grep -c x file%ld.c > count%ld.txt", i, i, i, i, i);
+    } else {  // pipeline
+        snprintf(buf, size, "cat in%ld.txt | sort | uniq -c | sort -rn > out%ld.txt", i, i);
+    }
+}
+
+// Suite 'parse': throughput del parser (sin ejecutar nada)
+static void bench_parse(void) {
+    static const char *workloads[] = { "short", "fanout", "longargv", "redir", "pipeline", NULL };
+    char tmpl[8192], line[8192];
+    for (int w = 0; workloads[w]; w++) {
+        long lines = bench_iters * 100;
+        size_t bytes = 0;
+        long long elapsed = 0;
+        for (long i = 0; i < lines; i++) {
+            bench_make_line(workloads[w], i, tmpl, sizeof(tmpl));
+            size_t len = strlen(tmpl) + 1;
+            memcpy(line, tmpl, len);  // El parser modifica la línea
+            bytes += len;
+            long long t0 = now_ns();
+            int count;
+            split_parallel_commands(line, &count);
+            arena_reset(&line_arena);
+            elapsed += now_ns() - t0;
+        }
+        double secs = elapsed / 1e9;
+        printf("{\"bench\":\"parse\",\"workload\":\"%s\",\"lines\":%ld,\"seconds\":%.6f,"
+               "\"lines_per_sec\":%.0f,\"mb_per_sec\":%.1f}\n",
+               workloads[w], lines, secs, lines / secs, bytes / secs / 1e6);
+    }
+}
+
+// Suite 'lookup': costo de find_executable con BENCH_PATH_DIRS directorios
+// vacíos antes de /bin. 'legacy' reproduce la búsqueda original (asprintf +
+// access por directorio) para comparar el ahorro de syscalls.
+static void bench_lookup(void) {
+    size_t count = BENCH_PATH_DIRS + 1;
+    char **dirs = calloc(count, sizeof(char*));
+    if (!dirs) return;
+    for (size_t i = 0; i < BENCH_PATH_DIRS; i++) {
+        if (asprintf(&dirs[i], "%s/path%zu", bench_dir, i) == -1) return;
+        mkdir(dirs[i], 0755);
+    }
+    dirs[BENCH_PATH_DIRS] = "/bin";
+    update_path(dirs, count);
+
+    long n = bench_iters * 10;
+    const char *modes[] = { "legacy", "cold", "cached" };
+    for (int m = 0; m < 3; m++) {
+        long long t0 = now_ns();
+        for (long i = 0; i < n; i++) {
+            char *found = NULL;
+            if (m == 0) {
+                for (size_t d = 0; d < path_count && !found; d++) {
+                    char *full = NULL;
+                    if (asprintf(&full, "%s/%s", path_dirs[d], "true") == -1) break;
+                    if (access(full, X_OK) == 0) found = full;
+                    else free(full);
+                }
+            } else {
+                if (m == 1) hash_clear();
+                found = find_executable("true");
+            }
+            free(found);
+        }
+        double ns = (double)(now_ns() - t0) / n;
+        printf("{\"bench\":\"lookup\",\"mode\":\"%s\",\"path_dirs\":%zu,\"lookups\":%ld,"
+               "\"ns_per_lookup\":%.0f}\n", modes[m], count, n, ns);
+    }
+
+    for (size_t i = 0; i < BENCH_PATH_DIRS; i++) {
+        rmdir(dirs[i]);
+        free(dirs[i]);
+    }
+    free(dirs);
+    char *defaults[] = { "/bin", "/usr/bin" };
+    update_path(defaults, 2);
+}
+
+// Suite 'spawn': latencia de lanzar y esperar /bin/true por cada backend
+static void bench_spawn(void) {
+    long n = bench_iters / 4 > 10 ? bench_iters / 4 : 10;
+    long long *lat = malloc(n * sizeof(long long));
+    if (!lat) return;
+    char *argv[] = { "/bin/true", NULL };
+    cmd_t cmd = { .argv = argv };
+    spawn_backend_t saved = spawn_backend;
+    const char *names[] = { "posix", "fork" };
+    spawn_backend_t backends[] = { SPAWN_POSIX, SPAWN_FORK };
+
+    for (int b = 0; b < 2; b++) {
+        spawn_backend = backends[b];
+        for (long i = 0; i < n; i++) {
+            long long t0 = now_ns();
+            execute_command(&cmd);
+            wait_for_children();
+            lat[i] = now_ns() - t0;
+        }
+        qsort(lat, n, sizeof(long long), bench_cmp_ll);
+        printf("{\"bench\":\"spawn\",\"backend\":\"%s\",\"spawns\":%ld,\"p50_us\":%.1f,"
+               "\"p99_us\":%.1f,\"max_us\":%.1f}\n", names[b], n,
+               bench_percentile(lat, n, 50) / 1e3, bench_percentile(lat, n, 99) / 1e3,
+               lat[n - 1] / 1e3);
+    }
+    spawn_backend = saved;
+    free(lat);
+}
+
+// Suite 'e2e': camino completo de una línea, con el tiempo repartido entre
+// parseo, lanzamiento (execute_command) y espera (reap/wait_for_children)
+static void bench_e2e(void) {
+    static const char *workloads[] = { "short", "fanout", "redir", NULL };
+    char line[4096];
+    for (int w = 0; workloads[w]; w++) {
+        long lines = bench_iters / 10 > 10 ? bench_iters / 10 : 10;
+        long long t_parse = 0, t_exec = 0, t_wait = 0;
+        long commands = 0;
+        long long start = now_ns();
+        for (long i = 0; i < lines; i++) {
+            if (w == 0) {
+                snprintf(line, sizeof(line), "true");
+            } else if (w == 1) {
+                snprintf(line, sizeof(line), "true & true & true & true & true & true & true & true");
+            } else {
+                snprintf(line, sizeof(line), "true > %s/out%ld & true > %s/out%ld",
+                         bench_dir, i % 4, bench_dir, (i + 1) % 4);
+            }
+            long long t0 = now_ns();
+            int count;
+            cmd_t **cmds = split_parallel_commands(line, &count);
+            long long t1 = now_ns();
+            t_parse += t1 - t0;
+            for (int k = 0; cmds && k < count; k++) {
+                long long tw = now_ns();
+                while (running_count >= jobs_limit) reap_children();
+                long long te = now_ns();
+                execute_command(cmds[k]);
+                t_wait += te - tw;
+                t_exec += now_ns() - te;
+            }
+            long long t2 = now_ns();
+            wait_for_children();
+            t_wait += now_ns() - t2;
+            arena_reset(&line_arena);
+            commands += count;
+        }
+        double secs = (now_ns() - start) / 1e9;
+        printf("{\"bench\":\"e2e\",\"workload\":\"%s\",\"lines\":%ld,\"commands\":%ld,"
+               "\"jobs_limit\":%ld,\"lines_per_sec\":%.1f,\"parse_us_per_line\":%.2f,"
+               "\"execute_us_per_cmd\":%.2f,\"wait_us_per_line\":%.2f}\n",
+               workloads[w], lines, commands, jobs_limit, lines / secs,
+               t_parse / 1e3 / lines, commands ? t_exec / 1e3 / commands : 0.0,
+               t_wait / 1e3 / lines);
+    }
+    for (int i = 0; i < 4; i++) {
+        char path[sizeof(bench_dir) + 16];
+        snprintf(path, sizeof(path), "%s/out%d", bench_dir, i);
+        unlink(path);
+    }
+}
+
+// Suite 'cpu': 2 jobs por CPU, cada uno un bucle de sh que sólo usa CPU,
+// lanzados con jobs_limit slots bajo cada política de afinidad
+static void bench_cpu(void) {
+    static const char *const names[] = { "none", "rr", "numa" };
+    char loop[128];
+    snprintf(loop, sizeof(loop), "i=0; while [ $i -lt %ld ]; do i=$((i+1)); done",
+             bench_iters * 50);
+    char *argv[] = { "/bin/sh", "-c", loop, NULL };
+    cmd_t cmd = { .argv = argv };
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    long jobs = cpus * 2 > 4 ? cpus * 2 : 4;
+    place_opts_t saved = place_current;
+    execute_command(&cmd);  // Calentamiento (caché de páginas de sh)
+    wait_for_children();
+
+    for (int a = 0; a < 3; a++) {
+        place_current = place_defaults;
+        place_set(&place_current, "affinity", names[a]);
+        long long start = now_ns();
+        for (long i = 0; i < jobs; i++) {
+            while (running_count >= jobs_limit) reap_children();
+            execute_command(&cmd);
+        }
+        wait_for_children();
+        double secs = (now_ns() - start) / 1e9;
+        printf("{\"bench\":\"cpu\",\"affinity\":\"%s\",\"jobs\":%ld,\"jobs_limit\":%ld,"
+               "\"numa_nodes\":%d,\"secs\":%.3f,\"jobs_per_sec\":%.2f}\n",
+               names[a], jobs, jobs_limit, place_nnodes, secs, jobs / secs);
+        fflush(stdout);
+    }
+    place_current = saved;
+}
+
+// Suite 'complete': un directorio con muchos ejecutables (enlaces duros a
+// /bin/true) en el PATH; mide la indexación inicial, la reindexación tras
+// agregar uno y la latencia de completar prefijos de 1 a 3 letras
+static void bench_complete(void) {
+    long names = bench_iters * 25 > 1000 ? bench_iters * 25 : 1000;
+    char dir[sizeof(bench_dir) + 16];
+    snprintf(dir, sizeof(dir), "%s/bin", bench_dir);
+    if (mkdir(dir, 0755) == -1) return;
+    char path[sizeof(dir) + 32];
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789-_";
+    unsigned long seed = 12345;
+    for (long i = 0; i < names; i++) {
+        char name[32];
+        int len = 4 + (int)(i % 9);
+        for (int k = 0; k < len; k++) {
+            seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+            name[k] = alphabet[(seed >> 33) % (k == 0 ? 26 : sizeof(alphabet) - 1)];
+        }
+        snprintf(name + len, sizeof(name) - len, "%ld", i);  // Únicos
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        link("/bin/true", path);
+    }
+    char *dirs[] = { "/bin", "/usr/bin", dir };
+    update_path(dirs, 3);
+
+    long long t0 = now_ns();
+    compl_sync();
+    long long index_ns = now_ns() - t0;
+    snprintf(path, sizeof(path), "%s/zzz-new", dir);
+    link("/bin/true", path);
+    t0 = now_ns();
+    compl_sync();
+    long long reindex_ns = now_ns() - t0;
+
+    long n = bench_iters;
+    long long *lat = malloc(n * sizeof(long long));
+    long total_matches = 0;
+    if (lat) {
+        for (long i = 0; i < n; i++) {
+            char prefix[4];
+            int len = 1 + (int)(i % 3);
+            for (int k = 0; k < len; k++) {
+                seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+                prefix[k] = alphabet[(seed >> 33) % (k == 0 ? 26 : sizeof(alphabet) - 1)];
+            }
+            prefix[len] = '\0';
+            long long t = now_ns();
+            char **matches = compl_commands(prefix);
+            lat[i] = now_ns() - t;
+            for (long m = 0; matches && matches[m]; m++) {
+                if (m > 0) total_matches++;
+                free(matches[m]);
+            }
+            free(matches);
+        }
+        qsort(lat, n, sizeof(long long), bench_cmp_ll);
+        printf("{\"bench\":\"complete\",\"executables\":%ld,\"trie_nodes\":%u,"
+               "\"index_ms\":%.2f,\"reindex_ms\":%.2f,\"completions\":%ld,"
+               "\"avg_matches\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+               names, trie_used, index_ns / 1e6, reindex_ns / 1e6, n,
+               (double)total_matches / n, bench_percentile(lat, n, 50) / 1e3,
+               bench_percentile(lat, n, 99) / 1e3, lat[n - 1] / 1e3);
+        free(lat);
+    }
+
+    // Limpiar: vaciar el directorio y restaurar el PATH del benchmark
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *d = fd == -1 ? NULL : fdopendir(fd);
+    struct dirent *de;
+    while (d && (de = readdir(d)) != NULL) {
+        if (de->d_name[0] != '.') unlinkat(fd, de->d_name, 0);
+    }
+    if (d) closedir(d);
+    rmdir(dir);
+    update_path(dirs, 2);
+}
+
+// Suite 'glob': expansión de comodines sobre un directorio con
+// bench_iters * 100 archivos. Compara glob(3) con el expansor del shell
+// sin caché (getdents64 en cada expansión) y con caché (sólo un stat).
+static void bench_glob(void) {
+    static const char *exts[] = { "c", "h", "txt", "o" };
+    static const char *patterns[] = { "*", "*.c", "f00[0-4]*.h", "f?????7.o", "*.none", NULL };
+    char dir[sizeof(bench_dir) + 16];
+    snprintf(dir, sizeof(dir), "%s/glob", bench_dir);
+    if (mkdir(dir, 0755) == -1) return;
+    int dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd == -1) return;
+    long files = bench_iters * 100;
+    char name[64];
+    for (long i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "f%06ld.%s", i, exts[i % 4]);
+        int fd = openat(dfd, name, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd != -1) close(fd);
+    }
+
+    char pattern[sizeof(dir) + 32], line[sizeof(pattern) + 8];
+    int reps = 5;
+    for (int p = 0; patterns[p]; p++) {
+        snprintf(pattern, sizeof(pattern), "%s/%s", dir, patterns[p]);
+        long long t0 = now_ns();
+        size_t libc_matches = 0;
+        for (int r = 0; r < reps; r++) {
+            glob_t g;
+            if (glob(pattern, 0, NULL, &g) == 0) libc_matches = g.gl_pathc;
+            globfree(&g);
+        }
+        long long libc_ns = (now_ns() - t0) / reps;
+
+        long long mode_ns[2];
+        int matches = 0;
+        for (int warm = 0; warm < 2; warm++) {
+            long long elapsed = 0;
+            for (int r = 0; r < reps; r++) {
+                if (!warm) glob_cache_clear();
+                snprintf(line, sizeof(line), "echo %s", pattern);
+                int count;
+                long long t = now_ns();
+                cmd_t **cmds = split_parallel_commands(line, &count);
+                elapsed += now_ns() - t;
+                matches = 0;
+                for (char **a = cmds && count == 1 ? cmds[0]->argv + 1 : NULL; a && *a; a++) {
+                    if (strcmp(*a, pattern) != 0) matches++;  // Sin coincidencias queda el patrón
+                }
+                arena_reset(&line_arena);
+            }
+            mode_ns[warm] = elapsed / reps;
+        }
+        printf("{\"bench\":\"glob\",\"files\":%ld,\"pattern\":\"%s\",\"matches\":%d,\"libc_matches\":%zu,"
+               "\"libc_ms\":%.3f,\"cold_ms\":%.3f,\"cached_ms\":%.3f,"
+               "\"speedup_cold\":%.2f,\"speedup_cached\":%.2f}\n",
+               files, patterns[p], matches, libc_matches, libc_ns / 1e6, mode_ns[0] / 1e6, mode_ns[1] / 1e6,
+               (double)libc_ns / mode_ns[0], (double)libc_ns / mode_ns[1]);
+    }
+    glob_cache_clear();
+
+    // Limpiar
+    for (long i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "f%06ld.%s", i, exts[i % 4]);
+        unlinkat(dfd, name, 0);
+    }
+    close(dfd);
+    rmdir(dir);
+}
+
+// Correr las suites pedidas con --bench y terminar
+static void run_benchmarks(void) {
+    if (!mkdtemp(bench_dir)) {
+        util_print_error();
+        exit(1);
+    }
+    char *defaults[] = { "/bin", "/usr/bin" };
+    update_path(defaults, 2);
+
+    printf("{\"bench\":\"meta\",\"cpus\":%ld,\"jobs_limit\":%ld,\"spawn\":\"%s\",\"iters\":%ld}\n",
+           sysconf(_SC_NPROCESSORS_ONLN), jobs_limit,
+           spawn_backend == SPAWN_FORK ? "fork" : "posix", bench_iters);
+    fflush(stdout);
+    if (bench_selected("parse")) bench_parse();
+    fflush(stdout);
+    if (bench_selected("lookup")) bench_lookup();
+    fflush(stdout);
+    if (bench_selected("spawn")) bench_spawn();
+    fflush(stdout);
+    if (bench_selected("e2e")) bench_e2e();
+    fflush(stdout);
+    if (bench_selected("cpu")) bench_cpu();
+    fflush(stdout);
+    if (bench_selected("complete")) bench_complete();
+    fflush(stdout);
+    if (bench_selected("glob")) bench_glob();
+    rmdir(bench_dir);
+    exit(0);
+}
+
+// Procesar las opciones de línea de comandos (antes del archivo batch)
+// --spawn=posix|fork : backend para crear procesos (por defecto posix)
+// -j N, --jobs=N     : máximo de comandos paralelos simultáneos (por defecto #CPUs)
+// --splice           : mover la salida de '>' al archivo con splice() desde el shell
+// --stats FILE       : escribir un registro JSON (tiempos, rusage, estado) por comando
+// --parallel-batch   : ejecutar en paralelo las líneas independientes del batch
+// --trace FILE       : trazas del camino crítico en formato Chrome (al salir o con SIGUSR1)
+// --keep-order, --tag, --capture-mem BYTES : capturar y ordenar la salida por comando
+// --cache DIR, --cache-max BYTES : caché de resultados del prefijo 'cache'
+// --affinity rr|numa|none, --nice N, --ioprio CLASE[:N], --rlimit RES:N :
+//                      colocación y prioridad de los hijos (ver 'opts')
+// --external-utils   : echo, true, pwd, sleep, ... siempre como procesos externos
+// --timeout SECS     : límite de tiempo por comando (SIGTERM y luego SIGKILL al grupo)
+// --journal FILE     : registrar cada línea terminada del batch (offset, estados, cwd, PATH)
+// --resume           : con --journal, continuar el batch desde la primera línea sin terminar
+// --serve SOCKET, --client SOCKET : ejecutar batches en un servidor persistente
+// --bench[=SUITES]   : correr benchmarks internos (parse,lookup,spawn,e2e,cpu,complete,glob) y salir
+// --bench-iters N    : iteraciones base de los benchmarks
+// Retorna: índice en argv del primer argumento que no es opción
+static int parse_options(int argc, char *argv[]) {
+    static const struct option long_opts[] = {
+        {"spawn", required_argument, NULL, 'S'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"splice", no_argument, NULL, 'P'},
+        {"stats", required_argument, NULL, 'T'},
+        {"trace", required_argument, NULL, 'R'},
+        {"parallel-batch", no_argument, NULL, 'L'},
+        {"keep-order", no_argument, NULL, 'K'},
+        {"tag", no_argument, NULL, 'G'},
+        {"capture-mem", required_argument, NULL, 'M'},
+        {"cache", required_argument, NULL, 'D'},
+        {"cache-max", required_argument, NULL, 'X'},
+        {"affinity", required_argument, NULL, 'A'},
+        {"nice", required_argument, NULL, 'N'},
+        {"ioprio", required_argument, NULL, 'O'},
+        {"rlimit", required_argument, NULL, 'U'},
+        {"external-utils", no_argument, NULL, 'E'},
+        {"timeout", required_argument, NULL, 'W'},
+        {"journal", required_argument, NULL, 'J'},
+        {"resume", no_argument, NULL, 'Q'},
+        {"serve", required_argument, NULL, 'V'},
+        {"client", required_argument, NULL, 'C'},
+        {"bench", optional_argument, NULL, 'B'},
+        {"bench-iters", required_argument, NULL, 'I'},
+        {NULL, 0, NULL, 0}
+    };
+
+    opterr = 0;  // Los errores se reportan con el mensaje único del shell
+    int opt;
+    // '+': detenerse en el primer argumento que no es opción (el archivo batch)
+    while ((opt = getopt_long(argc, argv, "+j:", long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'S':
+            if (strcmp(optarg, "posix") == 0) {
+                spawn_backend = SPAWN_POSIX;
+            } else if (strcmp(optarg, "fork") == 0) {
+                spawn_backend = SPAWN_FORK;
+            } else {
+                util_print_error();
+                exit(1);
+            }
+            break;
+        case 'P':
+            splice_mode = 1;
+            break;
+        case 'T':
+            stats_file = fopen(optarg, "we");
+            if (!stats_file) {
+                util_print_error();
+                exit(1);
+            }
+            break;
+        case 'R':
+            trace_init(optarg);
+            break;
+        case 'L':
+            parallel_batch = 1;
+            break;
+        case 'K':
+            keep_order = 1;
+            break;
+        case 'G':
+            tag_output = 1;
+            break;
+        case 'M': {
+            char *end;
+            errno = 0;
+            unsigned long long bytes = strtoull(optarg, &end, 10);
+            if (end == optarg || *end || errno || optarg[0] == '-') {
+                util_print_error();
+                exit(1);
+            }
+            capture_budget = (size_t)bytes;
+            break;
+        }
+        case 'D':
+            cache_path = optarg;
+            break;
+        case 'X': {
+            char *end;
+            errno = 0;
+            cache_max = strtoull(optarg, &end, 10);
+            if (end == optarg || *end || errno || optarg[0] == '-') {
+                util_print_error();
+                exit(1);
+            }
+            break;
+        }
+        case 'A':
+        case 'N':
+        case 'O':
+        case 'U': {
+            const char *key = opt == 'A' ? "affinity" : opt == 'N' ? "nice" :
+                              opt == 'O' ? "ioprio" : "rlimit";
+            if (place_set(&place_defaults, key, optarg) == -1) {
+                util_print_error();
+                exit(1);
+            }
+            place_current = place_defaults;
+            break;
+        }
+        case 'E':
+            external_utils = 1;
+            break;
+        case 'W': {
+            double secs = parse_duration(optarg);
+            if (secs < 0) {
+                util_print_error();
+                exit(1);
+            }
+            timeout_default_ns = secs < 9e9 ? (long long)(secs * 1e9) : 0;
+            break;
+        }
+        case 'J':
+            journal_path = optarg;
+            break;
+        case 'Q':
+            journal_resume = 1;
+            break;
+        case 'V':
+            serve_path = optarg;
+            break;
+        case 'C':
+            client_path = optarg;
+            break;
+        case 'B':
+            bench_suites = optarg ? optarg : "all";
+            break;
+        case 'I': {
+            char *end;
+            errno = 0;
+            bench_iters = strtol(optarg, &end, 10);
+            if (*end || errno || bench_iters < 1) {
+                util_print_error();
+                exit(1);
+            }
+            break;
+        }
+        case 'j': {
+            char *end;
+            errno = 0;
+            jobs_limit = strtol(optarg, &end, 10);
+            if (*end || errno || jobs_limit < 1) {
+                util_print_error();
+                exit(1);
+            }
+            break;
+        }
+        default:  // Opción desconocida o sin su argumento
+            util_print_error();
+            exit(1);
+        }
+    }
+    return optind;
 }
 
 int main(int argc, char *argv[]) {
+    int first_arg = parse_options(argc, argv);
+    int nargs = argc - first_arg;
+
     // Verificar argumentos: debe ser "./gtesh" o "./gtesh archivo.txt"
     // Más de 1 argumento -> error y exit(1)
-    if (argc > 2) {
+    if (nargs > 1 || (journal_resume && !journal_path)) {  // --resume necesita --journal
         util_print_error();
         exit(1);
     }
 
+    // ====== MODO CLIENTE (--client SOCKET): el batch lo ejecuta el servidor ======
+    if (client_path) {
+        run_client(nargs == 1 ? argv[first_arg] : NULL);  // No retorna
+    }
+
     // Inicializar PATH con /bin 
     init_path();
+    builtin_init();  // Tabla de builtins, utilidades internas y plugins
+    if (cache_path) cache_init();  // --cache DIR
 
-    // ====== MODO BATCH (si se pasó un archivo) ======
-    if (argc == 2) {
-        FILE *batch = fopen(argv[1], "r");  // Abrir archivo batch
-        if (!batch) {  // Archivo no existe o no se puede abrir
+    // ====== MODO SERVIDOR (--serve SOCKET) ======
+    // Cada worker crea su propio planificador (sched_init) después del fork
+    if (serve_path) {
+        if (nargs > 0) {  // --serve no lee comandos
             util_print_error();
-            exit(1);  // Salir con código 1 (según enunciado)
+            exit(1);
         }
+        run_server();  // No retorna
+    }
 
-        char *line = NULL;  // Buffer para getline (se aloca automáticamente)
-        size_t len = 0;     // Tamaño del buffer
-        ssize_t read;       // Número de bytes leídos
-
-        // Leer línea por línea del archivo
-        while ((read = getline(&line, &len, batch)) != -1) {
-            // Eliminar newline al final si existe
-            if (read > 0 && line[read-1] == '\n') {
-                line[read-1] = '\0';
-            }
+    sched_init();  // epoll para esperar hijos y límite de jobs
 
-            // Parsear la línea en comandos (puede haber varios con &)
-            int cmd_count;
-            cmd_t **cmds = split_parallel_commands(line, &cmd_count);
-            if (cmds) {
-                // Ejecutar cada comando (se lanzan en paralelo si hay &)
-                for (int i = 0; i < cmd_count; i++) {
-                    if (execute_command(cmds[i]) == -1) {
-                        // Error ejecutando comando: continuar con el siguiente
-                        continue;
-                    }
-                }
-                // Esperar a que terminen TODOS los comandos lanzados
-                wait_for_children();
-                
-                // Liberar memoria de todos los comandos
-                for (int i = 0; i < cmd_count; i++) {
-                    free_command(cmds[i]);
-                }
-                free(cmds);
-            }
+    // ====== MODO BENCHMARK ======
+    if (bench_suites) {
+        if (nargs > 0) {  // --bench no lee comandos
+            util_print_error();
+            exit(1);
         }
+        run_benchmarks();  // No retorna
+    }
 
-        free(line);   // Liberar buffer de getline
-        fclose(batch);
-        exit(0);  // Terminar con código 0 (batch exitoso)
+    // ====== MODO BATCH (si se pasó un archivo, o stdin no es una terminal) ======
+    // "-" como archivo, o una entrada por pipe (cmd | ./gtesh), leen de stdin
+    if (nargs == 1 || !isatty(STDIN_FILENO)) {
+        batch_reader_t batch;
+        if (batch_open(&batch, nargs == 1 ? argv[first_arg] : NULL) == -1) {
+            // Archivo no existe o no se puede abrir
+            util_print_error();
+            exit(1);  // Salir con código 1 (según enunciado)
+        }
+        if (journal_path) journal_open(&batch, nargs == 1 ? argv[first_arg] : "-");
+        run_batch(&batch);  // No retorna
     }
 
     // ====== MODO INTERACTIVO (con readline para edición de línea) ======
+    if (journal_path) {  // El journal registra líneas de un batch
+        util_print_error();
+        exit(1);
+    }
     // Imprimir banner de bienvenida
     printf("\n\033[1;35m╔═══════════════════════════════════╗\033[0m\n");
     printf("\033[1;35m║\033[1;36m    ✦ GTESH Shell v1.0 ✦           \033[1;35m║\033[0m\n");
@@ -487,6 +6652,14 @@ int main(int argc, char *argv[]) {
     printf("\033[1;35m╚═══════════════════════════════════╝\033[0m\n\n");
     
     char *line = NULL;
+    rl_attempted_completion_function = compl_readline;  // Tab: comandos del PATH
+    compl_sync();  // Indexar el PATH ahora y no en el primer Tab
+
+    // Con control de jobs, '&' devuelve el prompt de inmediato (ver jc_loop)
+    if (jc_init() == 0) {
+        jc_loop();
+        exit(0);
+    }
 
     while (1) {  // Bucle infinito hasta EOF o exit
         // readline() lee con edición interactiva (flechas, historial, etc.)
@@ -509,24 +6682,7 @@ int main(int argc, char *argv[]) {
         }
 
         // Parsear y ejecutar (igual que en modo batch)
-        int cmd_count;
-        cmd_t **cmds = split_parallel_commands(line, &cmd_count);
-        if (cmds) {
-            for (int i = 0; i < cmd_count; i++) {
-                if (execute_command(cmds[i]) == -1) {
-                    // Error: continuar (mostrar prompt de nuevo)
-                    continue;
-                }
-            }
-            // Esperar todos los comandos paralelos
-            wait_for_children();
-            
-            // Liberar memoria
-            for (int i = 0; i < cmd_count; i++) {
-                free_command(cmds[i]);
-            }
-            free(cmds);
-        }
+        run_line(line);
     }
 
     free(line);  // Liberar buffer de getline
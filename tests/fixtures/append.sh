@@ -0,0 +1,3 @@
+#!/bin/sh
+# append.sh ARCHIVO N: agrega N al final de ARCHIVO (no es idempotente)
+echo "$2" >> "$1"
@@ -0,0 +1,8 @@
+#!/bin/sh
+# La primera vez (sin .once junto al script) deja su pid en $BLOCK_PID y
+# se queda esperando a que run.sh mate al shell; después no hace nada
+once=$(dirname "$0")/.once
+[ -e "$once" ] && exit 0
+: > "$once"
+echo $$ > "$BLOCK_PID"
+exec sleep 30
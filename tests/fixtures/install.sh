@@ -0,0 +1,4 @@
+#!/bin/sh
+# Instala first/hello, que tapa a second/hello en el path
+printf '#!/bin/sh\necho first\n' > first/hello
+chmod +x first/hello
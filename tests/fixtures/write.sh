@@ -0,0 +1,3 @@
+#!/bin/sh
+# Escribe "new" en el archivo que recibe como argumento (no por '>')
+echo new > "$1"
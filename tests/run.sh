@@ -0,0 +1,146 @@
+#!/bin/sh
+# Pruebas de regresión de gtesh en modo batch
+#
+# Cada caso corre un batch de tests/ de dos maneras que deben dar lo mismo
+# (o contra una salida esperada *.out) y compara stdout, stderr, el estado
+# de salida y los archivos que quedaron en el directorio de trabajo:
+#   utils    - utilidades internas (rm, mkdir, echo, ...) vs --external-utils
+#   parallel - --parallel-batch vs ejecución secuencial
+#   resume   - batch matado con kill -9 y retomado con --resume vs completo
+#              (secuencial y con --parallel-batch)
+#   path     - caché de ejecutables: binarios nuevos y borrados en el path
+#   timeout  - prefijo 'timeout' corta el comando y el batch sigue
+#
+# Uso: tests/run.sh [caso...]
+# Con GTESH=ruta usa ese binario; si no, compila src/project.c con $CC.
+
+TESTS=$(cd "$(dirname "$0")" && pwd)
+TMP=$(mktemp -d "${TMPDIR:-/tmp}/gtesh-tests.XXXXXX") || exit 1
+trap 'rm -rf "$TMP"' EXIT
+export LC_ALL=C
+
+if [ -z "$GTESH" ]; then
+    GTESH=$TMP/gtesh
+    ${CC:-gcc} -Wall -Wextra -O2 "$TESTS/../src/project.c" -o "$GTESH" -lreadline || exit 1
+fi
+
+WORK=$TMP/work  # Siempre la misma ruta: pwd y mensajes iguales entre corridas
+failed=0
+
+# Archivos y directorios del directorio de trabajo con el contenido de cada archivo
+snapshot() {
+    (cd "$WORK" && find . -mindepth 1 ! -name .once | sort | while read -r f; do
+        if [ -d "$f" ]; then
+            echo "d $f $(stat -c %a "$f")"
+        else
+            echo "f $f $(cksum < "$f")"
+        fi
+    done)
+}
+
+# Directorio de trabajo nuevo con los archivos de fixtures/
+fresh() {
+    rm -rf "$WORK"
+    cp -R "$TESTS/fixtures" "$WORK"
+}
+
+# run RESULTADO BATCH [opciones de gtesh...]: correr en $WORK y guardar
+# RESULTADO.out, .err, .rc y .tree
+run() {
+    res=$TMP/$1 batch=$TESTS/$2
+    shift 2
+    (cd "$WORK" && "$GTESH" "$@" "$batch" < /dev/null > "$res.out" 2> "$res.err"; echo $? > "$res.rc")
+    snapshot > "$res.tree"
+}
+
+# same CASO A B [sorted]: comparar dos resultados (sorted: stdout sin orden)
+same() {
+    name=$1 a=$TMP/$2 b=$TMP/$3
+    if [ "$4" = sorted ]; then
+        sort "$a.out" > "$a.out.s" && mv "$a.out.s" "$a.out"
+        sort "$b.out" > "$b.out.s" && mv "$b.out.s" "$b.out"
+    fi
+    ok=1
+    for ext in out err rc tree; do
+        if ! cmp -s "$a.$ext" "$b.$ext"; then
+            [ $ok = 1 ] && echo "FAIL $name"
+            ok=0
+            diff -u "$a.$ext" "$b.$ext" | sed 's/^/    /'
+        fi
+    done
+    if [ $ok = 1 ]; then echo "ok   $name"; else failed=1; fi
+}
+
+# expect CASO RESULTADO: stdout igual a CASO.out, sin stderr y estado 0
+expect() {
+    name=$1 res=$TMP/$2
+    cp "$TESTS/$1.out" "$TMP/$1.expected.out"
+    : > "$TMP/$1.expected.err"
+    echo 0 > "$TMP/$1.expected.rc"
+    cp "$res.tree" "$TMP/$1.expected.tree"
+    same "$1" "$1.expected" "$2"
+}
+
+# Correr BATCH con --journal hasta que block.sh se bloquea, matar el shell
+# con kill -9 y retomarlo con --resume
+run_killed() {
+    res=$1 batch=$2
+    shift 2
+    rm -f "$TMP/journal" "$TMP/block.pid"
+    (cd "$WORK" && BLOCK_PID=$TMP/block.pid exec "$GTESH" --journal "$TMP/journal" "$@" \
+        "$TESTS/$batch" > /dev/null 2>&1) &
+    shell=$!
+    i=0
+    while [ ! -s "$TMP/block.pid" ] && [ $i -lt 100 ]; do sleep 0.1; i=$((i + 1)); done
+    kill -9 $shell 2> /dev/null
+    wait $shell 2> /dev/null
+    [ -s "$TMP/block.pid" ] && kill "$(cat "$TMP/block.pid")" 2> /dev/null
+    run "$res" "$batch" --journal "$TMP/journal" --resume "$@"
+}
+
+case_utils() {
+    fresh; run utils.inproc utils.txt
+    fresh; run utils.external utils.txt --external-utils
+    same utils utils.external utils.inproc
+}
+
+case_parallel() {
+    fresh; run parallel.seq parallel.txt -j 4
+    fresh; run parallel.par parallel.txt -j 4 --parallel-batch
+    same parallel parallel.seq parallel.par sorted
+}
+
+case_resume() {
+    for mode in seq par; do
+        opt=
+        [ $mode = par ] && opt=--parallel-batch
+        fresh; : > "$WORK/.once"
+        rm -f "$TMP/journal"
+        run resume.full resume.txt --journal "$TMP/journal" $opt
+        fresh; run_killed resume.killed resume.txt $opt
+        same "resume ($mode)" resume.full resume.killed sorted
+    done
+}
+
+case_path() {
+    fresh; run path.run path.txt
+    expect path path.run
+}
+
+case_timeout() {
+    fresh
+    start=$(date +%s)
+    run timeout.run timeout.txt
+    if [ $(($(date +%s) - start)) -ge 5 ]; then
+        echo "FAIL timeout: el batch tardó más de 5 s"
+        failed=1
+    else
+        expect timeout timeout.run
+    fi
+}
+
+cases=${*:-utils parallel resume path timeout}
+for c in $cases; do
+    case_$c
+done
+exit $failed